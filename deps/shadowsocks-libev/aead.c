@@ -703,6 +703,130 @@ aead_decrypt(buffer_t *ciphertext, cipher_ctx_t *cipher_ctx, size_t capacity)
     return CRYPTO_OK;
 }
 
+/*
+ * Encrypt one chunk of plaintext straight into ciphertext, after the salt
+ * when the stream starts, skipping the copies of aead_encrypt. ciphertext
+ * has room for key_len + 2 * tag_len + CHUNK_SIZE_LEN + plen bytes.
+ */
+int
+aead_encrypt_chunk(cipher_ctx_t *cipher_ctx, char *plaintext, size_t plen,
+                   char *ciphertext, size_t *clen)
+{
+    if (cipher_ctx == NULL || plen > CHUNK_SIZE_MASK)
+        return CRYPTO_ERROR;
+
+    cipher_t *cipher = cipher_ctx->cipher;
+    size_t salt_ofst = 0;
+    int err;
+
+    *clen = 0;
+    if (plen == 0)
+        return CRYPTO_OK;
+
+    if (!cipher_ctx->init) {
+        salt_ofst = cipher->key_len;
+        memcpy(ciphertext, cipher_ctx->salt, salt_ofst);
+        aead_cipher_ctx_set_key(cipher_ctx, 1);
+        cipher_ctx->init = 1;
+
+        ppbloom_add((void *)cipher_ctx->salt, salt_ofst);
+    }
+
+    err = aead_chunk_encrypt(cipher_ctx, (uint8_t *)plaintext,
+                             (uint8_t *)ciphertext + salt_ofst,
+                             cipher_ctx->nonce, plen);
+    if (err)
+        return err;
+
+    *clen = salt_ofst + 2 * cipher->tag_len + CHUNK_SIZE_LEN + plen;
+
+    return CRYPTO_OK;
+}
+
+/*
+ * The salt of the stream has passed its check, aead_decrypt_chunks applies
+ */
+int
+aead_ctx_ready(cipher_ctx_t *cipher_ctx)
+{
+    return cipher_ctx != NULL && cipher_ctx->init == 2 && cipher_ctx->chunk != NULL;
+}
+
+/*
+ * The crypto is of an AEAD method
+ */
+int
+aead_is_crypto(crypto_t *crypto)
+{
+    return crypto->encrypt == aead_encrypt;
+}
+
+/*
+ * The most ciphertext to pass to aead_decrypt or aead_decrypt_chunks, so that
+ * with what is buffered all its chunks fit in capacity. capacity holds a full
+ * chunk, so the room is never 0.
+ */
+size_t
+aead_decrypt_room(cipher_ctx_t *cipher_ctx, size_t capacity)
+{
+    size_t overhead = 2 * cipher_ctx->cipher->tag_len + CHUNK_SIZE_LEN;
+    size_t buffered = cipher_ctx->chunk ? cipher_ctx->chunk->len : 0;
+
+    // The salt is still buffered ahead of the first chunk
+    if (!cipher_ctx->init)
+        overhead += cipher_ctx->cipher->key_len;
+
+    if (capacity + overhead <= buffered)
+        return 0;
+
+    return min(capacity + overhead - buffered, capacity);
+}
+
+/*
+ * Decrypt all the chunks of a stream past its salt check straight into
+ * plaintext, skipping the copies of aead_decrypt. plaintext may be the
+ * ciphertext buffer. clen is at most aead_decrypt_room, only a partial
+ * chunk stays buffered.
+ */
+int
+aead_decrypt_chunks(cipher_ctx_t *cipher_ctx, char *ciphertext, size_t clen,
+                    char *plaintext, size_t *plen, size_t capacity)
+{
+    if (!aead_ctx_ready(cipher_ctx))
+        return CRYPTO_ERROR;
+
+    buffer_t *chunk = cipher_ctx->chunk;
+    size_t overhead = 2 * cipher_ctx->cipher->tag_len + CHUNK_SIZE_LEN;
+
+    brealloc(chunk, chunk->len + clen, capacity);
+    memcpy(chunk->data + chunk->len, ciphertext, clen);
+    chunk->len += clen;
+
+    *plen = 0;
+    while (chunk->len > 0) {
+        size_t chunk_clen = chunk->len;
+        size_t chunk_plen = 0;
+        int err;
+
+        // Only when more than aead_decrypt_room was passed
+        if (chunk->len > overhead && chunk->len - overhead > capacity - *plen)
+            return CRYPTO_ERROR;
+
+        err = aead_chunk_decrypt(cipher_ctx, (uint8_t *)plaintext + *plen,
+                                 (uint8_t *)chunk->data, cipher_ctx->nonce,
+                                 &chunk_plen, &chunk_clen);
+        if (err == CRYPTO_ERROR)
+            return err;
+        if (err == CRYPTO_NEED_MORE)
+            break;
+
+        chunk->len = chunk_clen;
+        *plen     += chunk_plen;
+    }
+
+    return *plen == 0 ? CRYPTO_NEED_MORE : CRYPTO_OK;
+}
+
 cipher_t *
 aead_key_init(int method, const char *pass, const char *key)
 {
@@ -38,6 +38,11 @@ int aead_decrypt_all(buffer_t *, cipher_t *, size_t);
 
 int aead_encrypt(buffer_t *, cipher_ctx_t *, size_t);
 int aead_decrypt(buffer_t *, cipher_ctx_t *, size_t);
+int aead_encrypt_chunk(cipher_ctx_t *, char *, size_t, char *, size_t *);
+int aead_decrypt_chunks(cipher_ctx_t *, char *, size_t, char *, size_t *, size_t);
+size_t aead_decrypt_room(cipher_ctx_t *, size_t);
+int aead_ctx_ready(cipher_ctx_t *);
+int aead_is_crypto(crypto_t *);
 
 void aead_ctx_init(cipher_t *, cipher_ctx_t *, int);
 void aead_ctx_release(cipher_ctx_t *);
@@ -373,7 +373,7 @@ static void tcpClientOnConnect(void *data, int status) {
         exit(EXIT_ERR);
     }
 
-    LOGD("TCP client %s connect success", conn->addrinfo);
+    LOGD("TCP client %s connect success", netFormatSock(conn->fd));
     LOGI("TCP client current count: %d", app->liveclients);
 
     tcpClientReset(client);
@@ -393,7 +393,7 @@ static void tcpClientOnError(void *data) {
     tcpClient *client = data;
     tcpConn *conn = client->conn;
 
-    LOGW("TCP client %s %s error: %s", conn->addrinfo,
+    LOGW("TCP client %s %s error: %s", netFormatSock(conn->fd),
          conn->err == TCP_ERROR_READ ? "read" : "write", conn->errstr);
 }
 
@@ -402,9 +402,9 @@ static void tcpClientOnTimeout(void *data) {
     tcpConn *conn = client->conn;
 
     if (tcpIsConnected(conn))
-        LOGI("TCP client %s read timeout", conn->addrinfo);
+        LOGI("TCP client %s read timeout", netFormatSock(conn->fd));
     else
-        LOGE("TCP client %s connect timeout", conn->addrinfo);
+        LOGE("TCP client %s connect timeout", netFormatSock(conn->fd));
 }
 
 static void tcpClientOnRead(void *data) {
@@ -0,0 +1,249 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "lib/protocol/tcp_shadowsocks.h"
+
+#include "shadowsocks-libev/aead.h"
+
+#include <getopt.h>
+#include <sys/wait.h>
+
+enum {
+    GETOPT_VAL_KEY = 300,
+};
+
+enum {
+    RELAY_GENERIC = 0,
+    RELAY_SPECIALIZED = 1,
+};
+
+#define MB_UNIT (1024*1024)
+
+typedef struct bench {
+    char *password;
+    char *method;
+    char *key;
+    int size; // MB of the stream relayed by each path
+    crypto_t *crypto;
+} bench;
+
+static bench b;
+static bench *app = &b;
+
+static void initBench();
+static void parseOptions(int argc, char *argv[]);
+static void usage();
+static double benchmark(int path);
+static void encryptStream(int fd, int path);
+static uint64_t decryptStream(int fd, int path);
+
+int main(int argc, char *argv[]) {
+    double generic, specialized;
+
+    initBench();
+    parseOptions(argc, argv);
+
+    app->crypto = crypto_init(app->password, app->key, app->method);
+    if (!app->crypto) FATAL("Failed to initialize ciphers");
+    if (!aead_is_crypto(app->crypto)) FATAL("Only AEAD methods have a specialized relay");
+
+    LOGI("Use crypto method: %s", app->method);
+    LOGI("Use stream size: %dMB", app->size);
+
+    generic = benchmark(RELAY_GENERIC);
+    specialized = benchmark(RELAY_SPECIALIZED);
+
+    LOGIR("\n====== RELAY %s ======\n", app->method);
+    LOGIR("  generic:     %.2f MB/s\n", app->size / generic);
+    LOGIR("  specialized: %.2f MB/s (%+.1f%%)\n", app->size / specialized,
+          (generic / specialized - 1) * 100);
+
+    return EXIT_OK;
+}
+
+static void initBench() {
+    app->password = "foobar";
+    app->method = "chacha20-ietf-poly1305";
+    app->key = NULL;
+    app->size = 1024;
+
+    setupSigsegvHandlers();
+
+    logger *log = getLogger();
+    log->level = LOGLEVEL_INFO;
+    log->color_enabled = 1;
+    log->syslog_ident = "xs-benchmark-relay";
+}
+
+static void parseOptions(int argc, char *argv[]) {
+    int help = 0;
+    int opt;
+
+    struct option long_options[] = {
+        { "help",  no_argument,        NULL, 'h'            },
+        { "key",   required_argument,  NULL, GETOPT_VAL_KEY },
+        { NULL,    0,                  NULL, 0              },
+    };
+
+    while ((opt = getopt_long(argc, argv, "k:m:n:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'k': app->password = optarg; break;
+            case 'm': app->method = optarg; break;
+            case 'n': app->size = atoi(optarg); break;
+            case 'h': help = 1; break;
+            case GETOPT_VAL_KEY: app->key = optarg; break;
+            case '?':
+            default: help = 1; break;
+        }
+    }
+
+    if (help || app->size <= 0) {
+        usage();
+        exit(EXIT_ERR);
+    }
+}
+
+static void usage() {
+    printf("Usage: xs-benchmark-relay [options]\n\n"
+           "Options:\n"
+           " [-k <password>]          Password (default foobar)\n"
+           " [-m <encrypt_method>]    AEAD encrypt method (default chacha20-ietf-poly1305)\n"
+           " [--key <key_in_base64>]  Key (default null)\n"
+           " [-n <size>]              MB relayed by each path (default 1024)\n"
+           " [-h, --help]             Print this help\n");
+}
+
+/*
+ The encrypting side of the relay runs in a child, which writes the stream to a
+ socket pair, and the parent reads and decrypts it as the other side would. Returns
+ the seconds the whole stream took.
+ */
+static double benchmark(int path) {
+    int fds[2];
+    pid_t pid;
+    uint64_t start, total;
+    double duration;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) FATAL("Socket pair error: %s", STRERR);
+
+    start = timerStart();
+    if ((pid = fork()) == -1) FATAL("Fork error: %s", STRERR);
+    if (pid == 0) {
+        close(fds[1]);
+        encryptStream(fds[0], path);
+        exit(EXIT_OK);
+    }
+
+    close(fds[0]);
+    total = decryptStream(fds[1], path);
+    duration = timerStop(start, SECOND_UNIT, NULL);
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+
+    if (total != (uint64_t)app->size * MB_UNIT)
+        FATAL("Relay stream broken after %llu bytes", (unsigned long long)total);
+
+    return duration;
+}
+
+/*
+ A chunk at a time, as tcpShadowsocksConnWrite and tcpShadowsocksStreamWrite do
+ */
+static void encryptStream(int fd, int path) {
+    char plain[SHADOWSOCKS_CHUNK_MAX];
+    ioBuf *wbuf = ioBufNew(SOCKS5_ADDR_MAX_LEN + SHADOWSOCKS_CHUNK_MAX + SHADOWSOCKS_TAILROOM,
+                           SOCKS5_ADDR_MAX_LEN);
+    cipher_ctx_t ctx;
+    uint64_t left = (uint64_t)app->size * MB_UNIT;
+
+    memset(plain, 'x', sizeof(plain));
+    app->crypto->ctx_init(app->crypto->cipher, &ctx, 1);
+
+    while (left > 0) {
+        int len = (int)MIN(left, sizeof(plain));
+        size_t clen;
+
+        if (path == RELAY_GENERIC) {
+            ioBufReset(wbuf, SOCKS5_ADDR_MAX_LEN);
+            ioBufAppend(wbuf, plain, len);
+
+            buffer_t tmp_buf = {.idx = 0,
+                                .len = wbuf->len,
+                                .capacity = wbuf->len + IOBUF_TAILROOM(wbuf),
+                                .data = IOBUF_DATA(wbuf)};
+            if (app->crypto->encrypt(&tmp_buf, &ctx, tmp_buf.capacity)) FATAL("Encrypt error");
+            wbuf->len = tmp_buf.len;
+        } else {
+            ioBufReset(wbuf, 0);
+            if (aead_encrypt_chunk(&ctx, plain, len, IOBUF_DATA(wbuf), &clen)) FATAL("Encrypt error");
+            wbuf->len = clen;
+        }
+
+        while (wbuf->len > 0) {
+            ssize_t nwrite = write(fd, IOBUF_DATA(wbuf), wbuf->len);
+            if (nwrite <= 0) FATAL("Write error: %s", STRERR);
+            ioBufConsume(wbuf, nwrite);
+        }
+        left -= len;
+    }
+
+    app->crypto->ctx_release(&ctx);
+    ioBufRelease(wbuf);
+}
+
+/*
+ As tcpShadowsocksConnRead and tcpShadowsocksStreamRead do, returns the plaintext bytes
+ */
+static uint64_t decryptStream(int fd, int path) {
+    static char buf[NET_IOBUF_LEN];
+    buffer_t tmp_buf;
+    cipher_ctx_t ctx;
+    uint64_t total = 0;
+    ssize_t nread;
+
+    app->crypto->ctx_init(app->crypto->cipher, &ctx, 0);
+    balloc(&tmp_buf, NET_IOBUF_LEN);
+
+    /* Both paths read like the relay does, with its rbuf size */
+    for (;;) {
+        size_t plen;
+        int rc;
+
+        if (path == RELAY_SPECIALIZED && aead_ctx_ready(&ctx)) {
+            nread = read(fd, buf, aead_decrypt_room(&ctx, sizeof(buf)));
+            if (nread <= 0) break;
+            rc = aead_decrypt_chunks(&ctx, buf, nread, buf, &plen, sizeof(buf));
+        } else {
+            nread = read(fd, tmp_buf.data, NET_IOBUF_LEN);
+            if (nread <= 0) break;
+            tmp_buf.idx = 0;
+            tmp_buf.len = nread;
+            rc = app->crypto->decrypt(&tmp_buf, &ctx, NET_IOBUF_LEN);
+            plen = tmp_buf.len;
+        }
+
+        if (rc == CRYPTO_ERROR) break;
+        if (rc == CRYPTO_OK) total += plen;
+    }
+
+    bfree(&tmp_buf);
+    app->crypto->ctx_release(&ctx);
+
+    return total;
+}
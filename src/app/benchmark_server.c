@@ -134,7 +134,7 @@ tcpServer *tcpServerNew() {
     }
 
     char err[XS_ERR_LEN];
-    tcpListener *ln = tcpListen(err, app->el, app->host, app->port, server, tcpServerOnAccept);
+    tcpListener *ln = tcpListen(err, app->el, app->host, app->port, SOMAXCONN, server, tcpServerOnAccept);
     if (!ln) {
         LOGE(err);
         tcpServerFree(server);
@@ -158,8 +158,9 @@ static void tcpServerOnAccept(void *data) {
     tcpClient *client = tcpClientNew(server);
     if (client) {
         tcpConn *conn = client->conn;
-        LOGD("TCP server accepted client %s", conn->addrinfo_peer);
-        LOGI("TCP client current count: %d", ++server->client_count);
+        LOGD("TCP server accepted client %s", tcpGetAddrinfo(conn));
+        server->client_count++;
+        LOGI("TCP client current count: %d", server->client_count);
     }
 }
 
@@ -208,7 +209,8 @@ static void tcpClientOnClose(void *data) {
     tcpClient *client = data;
 
     LOGD("TCP client %s closed connection", CONN_GET_ADDRINFO(client->conn));
-    LOGD("TCP client current count: %d", --client->server->client_count);
+    client->server->client_count--;
+    LOGD("TCP client current count: %d", client->server->client_count);
 
     tcpClientFree(client);
 }
@@ -225,5 +227,5 @@ static void tcpClientOnTimeout(void *data) {
     tcpClient *client = data;
     tcpConn *conn = client->conn;
 
-    LOGI("TCP client %s read timeout", conn->addrinfo_peer);
+    LOGI("TCP client %s read timeout", tcpGetAddrinfo(conn));
 }
@@ -18,8 +18,12 @@
  */
 
 #include "module/module.h"
+#include "module/module_mux.h"
+#include "module/module_pool.h"
 #include "module/module_tcp.h"
 
+#include "lib/core/sockmap.h"
+#include "lib/protocol/resolver.h"
 #include "lib/protocol/tcp_shadowsocks.h"
 #include "lib/protocol/tcp_socks5.h"
 
@@ -36,7 +40,12 @@ static void tcpServerOnAccept(void *data);
 static void tcpClientOnRead(void *data);
 static void tcpRemoteOnConnect(void *data, int status);
 
+static void localRoute(tcpClient *client, char *host, int port, int atyp);
+static void localConnect(tcpClient *client, char *host, int port, int bypass, sockAddrEx *addrs,
+                         int naddrs);
+static void localOnResolved(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err);
 static int isBypass(char *ip);
+static int isBypassAddr(sockAddrEx *sa);
 
 static server s;
 module *app = (module *)&s;
@@ -66,19 +75,32 @@ static void localRun() {
 
     if (!s.ts) exit(EXIT_ERR);
     if (s.ts) LOGN("TCP server listen at: %s", s.ts->ln->addrinfo);
+
+    if (app->config->pool_size > 0)
+        app->pool = tcpPoolNew(app->config->remote_addr, app->config->remote_port,
+                               app->config->pool_size, app->config->pool_ttl);
+
+    if (app->config->mux > 0)
+        app->mux = tcpMuxNew(app->config->remote_addr, app->config->remote_port, app->config->mux);
+
+    if (app->config->sockmap) {
+        char err[XS_ERR_LEN];
+        if (sockmapInit(err, TCP_SOCKMAP_SIZE) == NET_ERR)
+            LOGW("Sockmap is disabled, bypass connections fall back to userland: %s", err);
+    }
 }
 
 static void localExit() {
+    sockmapFree();
+    tcpMuxFree(app->mux);
+    tcpPoolFree(app->pool);
     tcpServerFree(s.ts);
 }
 
 static void tcpServerOnAccept(void *data) {
     tcpServer *server = data;
     tcpClient *client = tcpClientNew(server, CONN_TYPE_SOCKS5, tcpClientOnRead);
-    if (client) {
-        LOGD("TCP server accepted client %s", CONN_GET_ADDRINFO(client->conn));
-        LOGD("TCP client current count: %d", ++server->client_count);
-    }
+    if (client) LOGD("TCP server accepted client %s", CONN_GET_ADDRINFO(client->conn));
 }
 
 static void tcpClientOnRead(void *data) {
@@ -93,57 +115,17 @@ static void tcpClientOnRead(void *data) {
     }
 
     if (!remote) {
-        int bypass = 0;
-        int host_match = 0;
-
         char host[HOSTNAME_MAX_LEN];
         int host_len = sizeof(host);
-        char ip[NET_IP_MAX_STR_LEN];
-        int ip_len = sizeof(ip);
         int port;
         int atyp;
 
         socks5AddrParse(conn_client->addrbuf_dest, sdslen(conn_client->addrbuf_dest), &atyp, host,
                         &host_len, &port);
 
-        if (app->config->acl) {
-            if (atyp == SOCKS5_ATYP_DOMAIN) host_match = acl_match_host(host);
-
-            if (host_match > 0) bypass = 1;
-            else if (host_match < 0) bypass = 0;
-            else {
-                int resolved = 0;
-
-                if (atyp != SOCKS5_ATYP_DOMAIN) {
-                    memcpy(ip, host, ip_len);
-                    resolved = 1;
-                } else if (anetResolve(NULL, host, ip, ip_len) == ANET_OK)
-                    resolved = 1;
-
-                if (resolved) bypass = isBypass(ip);
-            }
-        }
-
-        if (bypass) {
-            remote = tcpRemoteNew(client, CONN_TYPE_RAW, host, port, tcpRemoteOnConnect);
-
-            if (remote) LOGD("TCP client bypass dest addr: %s:%d", host, port);
-        } else {
-            remote = tcpRemoteNew(client, CONN_TYPE_SHADOWSOCKS, app->config->remote_addr,
-                                  app->config->remote_port, tcpRemoteOnConnect);
-
-            if (remote) {
-                tcpShadowsocksConnInit((tcpShadowsocksConn *)remote->conn, host, port);
-                LOGD("TCP client proxy dest addr: %s:%d", host, port);
-            }
-        }
-
-        if (!remote) {
-            tcpConnectionFree(client);
-            return;
-        }
-    } else {
-        tcpPipe(client->conn, remote->conn);
+        localRoute(client, host, port, atyp);
+    } else if (tcpConnectionPipe(client, client->conn, remote->conn) > 0) {
+        tcpConnectionSockmap(client);
     }
 }
 
@@ -161,6 +143,117 @@ static void tcpRemoteOnConnect(void *data, int status) {
     // Prepare pipe
     ADD_EVENT_READ(remote->conn);
     ADD_EVENT_READ(client->conn);
+    tcpConnectionSockmap(client);
+}
+
+/*
+ Route by the domain rules, then by the IP rules on the dest IP. A domain no rule
+ matches is looked up as acl_resolve says, the client stops reading while it waits.
+ */
+static void localRoute(tcpClient *client, char *host, int port, int atyp) {
+    sockAddrEx addrs[NET_CONNECT_MAX_ADDRS];
+    char err[XS_ERR_LEN];
+    int host_match = 0;
+    int naddrs;
+
+    if (!app->config->acl) {
+        localConnect(client, host, port, 0, NULL, 0);
+        return;
+    }
+
+    if (atyp == SOCKS5_ATYP_DOMAIN) host_match = acl_match_host(host);
+    if (host_match != 0 || app->config->acl_resolve == ACL_RESOLVE_PROXY) {
+        localConnect(client, host, port, host_match > 0, NULL, 0);
+        return;
+    }
+    if (atyp != SOCKS5_ATYP_DOMAIN) {
+        localConnect(client, host, port, isBypass(host), NULL, 0);
+        return;
+    }
+
+    // Cached and hosts answers come at once, the addresses are reused by a bypass connect
+    naddrs = resolverResolve(err, host, port, addrs, NET_CONNECT_MAX_ADDRS, localOnResolved,
+                             client, &client->query);
+    if (naddrs != 0) {
+        if (naddrs == NET_ERR) LOGD("TCP client resolve %s error: %s", host, err);
+        int bypass = naddrs > 0 && isBypassAddr(&addrs[0]);
+        localConnect(client, host, port, bypass, bypass ? addrs : NULL, bypass ? naddrs : 0);
+        return;
+    }
+
+    if (app->config->acl_resolve == ACL_RESOLVE_ASYNC)
+        localConnect(client, host, port, 0, NULL, 0);
+    else
+        DEL_EVENT_READ(client->conn);
+}
+
+/*
+ Connect the client directly or through the proxy, the client is freed on failure
+ */
+static void localConnect(tcpClient *client, char *host, int port, int bypass, sockAddrEx *addrs,
+                         int naddrs) {
+    tcpRemote *remote;
+
+    if (bypass) {
+        // Reuse the addresses resolved for the ACL rather than resolving again
+        if (naddrs > 0)
+            remote = tcpRemoteNewAddr(client, CONN_TYPE_RAW, host, addrs, naddrs,
+                                      tcpRemoteOnConnect);
+        else
+            remote = tcpRemoteNew(client, CONN_TYPE_RAW, host, port, tcpRemoteOnConnect);
+
+        if (remote) LOGD("TCP client bypass dest addr: %s:%d", host, port);
+    } else if (app->mux) {
+        // The client conn is carried by the mux stream from now on
+        if (tcpMuxOpen(app->mux, client->conn, host, port) == MUX_OK) {
+            LOGD("TCP client mux dest addr: %s:%d", host, port);
+            client->conn = NULL;
+        }
+        tcpConnectionFree(client);
+        return;
+    } else {
+        remote = tcpRemoteNew(client, CONN_TYPE_SHADOWSOCKS, app->config->remote_addr,
+                              app->config->remote_port, tcpRemoteOnConnect);
+
+        if (remote) {
+            tcpShadowsocksConnInit((tcpShadowsocksConn *)remote->conn, host, port);
+            LOGD("TCP client proxy dest addr: %s:%d", host, port);
+        }
+    }
+
+    if (!remote) tcpConnectionFree(client);
+}
+
+/*
+ In strict mode the client waits for the IP. In async mode the proxy is connecting
+ already, and is replaced by a direct conn while nothing has gone through it.
+ */
+static void localOnResolved(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err) {
+    tcpClient *client = data;
+    tcpRemote *remote = client->remote;
+    tcpSocks5Conn *conn_client = (tcpSocks5Conn *)client->conn;
+    int bypass = naddrs > 0 && isBypassAddr(&addrs[0]);
+
+    char dest[HOSTNAME_MAX_LEN];
+    int dest_len = sizeof(dest);
+    int port;
+
+    client->query = NULL;
+    if (naddrs == NET_ERR) LOGD("TCP client resolve %s error: %s", host, err);
+
+    socks5AddrParse(conn_client->addrbuf_dest, sdslen(conn_client->addrbuf_dest), NULL, dest,
+                    &dest_len, &port);
+
+    if (!remote) {
+        localConnect(client, dest, port, bypass, bypass ? addrs : NULL, bypass ? naddrs : 0);
+        return;
+    }
+
+    if (!bypass || remote->type != CONN_TYPE_SHADOWSOCKS || tcpIsConnected(remote->conn)) return;
+
+    LOGD("TCP client %s dest %s bypasses, switch to direct", CONN_GET_ADDRINFO(client->conn), dest);
+    tcpRemoteDrop(client);
+    localConnect(client, dest, port, 1, addrs, naddrs);
 }
 
 static int isBypass(char *ip) {
@@ -179,3 +272,10 @@ static int isBypass(char *ip) {
 
     return bypass;
 }
+
+static int isBypassAddr(sockAddrEx *sa) {
+    char ip[NET_IP_MAX_STR_LEN];
+
+    if (netIpPresentBySockAddr(NULL, ip, sizeof(ip), NULL, sa) == NET_ERR) return 0;
+    return isBypass(ip);
+}
@@ -18,9 +18,15 @@
  */
 
 #include "module.h"
+#include "module_dnscache.h"
+#include "module_fakeip.h"
+#include "module_limit.h"
+#include "module_reaper.h"
+#include "module_upstream.h"
 
 #include "lib/core/version.h"
 #include "lib/protocol/proxy.h"
+#include "lib/protocol/resolver.h"
 
 #include "shadowsocks-libev/ppbloom.h"
 
@@ -30,6 +36,8 @@ static module *mod;
 
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
+#define MODULE_EVENT_SIZE 10240
+
 static void moduleInit();
 static void moduleRun();
 static void moduleExit();
@@ -75,14 +83,44 @@ static void moduleInit(int type, moduleHook hook, module *m, int argc, char *arg
     if (config->daemonize) xs_daemonize();
     createPidFile();
 
-    mod->el = eventLoopNew(1024);
+    int nofile = setOpenFilesLimit(config->nofile);
+    if (config->nofile > 0 && nofile < config->nofile)
+        LOGW("Can't raise the max open files to %d, it is %d now", config->nofile, nofile);
+    config->nofile = nofile;
+
+    // The fd table grows on demand, don't allocate it all for a huge limit
+    mod->el = eventLoopNew(nofile > 0 ? MIN(nofile, MODULE_EVENT_SIZE) : MODULE_EVENT_SIZE);
     setupSignalHandlers();
 
     mod->crypto = crypto_init(mod->config->password, mod->config->key, mod->config->method);
     if (!mod->crypto) FATAL("Failed to initialize ciphers");
 
+    if (type != MODULE_SERVER) mod->upstreams = upstreamGroupNew(config, mod->crypto);
+    mod->reaper = idleReaperNew(config);
+    mod->limiter = rateLimiterNew(config);
+
+    // xs-tunnel assigns the fake IPs, xs-redir maps them back to the domains
+    if (config->fake_ip && (type == MODULE_TUNNEL || type == MODULE_REDIR)) {
+        char err[XS_ERR_LEN];
+        mod->fakeip = fakeIpPoolNew(err, config->fake_ip, config->fake_ip_map, type == MODULE_TUNNEL);
+        if (!mod->fakeip) FATAL(err);
+    }
+    if (type == MODULE_TUNNEL) mod->dnscache = dnsCacheNew(config);
+
     if (config->acl && init_acl(config->acl) < 0) FATAL("Failed to initialize acl");
 
+    if (config->outbound_addrs) {
+        char err[XS_ERR_LEN];
+        if (netOutboundSet(err, config->outbound_addrs) == NET_ERR) FATAL(err);
+    }
+
+    // Without a server of its own the lookups block in getaddrinfo as before
+    char err[XS_ERR_LEN];
+    if (resolverInit(err, mod->el, config->nameserver, config->dns_cache) == NET_ERR) {
+        if (config->nameserver) FATAL(err);
+        LOGW("Resolver init error: %s, use the system resolver", err);
+    }
+
     if (mod->hook.init) mod->hook.init();
 }
 
@@ -99,9 +137,35 @@ static void moduleRun() {
     if (config->ipv6_first) LOGI("Use IPv6 address first");
     // if (config->ipv6_only) LOGI("Use IPv6 address only");
     if (config->timeout) LOGI("Use timeout: %ds", config->timeout);
+    LOGI("Use connect timeout: %ds, handshake timeout: %ds, idle timeout: %ds",
+         config->connect_timeout, config->handshake_timeout, config->idle_timeout);
     if (config->acl) LOGI("Use acl file: %s", config->acl);
+    if (config->acl && mod->type == MODULE_LOCAL) {
+        static const char *modes[] = {"strict", "proxy", "async"};
+        LOGI("Use acl resolve mode: %s", modes[config->acl_resolve]);
+    }
+    if (config->pool_size) LOGI("Use remote pool size: %d, ttl: %ds", config->pool_size, config->pool_ttl);
+    if (config->mux) LOGI("Use mux sessions: %d", config->mux);
+    if (config->sockmap) LOGI("Enable sockmap relay for bypass connections");
+    if (config->sniff) LOGI("Enable TLS SNI and HTTP Host sniffing");
+    if (config->priority) LOGI("Enable interactive session priority");
+    if (mod->fakeip) LOGI("Use fake IP range: %s, map: %s", config->fake_ip, config->fake_ip_map);
+    if (mod->dnscache) LOGI("Use tunnel DNS cache size: %d", config->tunnel_dns_cache);
+    LOGI("Use listen backlog: %d", config->backlog);
+    LOGI("Use max open files: %d", config->nofile);
+    if (config->max_clients) LOGI("Use max clients: %d", config->max_clients);
+    if (config->max_clients_per_ip) LOGI("Use max clients per IP: %d", config->max_clients_per_ip);
+    if (config->max_connects_per_dest)
+        LOGI("Use max concurrent connects per dest: %d", config->max_connects_per_dest);
+    if (config->rate_limit) LOGI("Use rate limit: %dKB/s", config->rate_limit);
+    if (config->session_rate_limit) LOGI("Use session rate limit: %dKB/s", config->session_rate_limit);
+    if (config->outbound_addrs) LOGI("Use outbound addrs: %s", config->outbound_addrs);
+    if (config->nameserver) LOGI("Use nameserver: %s", config->nameserver);
+    LOGI("Use DNS cache size: %d", config->dns_cache);
     LOGI("Use local addr: %s:%d", config->local_addr, config->local_port);
     LOGI("Use remote addr: %s:%d", config->remote_addr, config->remote_port);
+    for (int i = 0; i < config->server_count; i++)
+        LOGI("Use remote addr: %s:%d", config->servers[i].addr, config->servers[i].port);
     LOGI("Start event loop with: %s", eventGetApiName());
     if (config->pidfile) LOGI("Process id save in file: %s", config->pidfile);
     if (config->daemonize) LOGI("Enable daemonize");
@@ -117,6 +181,12 @@ static void moduleExit() {
 
     if (mod->config->pidfile) unlink(mod->config->pidfile);
     if (mod->config->acl) free_acl();
+    upstreamGroupFree(mod->upstreams);
+    idleReaperFree(mod->reaper);
+    fakeIpPoolFree(mod->fakeip);
+    dnsCacheFree(mod->dnscache);
+    rateLimiterFree(mod->limiter);
+    resolverFree();
     freeCrypto(mod->crypto);
     listRelease(mod->sigexit_events);
     eventLoopFree(mod->el);
@@ -160,8 +230,13 @@ static void moduleUsage() {
     // eprintf("       [-a <user>]                Run as another user.\n");
     eprintf("  [-f <pid_file>]            The file path to store pid\n");
     eprintf("  [-t <timeout>]             Socket timeout in seconds (default 60)\n");
+    eprintf("  [--connect-timeout <sec>]  Timeout of connecting to remote (default 10)\n");
+    eprintf("  [--handshake-timeout <sec>]\n"
+            "                             Timeout of the client handshake (default 10)\n");
+    eprintf("  [--idle-timeout <sec>]     Idle timeout of an established connection\n"
+            "                             (default the socket timeout)\n");
     eprintf("  [-c <config_file>]         The path to config file\n");
-    // eprintf("       [-n <number>]              Max number of open files.\n");
+    eprintf("  [-n <number>]              Max number of open files (default the hard limit)\n");
 #ifndef MODULE_REDIR
     // eprintf("       [-i <interface>]           Network interface to bind.\n");
 #endif
@@ -171,17 +246,70 @@ static void moduleUsage() {
         eprintf("                                  TPROXY is required in redir mode\n");
     eprintf("  [-U]                       Enable UDP relay and disable TCP relay\n");
     eprintf("  [-6]                       Use IPv6 address first\n");
-    // if (module == MODULE_REMOTE)
-    // eprintf(
-    // "       [-d <addr>]                Name servers for internal DNS resolver.\n");
 
     // eprintf("       [--reuse-port]             Enable port reuse.\n");
 #if defined(MODULE_REMOTE) || defined(MODULE_LOCAL) || defined(MODULE_REDIR)
     // eprintf("       [--fast-open]              Enable TCP fast open.\n");
     // eprintf("                                  with Linux kernel > 3.7.0.\n");
 #endif
-if (module == MODULE_REDIR || module == MODULE_LOCAL)
-    eprintf("  [--acl <acl_file>]         Path to Access Control List\n");
+    if (module == MODULE_REDIR || module == MODULE_LOCAL) {
+        eprintf("  [--acl <acl_file>]         Path to Access Control List\n");
+        if (module == MODULE_LOCAL)
+            eprintf("  [--acl-resolve <mode>]     Route of the domains no ACL rule matches: strict\n"
+                    "                             waits for their IP, proxy sends them to the\n"
+                    "                             proxy, async proxies them until their IP is\n"
+                    "                             known to bypass (default strict)\n");
+        eprintf("  [--pool-size <size>]       Number of pre-connected remote server connections\n"
+                "                             (default 0, disabled)\n");
+        eprintf("  [--pool-ttl <ttl>]         Max idle seconds of a pooled connection, keep it\n"
+                "                             below the server handshake timeout (default 8)\n");
+        eprintf("  [--mux <num>]              Carry the streams over num persistent connections\n"
+                "                             to the remote server, not with the client caps,\n"
+                "                             rate limits or priority (default 0, disabled)\n");
+        eprintf("  [--sockmap]                Relay bypass connections in the kernel by eBPF\n"
+                "                             sockmap, Linux only\n");
+    }
+    if (module == MODULE_TUNNEL || module == MODULE_REDIR) {
+        eprintf("  [--fake-ip <cidr>]         Answer A queries in xs-tunnel with IPs of cidr,\n"
+                "                             which xs-redir maps back to the domains\n");
+        eprintf("  [--fake-ip-map <file>]     File of the fake IPs shared by xs-tunnel and\n"
+                "                             xs-redir (default /tmp/xsocks-fakeip.map)\n");
+    }
+    if (module == MODULE_TUNNEL) {
+        eprintf("  [--tunnel-dns-cache <num>] Max DNS answers cached by xs-tunnel, identical\n"
+                "                             queries in flight share one lookup\n"
+                "                             (default 0, disabled)\n");
+    }
+    if (module == MODULE_REDIR) {
+        eprintf("  [--sniff]                  Route by the TLS SNI or HTTP Host of the first\n"
+                "                             client bytes instead of the dest IP\n");
+    }
+    if (module != MODULE_TUNNEL) {
+        eprintf("  [--priority]               Relay interactive TCP sessions ahead of the bulk\n"
+                "                             ones, with latency stats per class\n");
+    }
+    eprintf("  [--outbound-addrs <ips>]   Comma separated source IPs of the outgoing\n"
+            "                             connections, used round-robin\n");
+    eprintf("  [--nameserver <ips>]       Comma separated DNS servers of the async resolver\n"
+            "                             (default the ones of /etc/resolv.conf)\n");
+    eprintf("  [--dns-cache <num>]        Max names in the DNS cache, answers are kept for\n"
+            "                             their TTL and served stale while refreshed\n"
+            "                             (default 10000, 0 disables the cache)\n");
+    eprintf("  [--backlog <num>]          Listen backlog, capped by somaxconn (default 1024)\n");
+    eprintf("  [--max-clients <num>]      Max TCP clients, accept pauses at the limit\n"
+            "                             (default 0, unlimited)\n");
+    eprintf("  [--max-clients-per-ip <num>]\n"
+            "                             Max TCP clients of one source IP (default 0, unlimited)\n");
+    if (module == MODULE_REMOTE) {
+        eprintf("  [--max-connects-per-dest <num>]\n"
+                "                             Max concurrent connects to one destination host\n"
+                "                             (default 0, unlimited)\n");
+    }
+    eprintf("  [--rate-limit <KB/s>]      Rate of the listening port, both directions of all\n"
+            "                             the TCP and UDP sessions (default 0, unlimited)\n");
+    eprintf("  [--session-rate-limit <KB/s>]\n"
+            "                             Rate of every TCP session, both directions\n"
+            "                             (default 0, unlimited)\n");
     // eprintf("  [--mtu <MTU>]              MTU of your network interface.\n");
 #ifdef __linux__
     // eprintf("       [--mptcp]                  Enable Multipath TCP on MPTCP Kernel.\n");
@@ -44,6 +44,13 @@ typedef struct module {
     eventLoop *el;
     crypto_t *crypto;
     list *sigexit_events;
+    struct tcpPool *pool;
+    struct tcpMux *mux;
+    struct upstreamGroup *upstreams;
+    struct idleReaper *reaper;
+    struct fakeIpPool *fakeip;
+    struct dnsCache *dnscache; // xs-tunnel only
+    struct rateLimiter *limiter;
 } module;
 
 enum {
@@ -0,0 +1,222 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_dnscache.h"
+#include "module.h"
+
+#include "lib/protocol/dns.h"
+
+#include <ctype.h>
+
+static int dnsCacheMatch(char *buf, int len, dnsCacheKey *key);
+static dnsCacheEntry *dnsCacheFind(dnsCache *cache, dnsCacheKey *key);
+static dnsCacheEntry *dnsCacheAdd(dnsCache *cache, dnsCacheKey *key, uint64_t now);
+static void dnsCacheRemove(dnsCache *cache, dnsCacheEntry *entry);
+static void dnsCacheWaitersFree(dnsCacheEntry *entry);
+
+/*
+ Answers of xs-tunnel keyed by the question, NULL when disabled. A query in flight has
+ an entry as well, for the same queries coming meanwhile to wait on.
+ */
+dnsCache *dnsCacheNew(xsocksConfig *config) {
+    dnsCache *cache;
+
+    if (config->tunnel_dns_cache <= 0) return NULL;
+
+    if (CALLOC_P(cache) == NULL) {
+        LOGW("DNS cache is NULL, please check the memory");
+        return NULL;
+    }
+    cache->size = config->tunnel_dns_cache;
+
+    return cache;
+}
+
+void dnsCacheFree(dnsCache *cache) {
+    if (!cache) return;
+
+    while (cache->lru.head) dnsCacheRemove(cache, DLIST_ENTRY(cache->lru.head, dnsCacheEntry, lru));
+    xs_free(cache);
+}
+
+/*
+ Turn the query in b into its cached answer, keeping the ID of the query and taking
+ the seconds it was cached off the TTLs. Without one the query waits for the same one
+ in flight, or becomes the query in flight of the key.
+ */
+int dnsCacheLookup(dnsCache *cache, dnsCacheKey *key, ioBuf *b, sockAddrEx *sa) {
+    dnsCacheEntry *entry = dnsCacheFind(cache, key);
+    dnsCacheWaiter *waiter;
+    uint64_t now = timerStart();
+    char *buf = IOBUF_DATA(b);
+
+    if (entry && now >= entry->expire) {
+        if (!entry->answer) {
+            // Lost or slow, this one is forwarded and the waiters stay for either answer
+            entry->expire = now + (uint64_t)DNSCACHE_QUERY_TIMEOUT * MICROSECOND_UNIT;
+            return DNSCACHE_MISS;
+        }
+        dnsCacheRemove(cache, entry);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        if ((entry = dnsCacheAdd(cache, key, now)) != NULL)
+            entry->expire = now + (uint64_t)DNSCACHE_QUERY_TIMEOUT * MICROSECOND_UNIT;
+        return DNSCACHE_MISS;
+    }
+
+    if (entry->answer) {
+        if (entry->answer_len > b->len + IOBUF_TAILROOM(b)) return DNSCACHE_MISS;
+
+        memcpy(buf + 2, entry->answer + 2, entry->answer_len - 2);
+        b->len = entry->answer_len;
+        dnsAnswerTtl(buf, b->len, (now - entry->stored) / MICROSECOND_UNIT);
+        return DNSCACHE_HIT;
+    }
+
+    if (entry->nwaiters >= DNSCACHE_WAITERS || CALLOC_P(waiter) == NULL) return DNSCACHE_MISS;
+
+    memcpy(&waiter->sa, sa, sizeof(*sa));
+    memcpy(waiter->id, buf, 2);
+    waiter->next = entry->waiters;
+    entry->waiters = waiter;
+    entry->nwaiters++;
+
+    return DNSCACHE_WAIT;
+}
+
+/*
+ Send the answer in b to the queries waiting on key, each with its own ID, then cache
+ it for its TTL, capped by DNSCACHE_TTL_MAX. The ID of b is left as it came.
+ */
+void dnsCacheStore(dnsCache *cache, dnsCacheKey *key, ioBuf *b, dnsCacheHandler handler,
+                   void *data) {
+    dnsCacheEntry *entry;
+    uint64_t now = timerStart();
+    char *buf = IOBUF_DATA(b), *answer, id[2];
+    int ttl;
+
+    // Whatever came back, only the answer to the question reaches the other clients
+    if (!dnsCacheMatch(buf, b->len, key)) return;
+
+    entry = dnsCacheFind(cache, key);
+    if (entry && entry->waiters) {
+        memcpy(id, buf, 2);
+        for (dnsCacheWaiter *w = entry->waiters; w; w = w->next) {
+            memcpy(buf, w->id, 2);
+            handler(data, b, &w->sa);
+        }
+        memcpy(buf, id, 2);
+        dnsCacheWaitersFree(entry);
+    }
+
+    if ((ttl = dnsAnswerTtl(buf, b->len, 0)) <= 0) {
+        if (entry && !entry->answer) dnsCacheRemove(cache, entry);
+        return;
+    }
+
+    if (!entry && (entry = dnsCacheAdd(cache, key, now)) == NULL) return;
+    if ((answer = xs_malloc(b->len)) == NULL) {
+        dnsCacheRemove(cache, entry);
+        return;
+    }
+    memcpy(answer, buf, b->len);
+
+    xs_free(entry->answer);
+    entry->answer = answer;
+    entry->answer_len = b->len;
+    entry->stored = now;
+    entry->expire = now + (uint64_t)MIN(ttl, DNSCACHE_TTL_MAX) * MICROSECOND_UNIT;
+}
+
+/*
+ The question of the answer is the one of the key, the case of the name aside
+ */
+static int dnsCacheMatch(char *buf, int len, dnsCacheKey *key) {
+    int qlen = key->len - 1;
+    char *q = buf + DNS_HEADER_LEN;
+
+    if (len < DNS_HEADER_LEN + qlen) return 0;
+
+    for (int i = 0; i < qlen - 4; i++)
+        if (tolower((uint8_t)q[i]) != key->data[i]) return 0;
+
+    return memcmp(q + qlen - 4, key->data + qlen - 4, 4) == 0;
+}
+
+static dnsCacheEntry *dnsCacheFind(dnsCache *cache, dnsCacheKey *key) {
+    dnsCacheEntry *entry;
+
+    HASH_FIND(hh, cache->entries, key->data, (size_t)key->len, entry);
+    if (!entry) return NULL;
+
+    dlistUnlink(&cache->lru, &entry->lru);
+    dlistPushHead(&cache->lru, &entry->lru);
+
+    return entry;
+}
+
+/*
+ Make room by the least recently used entry, but not a query in flight with time left,
+ its waiters would get no answer. NULL when all are such queries.
+ */
+static dnsCacheEntry *dnsCacheAdd(dnsCache *cache, dnsCacheKey *key, uint64_t now) {
+    dnsCacheEntry *entry;
+
+    if (cache->count >= cache->size) {
+        dlistNode *n;
+
+        for (n = cache->lru.tail; n; n = n->prev) {
+            entry = DLIST_ENTRY(n, dnsCacheEntry, lru);
+            if (entry->answer || now >= entry->expire) break;
+        }
+        if (!n) return NULL;
+        dnsCacheRemove(cache, entry);
+    }
+    if ((entry = xs_calloc(sizeof(*entry) + key->len)) == NULL) return NULL;
+
+    entry->key_len = key->len;
+    memcpy(entry->key, key->data, key->len);
+    HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+    dlistPushHead(&cache->lru, &entry->lru);
+    cache->count++;
+
+    return entry;
+}
+
+static void dnsCacheRemove(dnsCache *cache, dnsCacheEntry *entry) {
+    if (!entry) return;
+
+    HASH_DEL(cache->entries, entry);
+    dlistUnlink(&cache->lru, &entry->lru);
+    cache->count--;
+    dnsCacheWaitersFree(entry);
+    xs_free(entry->answer);
+    xs_free(entry);
+}
+
+static void dnsCacheWaitersFree(dnsCacheEntry *entry) {
+    while (entry->waiters) {
+        dnsCacheWaiter *next = entry->waiters->next;
+        xs_free(entry->waiters);
+        entry->waiters = next;
+    }
+    entry->nwaiters = 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_DNSCACHE_H
+#define __MODULE_DNSCACHE_H
+
+#include "lib/core/common.h"
+#include "lib/core/config.h"
+#include "lib/core/dlist.h"
+#include "lib/core/iobuf.h"
+#include "lib/core/net.h"
+
+#include "shadowsocks-libev/uthash.h"
+
+enum {
+    DNSCACHE_MISS = 0, // Forward the query, dnsCacheStore caches its answer
+    DNSCACHE_HIT = 1, // The buffer holds the answer
+    DNSCACHE_WAIT = 2, // The same query is in flight, dnsCacheStore answers this one too
+};
+
+#define DNSCACHE_KEY_LEN 262 /* Question of the longest name, and the EDNS flag */
+#define DNSCACHE_TTL_MAX 3600 /* s */
+#define DNSCACHE_QUERY_TIMEOUT 3 /* s, a query in flight longer has the next one forwarded */
+#define DNSCACHE_WAITERS 32 /* Per query in flight, the queries over it are forwarded */
+
+/* See dnsQueryKey */
+typedef struct dnsCacheKey {
+    int len;
+    char data[DNSCACHE_KEY_LEN];
+} dnsCacheKey;
+
+typedef struct dnsCacheWaiter {
+    sockAddrEx sa;
+    char id[2]; // Of the waiting query, as it came
+    struct dnsCacheWaiter *next;
+} dnsCacheWaiter;
+
+typedef struct dnsCacheEntry {
+    uint64_t stored; // us, the answer is aged by the seconds since
+    uint64_t expire; // us, of the answer, or of the query in flight
+    char *answer; // NULL while the query is in flight
+    int answer_len;
+    dnsCacheWaiter *waiters;
+    int nwaiters;
+    dlistNode lru;
+    UT_hash_handle hh;
+    size_t key_len;
+    char key[];
+} dnsCacheEntry;
+
+typedef struct dnsCache {
+    dnsCacheEntry *entries;
+    dlist lru; // Most recently used first
+    int count;
+    int size;
+} dnsCache;
+
+typedef void (*dnsCacheHandler)(void *data, ioBuf *b, sockAddrEx *sa);
+
+dnsCache *dnsCacheNew(xsocksConfig *config);
+void dnsCacheFree(dnsCache *cache);
+
+int dnsCacheLookup(dnsCache *cache, dnsCacheKey *key, ioBuf *b, sockAddrEx *sa);
+void dnsCacheStore(dnsCache *cache, dnsCacheKey *key, ioBuf *b, dnsCacheHandler handler,
+                   void *data);
+
+#endif /* __MODULE_DNSCACHE_H */
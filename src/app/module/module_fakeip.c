@@ -0,0 +1,228 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_fakeip.h"
+#include "module.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int fakeIpMapOpen(char *err, fakeIpPool *pool);
+static int fakeIpSlot(fakeIpPool *pool, sockAddrEx *sa);
+
+/*
+ The pool is the hosts of cidr, e.g. 198.18.0.0/16, up to FAKEIP_MAX_SIZE. The reader
+ maps the file of the writer on demand, so either may start first.
+ */
+fakeIpPool *fakeIpPoolNew(char *err, char *cidr, char *path, int writable) {
+    fakeIpPool *pool;
+    char ip[NET_IPV4_STR_LEN];
+    char *slash = strchr(cidr, '/');
+    int prefix;
+    ipV4Addr addr;
+
+    if (!slash || slash - cidr >= (int)sizeof(ip) || (prefix = atoi(slash + 1)) < 8 || prefix > 30) {
+        xs_error(err, "Invalid fake IP range: %s", cidr);
+        return NULL;
+    }
+    memcpy(ip, cidr, slash - cidr);
+    ip[slash - cidr] = '\0';
+    if (inet_pton(AF_INET, ip, &addr) != 1) {
+        xs_error(err, "Invalid fake IP range: %s", cidr);
+        return NULL;
+    }
+
+    if (CALLOC_P(pool) == NULL) {
+        xs_error(err, "Fake IP pool is NULL, please check the memory");
+        return NULL;
+    }
+    pool->net = ntohl(addr.s_addr) & (0xFFFFFFFFu << (32 - prefix));
+    pool->size = MIN((1u << (32 - prefix)) - 2, FAKEIP_MAX_SIZE);
+    pool->map_len = sizeof(fakeIpMap) + (size_t)pool->size * FAKEIP_DOMAIN_LEN;
+    pool->path = xs_strdup(path);
+    pool->writable = writable;
+
+    if (fakeIpMapOpen(err, pool) == FAKEIP_ERR && writable) {
+        fakeIpPoolFree(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void fakeIpPoolFree(fakeIpPool *pool) {
+    if (!pool) return;
+
+    fakeIpEntry *e, *tmp;
+    HASH_ITER(hh, pool->domains, e, tmp) {
+        HASH_DEL(pool->domains, e);
+        xs_free(e);
+    }
+
+    if (pool->map) munmap(pool->map, pool->map_len);
+    xs_free(pool->path);
+    xs_free(pool);
+}
+
+/*
+ The writer starts over when the file is of another pool, else it picks up the slots
+ assigned before a restart, the ones past next taken as the oldest
+ */
+static int fakeIpMapOpen(char *err, fakeIpPool *pool) {
+    fakeIpMap head;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(pool->path, pool->writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) == -1) {
+        xs_error(err, "Open fake IP map %s error: %s", pool->path, STRERR);
+        return FAKEIP_ERR;
+    }
+
+    int fresh = fstat(fd, &st) == -1 || (size_t)st.st_size != pool->map_len ||
+                pread(fd, &head, sizeof(head), 0) != sizeof(head) || head.magic != FAKEIP_MAGIC ||
+                head.net != pool->net || head.size != pool->size;
+
+    if (fresh && !pool->writable) {
+        xs_error(err, "Fake IP map %s is not of the pool", pool->path);
+        close(fd);
+        return FAKEIP_ERR;
+    }
+    if (fresh && (ftruncate(fd, 0) == -1 || ftruncate(fd, pool->map_len) == -1)) {
+        xs_error(err, "Truncate fake IP map %s error: %s", pool->path, STRERR);
+        close(fd);
+        return FAKEIP_ERR;
+    }
+
+    void *map = mmap(NULL, pool->map_len, pool->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        xs_error(err, "Map fake IP map %s error: %s", pool->path, STRERR);
+        return FAKEIP_ERR;
+    }
+    pool->map = map;
+
+    if (!pool->writable) return FAKEIP_OK;
+
+    if (fresh) {
+        pool->map->net = pool->net;
+        pool->map->size = pool->size;
+        pool->map->next = 0;
+        pool->map->magic = FAKEIP_MAGIC;
+        return FAKEIP_OK;
+    }
+
+    for (uint32_t n = 0; n < pool->size; n++) {
+        uint32_t i = (pool->map->next + n) % pool->size;
+        fakeIpEntry *e;
+
+        if (pool->map->domains[i][0] == '\0' || (e = xs_calloc(sizeof(*e))) == NULL) continue;
+        e->domain = pool->map->domains[i];
+        HASH_ADD_KEYPTR(hh, pool->domains, e->domain, strlen(e->domain), e);
+        dlistPushHead(&pool->lru, &e->lru);
+        pool->count++;
+    }
+
+    return FAKEIP_OK;
+}
+
+/*
+ The IP of domain. Without one it gets a free slot, or once the pool is full the slot
+ of the domain queried least recently, which clients are the least likely to hold.
+ */
+int fakeIpAssign(fakeIpPool *pool, char *domain, ipV4Addr *ip) {
+    fakeIpMap *map = pool->map;
+    size_t len = strlen(domain);
+    fakeIpEntry *e;
+    uint32_t slot;
+
+    if (!map || !pool->writable || len == 0 || len >= FAKEIP_DOMAIN_LEN) return FAKEIP_ERR;
+
+    HASH_FIND(hh, pool->domains, domain, len, e);
+    if (e) {
+        dlistUnlink(&pool->lru, &e->lru);
+        dlistPushHead(&pool->lru, &e->lru);
+    } else {
+        if (pool->count < pool->size) {
+            if ((e = xs_calloc(sizeof(*e))) == NULL) return FAKEIP_ERR;
+            while (map->domains[map->next][0] != '\0') map->next = (map->next + 1) % pool->size;
+            e->domain = map->domains[map->next];
+            map->next = (map->next + 1) % pool->size;
+            pool->count++;
+        } else {
+            e = DLIST_ENTRY(pool->lru.tail, fakeIpEntry, lru);
+            dlistUnlink(&pool->lru, &e->lru);
+            HASH_DEL(pool->domains, e);
+        }
+
+        memcpy(e->domain, domain, len + 1);
+        HASH_ADD_KEYPTR(hh, pool->domains, e->domain, len, e);
+        dlistPushHead(&pool->lru, &e->lru);
+    }
+
+    slot = (e->domain - map->domains[0]) / FAKEIP_DOMAIN_LEN;
+    ip->s_addr = htonl(pool->net + 1 + slot);
+
+    return FAKEIP_OK;
+}
+
+static int fakeIpSlot(fakeIpPool *pool, sockAddrEx *sa) {
+    uint32_t addr;
+
+    if (sa->sa.ss_family == AF_INET) {
+        addr = ntohl(((sockAddrIpV4 *)&sa->sa)->sin_addr.s_addr);
+    } else if (sa->sa.ss_family == AF_INET6 &&
+               IN6_IS_ADDR_V4MAPPED(&((sockAddrIpV6 *)&sa->sa)->sin6_addr)) {
+        memcpy(&addr, ((sockAddrIpV6 *)&sa->sa)->sin6_addr.s6_addr + 12, 4);
+        addr = ntohl(addr);
+    } else {
+        return -1;
+    }
+
+    addr -= pool->net + 1;
+    return addr < pool->size ? (int)addr : -1;
+}
+
+int fakeIpMatch(fakeIpPool *pool, sockAddrEx *sa) {
+    return fakeIpSlot(pool, sa) != -1;
+}
+
+/*
+ The domain behind a fake IP, copied out as the writer may reuse the slot anytime
+ */
+int fakeIpLookup(fakeIpPool *pool, sockAddrEx *sa, char *domain, int domain_len) {
+    int slot = fakeIpSlot(pool, sa);
+    char err[XS_ERR_LEN];
+
+    if (slot == -1) return FAKEIP_ERR;
+    if (!pool->map && fakeIpMapOpen(err, pool) == FAKEIP_ERR) {
+        LOGW(err);
+        return FAKEIP_ERR;
+    }
+
+    char *d = pool->map->domains[slot];
+    int len = strnlen(d, FAKEIP_DOMAIN_LEN - 1);
+    if (len == 0 || len >= domain_len) return FAKEIP_ERR;
+
+    memcpy(domain, d, len);
+    domain[len] = '\0';
+
+    return FAKEIP_OK;
+}
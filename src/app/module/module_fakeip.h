@@ -0,0 +1,73 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_FAKEIP_H
+#define __MODULE_FAKEIP_H
+
+#include "lib/core/common.h"
+#include "lib/core/dlist.h"
+#include "lib/core/net.h"
+
+#include "shadowsocks-libev/uthash.h"
+
+enum {
+    FAKEIP_OK = 0,
+    FAKEIP_ERR = -1,
+};
+
+#define FAKEIP_MAGIC 0x78736669 /* "xsfi" */
+#define FAKEIP_DOMAIN_LEN 256
+#define FAKEIP_MAX_SIZE 65534 /* A /16, the map file is 16MB but sparse */
+#define FAKEIP_TTL 1 /* s, the least recently queried domain gives its slot up once full */
+
+/* Shared by xs-tunnel, which assigns the slots, and xs-redir, which reads them */
+typedef struct fakeIpMap {
+    uint32_t magic;
+    uint32_t net;
+    uint32_t size;
+    uint32_t next; // Slot to look for a free one from
+    char domains[][FAKEIP_DOMAIN_LEN]; // Slot i is the IP net + 1 + i
+} fakeIpMap;
+
+typedef struct fakeIpEntry {
+    char *domain; // Key, points into the map
+    dlistNode lru;
+    UT_hash_handle hh;
+} fakeIpEntry;
+
+typedef struct fakeIpPool {
+    fakeIpMap *map; // NULL until the reader finds the map file
+    size_t map_len;
+    char *path;
+    int writable;
+    uint32_t net; // Host byte order
+    uint32_t size;
+    fakeIpEntry *domains; // Writer only
+    dlist lru; // Most recently queried first
+    uint32_t count;
+} fakeIpPool;
+
+fakeIpPool *fakeIpPoolNew(char *err, char *cidr, char *path, int writable);
+void fakeIpPoolFree(fakeIpPool *pool);
+
+int fakeIpAssign(fakeIpPool *pool, char *domain, ipV4Addr *ip);
+int fakeIpMatch(fakeIpPool *pool, sockAddrEx *sa);
+int fakeIpLookup(fakeIpPool *pool, sockAddrEx *sa, char *domain, int domain_len);
+
+#endif /* __MODULE_FAKEIP_H */
@@ -0,0 +1,136 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_limit.h"
+#include "module.h"
+
+#include "lib/protocol/proxy.h"
+
+static int tokenBucketRefill(tokenBucket *b, uint64_t now);
+static void rateLimiterHandler(event *e);
+
+/*
+ Both directions of the relay are charged. The port bucket also covers UDP, where a
+ datagram exchange is too short to be a session of its own.
+ */
+rateLimiter *rateLimiterNew(xsocksConfig *config) {
+    rateLimiter *limiter;
+
+    if (config->rate_limit <= 0 && config->session_rate_limit <= 0) return NULL;
+
+    if (CALLOC_P(limiter) == NULL) {
+        LOGW("Rate limiter is NULL, please check the memory");
+        return NULL;
+    }
+    tokenBucketInit(&limiter->port, (int64_t)MAX(config->rate_limit, 0) * 1024);
+    limiter->session_rate = (int64_t)MAX(config->session_rate_limit, 0) * 1024;
+
+    limiter->te = NEW_EVENT_REPEAT(LIMIT_INTERVAL, rateLimiterHandler, limiter);
+    ADD_EVENT(app, limiter->te);
+
+    return limiter;
+}
+
+void rateLimiterFree(rateLimiter *limiter) {
+    if (!limiter) return;
+
+    CLR_EVENT(limiter->te);
+    xs_free(limiter);
+}
+
+void tokenBucketInit(tokenBucket *b, int64_t rate) {
+    b->rate = rate;
+    b->burst = MAX(rate * LIMIT_BURST_MS / MILLISECOND_UNIT, LIMIT_BURST_MIN);
+    b->tokens = b->burst;
+    b->time = eventLoopWakeTime(app->el);
+}
+
+/*
+ Charge n bytes to the port and to b, LIMIT_WAIT once either one is used up
+ */
+int rateLimiterTake(rateLimiter *limiter, tokenBucket *b, int n) {
+    uint64_t now = eventLoopWakeTime(app->el);
+    int status = LIMIT_OK;
+
+    if (limiter->port.rate > 0) {
+        limiter->port.tokens -= n;
+        if (tokenBucketRefill(&limiter->port, now) == LIMIT_WAIT) status = LIMIT_WAIT;
+    }
+    if (b && b->rate > 0) {
+        b->tokens -= n;
+        if (tokenBucketRefill(b, now) == LIMIT_WAIT) status = LIMIT_WAIT;
+    }
+
+    return status;
+}
+
+void rateLimiterWait(rateLimiter *limiter, limitWaiter *w) {
+    if (dlistIsLinked(&limiter->waiters, &w->node)) return;
+
+    dlistPushTail(&limiter->waiters, &w->node);
+}
+
+void rateLimiterCancel(rateLimiter *limiter, limitWaiter *w) {
+    if (!limiter) return;
+
+    dlistUnlink(&limiter->waiters, &w->node);
+}
+
+/*
+ Only the whole bytes elapsed are added, the time is kept back for the fraction
+ */
+static int tokenBucketRefill(tokenBucket *b, uint64_t now) {
+    int64_t add;
+
+    if (now > b->time) {
+        // Past the time to fill the bucket the product would only overflow after a long idle
+        uint64_t full = (uint64_t)(b->burst - b->tokens) * MICROSECOND_UNIT / b->rate + 1;
+
+        add = (int64_t)MIN(now - b->time, full) * b->rate / MICROSECOND_UNIT;
+        if (add > 0) {
+            b->tokens += add;
+            b->time = now;
+        }
+    }
+    if (b->tokens > b->burst) b->tokens = b->burst;
+
+    return b->tokens > 0 ? LIMIT_OK : LIMIT_WAIT;
+}
+
+/*
+ Resume the waiters in order while the port has tokens, the rest wait for the next tick
+ */
+static void rateLimiterHandler(event *e) {
+    rateLimiter *limiter = e->data;
+    uint64_t now = eventLoopWakeTime(app->el);
+    dlistNode *n, *next;
+
+    if (limiter->port.rate > 0 && tokenBucketRefill(&limiter->port, now) == LIMIT_WAIT) return;
+
+    for (n = limiter->waiters.head; n; n = next) {
+        limitWaiter *w = DLIST_ENTRY(n, limitWaiter, node);
+
+        next = n->next;
+        if (w->bucket && w->bucket->rate > 0 && tokenBucketRefill(w->bucket, now) == LIMIT_WAIT)
+            continue;
+
+        rateLimiterCancel(limiter, w);
+        w->onResume(w);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_LIMIT_H
+#define __MODULE_LIMIT_H
+
+#include "lib/core/config.h"
+#include "lib/core/dlist.h"
+#include "lib/event/event.h"
+
+enum {
+    LIMIT_OK = 0,
+    LIMIT_WAIT = 1,
+};
+
+#define LIMIT_INTERVAL 20 /* ms, the waiters are resumed on this tick */
+#define LIMIT_BURST_MS 250 /* ms of the rate a bucket holds at most */
+#define LIMIT_BURST_MIN 0x4000 /* Bytes, one read has to fit in the burst */
+
+/*
+ Refilled lazily from the loop wakeup time when tokens are taken, so an idle bucket
+ costs nothing. A read may overdraw it, the reader then waits until it is positive.
+ */
+typedef struct tokenBucket {
+    int64_t tokens; // Bytes
+    int64_t rate; // Bytes per second, 0 is unlimited
+    int64_t burst;
+    uint64_t time; // Last refill in microseconds
+} tokenBucket;
+
+/* A session or a server with its reads paused, embedded in it */
+typedef struct limitWaiter {
+    tokenBucket *bucket; // Own bucket besides the port one, NULL if none
+    void (*onResume)(struct limitWaiter *w);
+    void *data;
+    dlistNode node; // On the waiters of the limiter while paused
+} limitWaiter;
+
+typedef struct rateLimiter {
+    event *te;
+    tokenBucket port; // Shared by all the sessions of the listening port
+    int64_t session_rate; // Bytes per second of every TCP session, 0 is unlimited
+    dlist waiters; // Resumed first come first served
+} rateLimiter;
+
+rateLimiter *rateLimiterNew(xsocksConfig *config);
+void rateLimiterFree(rateLimiter *limiter);
+
+void tokenBucketInit(tokenBucket *b, int64_t rate);
+int rateLimiterTake(rateLimiter *limiter, tokenBucket *b, int n);
+void rateLimiterWait(rateLimiter *limiter, limitWaiter *w);
+void rateLimiterCancel(rateLimiter *limiter, limitWaiter *w);
+
+#endif /* __MODULE_LIMIT_H */
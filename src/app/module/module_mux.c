@@ -0,0 +1,519 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_mux.h"
+#include "module.h"
+
+#include "lib/protocol/socks5.h"
+#include "lib/protocol/tcp_shadowsocks.h"
+
+static muxSession *muxSessionNew(tcpMux *mux, tcpConn *conn);
+static void muxSessionFree(muxSession *session);
+static muxSession *muxSessionGet(tcpMux *mux);
+static void muxSessionSetTimeout(muxSession *session);
+static void muxSessionSend(muxSession *session, int type, uint32_t id, char *data, int len);
+static void muxSessionFlush(muxSession *session);
+static int muxSessionProcess(muxSession *session);
+static int muxSessionHandleFrame(muxSession *session, muxFrame *frame);
+
+static void muxSessionOnConnect(void *data, int status);
+static void muxSessionOnRead(void *data);
+static void muxSessionOnWrite(void *data);
+static void muxSessionOnClose(void *data);
+static void muxSessionOnError(void *data);
+static void muxSessionOnTimeout(void *data);
+
+static muxStream *muxStreamNew(muxSession *session, uint32_t id);
+static void muxStreamFree(muxStream *stream);
+static void muxStreamFlush(muxStream *stream);
+
+static void muxStreamOnConnect(void *data, int status);
+static void muxStreamOnRead(void *data);
+static void muxStreamOnWrite(void *data);
+static void muxStreamOnClose(void *data);
+static void muxStreamOnError(void *data);
+static void muxStreamOnTimeout(void *data);
+
+tcpMux *tcpMuxNew(char *host, int port, int size) {
+    tcpMux *mux;
+
+    if (CALLOC_P(mux) == NULL) {
+        LOGW("TCP mux is NULL, please check the memory");
+        return NULL;
+    }
+
+    mux->host = xs_strdup(host);
+    mux->port = port;
+    mux->size = size;
+    mux->stream_id = 0;
+    mux->sessions = listCreate();
+
+    return mux;
+}
+
+void tcpMuxFree(tcpMux *mux) {
+    if (!mux) return;
+
+    while (listLength(mux->sessions)) muxSessionFree(listNodeValue(listFirst(mux->sessions)));
+    listRelease(mux->sessions);
+
+    xs_free(mux->host);
+    xs_free(mux);
+}
+
+/*
+ Carry conn as a new stream of a mux session, conn is owned by the stream from now on
+ */
+int tcpMuxOpen(tcpMux *mux, tcpConn *conn, char *host, int port) {
+    muxSession *session;
+    muxStream *stream;
+    char addr[SOCKS5_ADDR_MAX_LEN];
+    int addr_len;
+
+    if (socks5AddrCreate(NULL, host, port, addr, &addr_len) == SOCKS5_ERR) return MUX_ERR;
+
+    if ((session = muxSessionGet(mux)) == NULL) return MUX_ERR;
+
+    if (++mux->stream_id == 0) mux->stream_id = 1;
+    if ((stream = muxStreamNew(session, mux->stream_id)) == NULL) return MUX_ERR;
+
+    muxSessionSend(session, MUX_FRAME_SYN, stream->id, addr, addr_len);
+    muxStreamAttach(stream, conn);
+
+    return MUX_OK;
+}
+
+/*
+ Server side, conn sent the mux host as its dest. The data left in the first read is fed as frames.
+ */
+muxSession *muxSessionAccept(tcpConn *conn, char *buf, int buf_len, muxOpenHandler onOpen) {
+    muxSession *session;
+
+    if ((session = muxSessionNew(NULL, conn)) == NULL) return NULL;
+    session->onOpen = onOpen;
+
+    if (buf_len > 0) {
+        session->rbuf = sdscatlen(session->rbuf, buf, buf_len);
+        if (muxSessionProcess(session) == MUX_ERR) {
+            LOGW("TCP mux session %s protocol error", tcpGetAddrinfo(conn));
+            // Conn is closed by the caller
+            session->conn = NULL;
+            muxSessionFree(session);
+            return NULL;
+        }
+    }
+
+    return session;
+}
+
+void muxStreamAttach(muxStream *stream, tcpConn *conn) {
+    stream->conn = conn;
+    conn->data = stream;
+
+    CONN_ON_CONNECT(conn, muxStreamOnConnect);
+    CONN_ON_READ(conn, muxStreamOnRead);
+    CONN_ON_WRITE(conn, muxStreamOnWrite);
+    CONN_ON_CLOSE(conn, muxStreamOnClose);
+    CONN_ON_ERROR(conn, muxStreamOnError);
+    CONN_ON_TIMEOUT(conn, muxStreamOnTimeout);
+
+    if (tcpIsConnected(conn)) {
+        tcpSetStream(conn);
+        ADD_EVENT_READ(conn);
+    }
+}
+
+static muxSession *muxSessionNew(tcpMux *mux, tcpConn *conn) {
+    muxSession *session;
+
+    if (CALLOC_P(session) == NULL) {
+        LOGW("TCP mux session is NULL, please check the memory");
+        return NULL;
+    }
+
+    session->mux = mux;
+    session->conn = conn;
+    session->rbuf = sdsempty();
+    session->wbuf = sdsempty();
+    session->streams = NULL;
+    session->stream_count = 0;
+
+    conn->data = session;
+    CONN_ON_CONNECT(conn, muxSessionOnConnect);
+    CONN_ON_READ(conn, muxSessionOnRead);
+    CONN_ON_WRITE(conn, muxSessionOnWrite);
+    CONN_ON_CLOSE(conn, muxSessionOnClose);
+    CONN_ON_ERROR(conn, muxSessionOnError);
+    CONN_ON_TIMEOUT(conn, muxSessionOnTimeout);
+
+    if (mux) {
+        listAddNodeTail(mux->sessions, session);
+        session->node = listLast(mux->sessions);
+    }
+
+    muxSessionSetTimeout(session);
+    if (tcpIsConnected(conn)) ADD_EVENT_READ(conn);
+
+    return session;
+}
+
+static void muxSessionFree(muxSession *session) {
+    muxStream *stream, *tmp;
+
+    if (session->mux) listDelNode(session->mux->sessions, session->node);
+
+    CONN_CLOSE(session->conn);
+    session->conn = NULL;
+
+    HASH_ITER(hh, session->streams, stream, tmp) muxStreamFree(stream);
+
+    sdsfree(session->rbuf);
+    sdsfree(session->wbuf);
+    xs_free(session);
+}
+
+/*
+ The least busy session, a new one is opened while there are less than the mux size
+ */
+static muxSession *muxSessionGet(tcpMux *mux) {
+    muxSession *session = NULL;
+    tcpConn *conn;
+    listNode *ln;
+    listIter li;
+    char err[XS_ERR_LEN];
+
+    listRewind(mux->sessions, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        muxSession *s = listNodeValue(ln);
+        if (!session || s->stream_count < session->stream_count) session = s;
+    }
+    if (session && (session->stream_count == 0 || (int)listLength(mux->sessions) >= mux->size))
+        return session;
+
+    conn = tcpConnect(err, app->el, mux->host, mux->port, app->config->connect_timeout, NULL);
+    if (!conn) {
+        LOGW("TCP mux connect error: %s", err);
+        return session;
+    }
+    if (tcpSetSockOpts(err, conn, &app->config->remote_sockopts) == TCP_ERR)
+        LOGD("TCP mux set socket options error: %s", err);
+    conn = (tcpConn *)tcpShadowsocksConnNew(conn, app->crypto);
+    tcpShadowsocksConnInit((tcpShadowsocksConn *)conn, MUX_HOST, 0);
+
+    LOGD("TCP mux session current count: %d", (int)listLength(mux->sessions) + 1);
+
+    return muxSessionNew(mux, conn);
+}
+
+/*
+ Keep the session open as long as it carries streams, an unused one is closed after the idle timeout
+ */
+static void muxSessionSetTimeout(muxSession *session) {
+    int timeout = session->stream_count > 0 ? -1 : app->config->idle_timeout;
+
+    tcpSetIdleTimeout(session->conn, timeout);
+    if (tcpIsConnected(session->conn)) tcpSetTimeout(session->conn, timeout);
+}
+
+/*
+ Frames are only queued here and written from the write event, so sending never frees anything
+ */
+static void muxSessionSend(muxSession *session, int type, uint32_t id, char *data, int len) {
+    session->wbuf = muxFrameAppend(session->wbuf, type, id, data, len);
+    ADD_EVENT_WRITE(session->conn);
+}
+
+static void muxSessionFlush(muxSession *session) {
+    tcpConn *conn = session->conn;
+    int nwrite;
+
+    // A chunk stays in wbuf until the conn reports it is all on the wire
+    while (sdslen(session->wbuf) > 0) {
+        nwrite = TCP_WRITE(conn, session->wbuf, MIN((int)sdslen(session->wbuf), NET_IOBUF_LEN));
+        if (nwrite == TCP_ERR) return;
+        if (nwrite == 0) {
+            ADD_EVENT_WRITE(conn);
+            return;
+        }
+        sdsrange(session->wbuf, nwrite, -1);
+    }
+
+    DEL_EVENT_WRITE(conn);
+}
+
+static int muxSessionProcess(muxSession *session) {
+    muxFrame frame;
+    int off = 0;
+    int len;
+
+    while ((len = muxFrameParse(session->rbuf + off, sdslen(session->rbuf) - off, &frame)) > 0) {
+        off += len;
+        if (muxSessionHandleFrame(session, &frame) == MUX_ERR) return MUX_ERR;
+    }
+    if (len == MUX_ERR) return MUX_ERR;
+
+    sdsrange(session->rbuf, off, -1);
+
+    return MUX_OK;
+}
+
+static int muxSessionHandleFrame(muxSession *session, muxFrame *frame) {
+    muxStream *stream = NULL;
+    char host[HOSTNAME_MAX_LEN];
+    int host_len = sizeof(host);
+    int port;
+    uint32_t inc;
+
+    HASH_FIND(hh, session->streams, &frame->id, sizeof(frame->id), stream);
+
+    switch (frame->type) {
+        case MUX_FRAME_SYN:
+            if (!session->onOpen || stream) return MUX_ERR;
+            if (socks5AddrParse(frame->data, frame->len, NULL, host, &host_len, &port) == SOCKS5_ERR)
+                return MUX_ERR;
+
+            if ((stream = muxStreamNew(session, frame->id)) == NULL) return MUX_ERR;
+            if (session->onOpen(stream, host, port) == MUX_ERR) {
+                muxSessionSend(session, MUX_FRAME_RST, stream->id, NULL, 0);
+                muxStreamFree(stream);
+            }
+            break;
+        case MUX_FRAME_DATA:
+            // Closed on this side already, the RST is on the way
+            if (!stream || stream->closing) break;
+
+            if (frame->len > stream->recv_window) {
+                LOGW("TCP mux stream %s exceeds the window", CONN_GET_ADDRINFO(stream->conn));
+                muxSessionSend(session, MUX_FRAME_RST, stream->id, NULL, 0);
+                muxStreamFree(stream);
+                break;
+            }
+            stream->recv_window -= frame->len;
+            stream->wbuf = sdscatlen(stream->wbuf, frame->data, frame->len);
+            muxStreamFlush(stream);
+            break;
+        case MUX_FRAME_FIN:
+            if (!stream) break;
+
+            stream->closing = 1;
+            muxStreamFlush(stream);
+            break;
+        case MUX_FRAME_RST:
+            if (stream) muxStreamFree(stream);
+            break;
+        case MUX_FRAME_WND:
+            if (!stream) break;
+
+            memcpy(&inc, frame->data, sizeof(inc));
+            stream->send_window += ntohl(inc);
+            if (stream->send_window > 0 && tcpIsConnected(stream->conn)) ADD_EVENT_READ(stream->conn);
+            break;
+        default: return MUX_ERR;
+    }
+
+    return MUX_OK;
+}
+
+static void muxSessionOnConnect(void *data, int status) {
+    muxSession *session = data;
+    tcpConn *conn = session->conn;
+
+    if (status == TCP_ERR) {
+        LOGW("TCP mux session %s connect error: %s", tcpGetAddrinfo(conn), conn->errstr);
+        return;
+    }
+    LOGD("TCP mux session %s connect success", tcpGetAddrinfo(conn));
+
+    muxSessionSetTimeout(session);
+    ADD_EVENT_READ(conn);
+    ADD_EVENT_WRITE(conn);
+}
+
+static void muxSessionOnRead(void *data) {
+    muxSession *session = data;
+    tcpConn *conn = session->conn;
+    int nread;
+
+    nread = TCP_READ(conn, conn->rbuf, conn->rbuf_len);
+    if (nread <= 0) return;
+
+    session->rbuf = sdscatlen(session->rbuf, conn->rbuf, nread);
+    if (muxSessionProcess(session) == MUX_ERR) {
+        LOGW("TCP mux session %s protocol error", tcpGetAddrinfo(conn));
+        muxSessionFree(session);
+    }
+}
+
+static void muxSessionOnWrite(void *data) {
+    muxSessionFlush(data);
+}
+
+static void muxSessionOnClose(void *data) {
+    muxSession *session = data;
+
+    LOGD("TCP mux session %s closed connection", tcpGetAddrinfo(session->conn));
+
+    muxSessionFree(session);
+}
+
+static void muxSessionOnError(void *data) {
+    muxSession *session = data;
+
+    LOGW("TCP mux session %s error: %s", tcpGetAddrinfo(session->conn), session->conn->errstr);
+}
+
+static void muxSessionOnTimeout(void *data) {
+    muxSession *session = data;
+
+    LOGD("TCP mux session %s idle timeout", tcpGetAddrinfo(session->conn));
+}
+
+static muxStream *muxStreamNew(muxSession *session, uint32_t id) {
+    muxStream *stream;
+
+    if (CALLOC_P(stream) == NULL) {
+        LOGW("TCP mux stream is NULL, please check the memory");
+        return NULL;
+    }
+
+    stream->id = id;
+    stream->session = session;
+    stream->conn = NULL;
+    stream->send_window = MUX_WINDOW;
+    stream->recv_window = MUX_WINDOW;
+    stream->recv_consumed = 0;
+    stream->wbuf = sdsempty();
+    stream->closing = 0;
+
+    HASH_ADD(hh, session->streams, id, sizeof(stream->id), stream);
+    if (session->stream_count++ == 0) muxSessionSetTimeout(session);
+
+    LOGD("TCP mux stream current count: %d", session->stream_count);
+
+    return stream;
+}
+
+static void muxStreamFree(muxStream *stream) {
+    muxSession *session = stream->session;
+
+    HASH_DEL(session->streams, stream);
+    if (--session->stream_count == 0 && session->conn) muxSessionSetTimeout(session);
+
+    CONN_CLOSE(stream->conn);
+    sdsfree(stream->wbuf);
+    xs_free(stream);
+}
+
+/*
+ Write the data received to conn, the window is granted back as it is consumed
+ */
+static void muxStreamFlush(muxStream *stream) {
+    tcpConn *conn = stream->conn;
+    int nwrite;
+
+    if (!tcpIsConnected(conn)) return;
+
+    if (sdslen(stream->wbuf) > 0) {
+        // Closed and freed by onClose
+        nwrite = TCP_WRITE(conn, stream->wbuf, sdslen(stream->wbuf));
+        if (nwrite == TCP_ERR) return;
+
+        sdsrange(stream->wbuf, nwrite, -1);
+        stream->recv_consumed += nwrite;
+    }
+
+    if (stream->recv_consumed >= MUX_WINDOW / 2) {
+        uint32_t inc = htonl(stream->recv_consumed);
+
+        muxSessionSend(stream->session, MUX_FRAME_WND, stream->id, (char *)&inc, sizeof(inc));
+        stream->recv_window += stream->recv_consumed;
+        stream->recv_consumed = 0;
+    }
+
+    if (sdslen(stream->wbuf) > 0) {
+        ADD_EVENT_WRITE(conn);
+        return;
+    }
+    DEL_EVENT_WRITE(conn);
+
+    if (stream->closing) muxStreamFree(stream);
+}
+
+static void muxStreamOnConnect(void *data, int status) {
+    muxStream *stream = data;
+    tcpConn *conn = stream->conn;
+
+    if (status == TCP_ERR) {
+        LOGW("TCP mux stream %s connect error: %s", CONN_GET_ADDRINFO(conn), conn->errstr);
+        return;
+    }
+    LOGD("TCP mux stream %s connect success", CONN_GET_ADDRINFO(conn));
+
+    // The data arrived while connecting is written from the write event
+    ADD_EVENT_READ(conn);
+    if (sdslen(stream->wbuf) > 0 || stream->closing) ADD_EVENT_WRITE(conn);
+}
+
+static void muxStreamOnRead(void *data) {
+    muxStream *stream = data;
+    tcpConn *conn = stream->conn;
+    int len = MIN(conn->rbuf_len, stream->send_window);
+    int nread;
+
+    if (len <= 0) {
+        DEL_EVENT_READ(conn);
+        return;
+    }
+
+    nread = TCP_READ(conn, conn->rbuf, len);
+    if (nread <= 0) return;
+
+    muxSessionSend(stream->session, MUX_FRAME_DATA, stream->id, conn->rbuf, nread);
+
+    // Wait for the peer to grant more window
+    stream->send_window -= nread;
+    if (stream->send_window <= 0) DEL_EVENT_READ(conn);
+}
+
+static void muxStreamOnWrite(void *data) {
+    muxStreamFlush(data);
+}
+
+static void muxStreamOnClose(void *data) {
+    muxStream *stream = data;
+    tcpConn *conn = stream->conn;
+    int type = conn->err == 0 || conn->err == TCP_ERROR_CLOSED ? MUX_FRAME_FIN : MUX_FRAME_RST;
+
+    LOGD("TCP mux stream %s closed connection", CONN_GET_ADDRINFO(conn));
+
+    muxSessionSend(stream->session, type, stream->id, NULL, 0);
+    muxStreamFree(stream);
+}
+
+static void muxStreamOnError(void *data) {
+    muxStream *stream = data;
+
+    LOGW("TCP mux stream %s error: %s", CONN_GET_ADDRINFO(stream->conn), stream->conn->errstr);
+}
+
+static void muxStreamOnTimeout(void *data) {
+    muxStream *stream = data;
+
+    LOGI("TCP mux stream %s read timeout", CONN_GET_ADDRINFO(stream->conn));
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_MUX_H
+#define __MODULE_MUX_H
+
+#include "lib/protocol/mux.h"
+#include "lib/protocol/tcp.h"
+
+#include "redis/adlist.h"
+#include "shadowsocks-libev/uthash.h"
+
+struct muxStream;
+
+typedef int (*muxOpenHandler)(struct muxStream *stream, char *host, int port);
+
+/* Client side, the sessions to one server that the streams are spread on */
+typedef struct tcpMux {
+    char *host;
+    int port;
+    int size;
+    uint32_t stream_id;
+    list *sessions;
+} tcpMux;
+
+typedef struct muxSession {
+    tcpMux *mux; // NULL on the server side
+    listNode *node;
+    tcpConn *conn;
+    sds rbuf; // Frames read but not handled yet
+    sds wbuf; // Frames not written to conn yet
+    struct muxStream *streams;
+    int stream_count;
+    muxOpenHandler onOpen;
+} muxSession;
+
+typedef struct muxStream {
+    uint32_t id;
+    muxSession *session;
+    tcpConn *conn;
+    int send_window;
+    int recv_window;
+    int recv_consumed; // Written to conn but not granted back yet
+    sds wbuf; // Data not written to conn yet
+    int closing;
+    UT_hash_handle hh;
+} muxStream;
+
+tcpMux *tcpMuxNew(char *host, int port, int size);
+void tcpMuxFree(tcpMux *mux);
+int tcpMuxOpen(tcpMux *mux, tcpConn *conn, char *host, int port);
+
+muxSession *muxSessionAccept(tcpConn *conn, char *buf, int buf_len, muxOpenHandler onOpen);
+void muxStreamAttach(muxStream *stream, tcpConn *conn);
+
+#endif /* __MODULE_MUX_H */
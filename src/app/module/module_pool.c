@@ -0,0 +1,189 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_pool.h"
+#include "module.h"
+
+#define TCP_POOL_REFILL_INTERVAL 1000 /* ms */
+
+static void tcpPoolRefill(tcpPool *pool);
+static void tcpPoolRefillHandler(event *e);
+
+static tcpPoolConn *tcpPoolConnNew(tcpPool *pool);
+static void tcpPoolConnFree(tcpPoolConn *pc);
+
+static void tcpPoolConnOnConnect(void *data, int status);
+static void tcpPoolConnOnRead(void *data);
+static void tcpPoolConnOnClose(void *data);
+
+tcpPool *tcpPoolNew(char *host, int port, int size, int ttl) {
+    tcpPool *pool;
+
+    if (CALLOC_P(pool) == NULL) {
+        LOGW("TCP pool is NULL, please check the memory");
+        return NULL;
+    }
+
+    pool->host = xs_strdup(host);
+    pool->port = port;
+    pool->size = size;
+    pool->ttl = ttl;
+    pool->connecting = 0;
+    pool->conns = listCreate();
+
+    pool->te = NEW_EVENT_REPEAT(TCP_POOL_REFILL_INTERVAL, tcpPoolRefillHandler, pool);
+    ADD_EVENT(app, pool->te);
+
+    tcpPoolRefill(pool);
+
+    return pool;
+}
+
+void tcpPoolFree(tcpPool *pool) {
+    if (!pool) return;
+
+    while (listLength(pool->conns)) tcpPoolConnFree(listNodeValue(listFirst(pool->conns)));
+    listRelease(pool->conns);
+
+    CLR_EVENT(pool->te);
+    xs_free(pool->host);
+    xs_free(pool);
+}
+
+int tcpPoolMatch(tcpPool *pool, char *host, int port) {
+    return pool && pool->port == port && strcmp(pool->host, host) == 0;
+}
+
+tcpConn *tcpPoolGet(tcpPool *pool, int timeout, void *data) {
+    tcpConn *conn = NULL;
+    listNode *ln;
+    listIter li;
+
+    // The newest one is the least likely to be closed by the server
+    listRewindTail(pool->conns, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        tcpPoolConn *pc = listNodeValue(ln);
+        if (!tcpIsConnected(pc->conn)) continue;
+
+        conn = pc->conn;
+        pc->conn = NULL;
+        tcpPoolConnFree(pc);
+
+        tcpDetach(conn, timeout, data);
+        break;
+    }
+
+    LOGD("TCP pool %s, idle count: %d", conn ? "hit" : "miss",
+         (int)listLength(pool->conns) - pool->connecting);
+
+    tcpPoolRefill(pool);
+
+    return conn;
+}
+
+static void tcpPoolRefill(tcpPool *pool) {
+    while ((int)listLength(pool->conns) < pool->size) {
+        if (tcpPoolConnNew(pool) == NULL) break;
+    }
+}
+
+static void tcpPoolRefillHandler(event *e) {
+    tcpPoolRefill(e->data);
+}
+
+static tcpPoolConn *tcpPoolConnNew(tcpPool *pool) {
+    tcpPoolConn *pc;
+    tcpConn *conn;
+    char err[XS_ERR_LEN];
+
+    if (CALLOC_P(pc) == NULL) {
+        LOGW("TCP pool conn is NULL, please check the memory");
+        return NULL;
+    }
+
+    conn = tcpConnect(err, app->el, pool->host, pool->port, app->config->connect_timeout, pc);
+    if (!conn) {
+        LOGW("TCP pool connect error: %s", err);
+        xs_free(pc);
+        return NULL;
+    }
+    if (tcpSetSockOpts(err, conn, &app->config->remote_sockopts) == TCP_ERR)
+        LOGD("TCP pool set socket options error: %s", err);
+    tcpInit(conn);
+
+    CONN_ON_CONNECT(conn, tcpPoolConnOnConnect);
+    CONN_ON_READ(conn, tcpPoolConnOnRead);
+    CONN_ON_CLOSE(conn, tcpPoolConnOnClose);
+
+    pc->pool = pool;
+    pc->conn = conn;
+    listAddNodeTail(pool->conns, pc);
+    pc->node = listLast(pool->conns);
+    pool->connecting++;
+
+    return pc;
+}
+
+static void tcpPoolConnFree(tcpPoolConn *pc) {
+    tcpPool *pool = pc->pool;
+
+    if (pc->conn && !tcpIsConnected(pc->conn)) pool->connecting--;
+
+    CONN_CLOSE(pc->conn);
+    listDelNode(pool->conns, pc->node);
+    xs_free(pc);
+}
+
+static void tcpPoolConnOnConnect(void *data, int status) {
+    tcpPoolConn *pc = data;
+    tcpConn *conn = pc->conn;
+
+    if (status == TCP_ERR) {
+        LOGW("TCP pool connect error: %s", conn->errstr);
+        return;
+    }
+    pc->pool->connecting--;
+
+    // Stale members are evicted by the timeout, keep it below the server timeout
+    tcpSetTimeout(conn, pc->pool->ttl);
+    ADD_EVENT_READ(conn);
+
+    LOGD("TCP pool conn %s is ready", CONN_GET_ADDRINFO(conn));
+}
+
+static void tcpPoolConnOnRead(void *data) {
+    tcpPoolConn *pc = data;
+    tcpConn *conn = pc->conn;
+    int nread;
+
+    // Closed and freed by onClose
+    nread = TCP_READ(conn, conn->rbuf, conn->rbuf_len);
+    if (nread <= 0) return;
+
+    LOGW("TCP pool conn %s got unexpected data", CONN_GET_ADDRINFO(conn));
+    tcpPoolConnFree(pc);
+}
+
+static void tcpPoolConnOnClose(void *data) {
+    tcpPoolConn *pc = data;
+
+    LOGD("TCP pool conn %s closed connection", CONN_GET_ADDRINFO(pc->conn));
+
+    tcpPoolConnFree(pc);
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_POOL_H
+#define __MODULE_POOL_H
+
+#include "lib/protocol/tcp.h"
+
+#include "redis/adlist.h"
+
+typedef struct tcpPool {
+    char *host;
+    int port;
+    int size;
+    int ttl;
+    int connecting;
+    list *conns;
+    event *te;
+} tcpPool;
+
+typedef struct tcpPoolConn {
+    tcpPool *pool;
+    tcpConn *conn;
+    listNode *node;
+} tcpPoolConn;
+
+tcpPool *tcpPoolNew(char *host, int port, int size, int ttl);
+void tcpPoolFree(tcpPool *pool);
+
+int tcpPoolMatch(tcpPool *pool, char *host, int port);
+tcpConn *tcpPoolGet(tcpPool *pool, int timeout, void *data);
+
+#endif /* __MODULE_POOL_H */
@@ -0,0 +1,93 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_reaper.h"
+#include "module.h"
+
+#include "lib/protocol/tcp.h"
+#include "lib/protocol/udp.h"
+
+#define REAPER_INTERVAL 1000 /* ms */
+#define REAPER_PRESSURE_LOW 50 /* % of the open files, the timeouts start to shrink */
+#define REAPER_PRESSURE_HIGH 90 /* % of the open files, the timeouts are the minimum */
+#define REAPER_TIMEOUT_MIN 30 /* s */
+
+static int idleReaperTimeout(int timeout, int usage);
+static void idleReaperHandler(event *e);
+
+/*
+ The conns are reclaimed by the fd usage only, their buffers are sized per conn so
+ the memory follows the same pressure.
+ */
+idleReaper *idleReaperNew(xsocksConfig *config) {
+    idleReaper *reaper;
+
+    if (config->nofile <= 0 || (config->idle_timeout <= 0 && config->timeout <= 0)) return NULL;
+
+    if (CALLOC_P(reaper) == NULL) {
+        LOGW("Idle reaper is NULL, please check the memory");
+        return NULL;
+    }
+    reaper->nofile = config->nofile;
+    reaper->tcp_timeout = config->idle_timeout;
+    reaper->udp_timeout = config->timeout;
+
+    reaper->te = NEW_EVENT_REPEAT(REAPER_INTERVAL, idleReaperHandler, reaper);
+    ADD_EVENT(app, reaper->te);
+
+    return reaper;
+}
+
+void idleReaperFree(idleReaper *reaper) {
+    if (!reaper) return;
+
+    CLR_EVENT(reaper->te);
+    xs_free(reaper);
+}
+
+/*
+ The timeout shrinks linearly from the configured one at the low pressure down to
+ REAPER_TIMEOUT_MIN at the high pressure, 0 means there is no pressure
+ */
+static int idleReaperTimeout(int timeout, int usage) {
+    if (timeout <= 0 || usage < REAPER_PRESSURE_LOW) return 0;
+
+    int min = MIN(timeout, REAPER_TIMEOUT_MIN);
+    if (usage >= REAPER_PRESSURE_HIGH) return min;
+
+    return timeout - (timeout - min) * (usage - REAPER_PRESSURE_LOW) /
+                         (REAPER_PRESSURE_HIGH - REAPER_PRESSURE_LOW);
+}
+
+static void idleReaperHandler(event *e) {
+    idleReaper *reaper = e->data;
+    int usage = (tcpConnCount() + udpConnCount()) * 100 / reaper->nofile;
+    int tcp_timeout = idleReaperTimeout(reaper->tcp_timeout, usage);
+    int udp_timeout = idleReaperTimeout(reaper->udp_timeout, usage);
+    int reaped = 0;
+
+    if (tcp_timeout > 0) reaped += tcpReapIdle(tcp_timeout);
+    if (udp_timeout > 0) reaped += udpReapIdle(udp_timeout);
+    if (reaped == 0) return;
+
+    reaper->reclaimed += reaped;
+    LOGW("Reclaimed %d idle conns at %d%% of the open files, TCP idle timeout %ds, "
+         "UDP timeout %ds, %lu in total",
+         reaped, usage, tcp_timeout, udp_timeout, reaper->reclaimed);
+}
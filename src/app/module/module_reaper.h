@@ -0,0 +1,38 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_REAPER_H
+#define __MODULE_REAPER_H
+
+#include "lib/core/config.h"
+#include "lib/event/event.h"
+
+/* Shrinks the idle timeouts as the open files run out, see idleReaperTimeout */
+typedef struct idleReaper {
+    event *te;
+    int nofile;
+    int tcp_timeout; // Idle timeouts without pressure
+    int udp_timeout;
+    unsigned long reclaimed; // Conns reclaimed so far
+} idleReaper;
+
+idleReaper *idleReaperNew(xsocksConfig *config);
+void idleReaperFree(idleReaper *reaper);
+
+#endif /* __MODULE_REAPER_H */
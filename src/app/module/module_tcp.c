@@ -19,13 +19,33 @@
 
 #include "module_tcp.h"
 #include "module.h"
+#include "module_pool.h"
+#include "module_upstream.h"
 
+#include "lib/core/sockmap.h"
 #include "lib/protocol/raw.h"
+#include "lib/protocol/resolver.h"
 #include "lib/protocol/tcp_shadowsocks.h"
 #include "lib/protocol/tcp_socks5.h"
 
-static tcpConn *tcpConnNew(int type, tcpConn *conn);
+#include "redis/anet.h"
 
+static tcpConn *tcpConnNew(int type, tcpConn *conn, crypto_t *crypto);
+
+static void tcpServerPause(tcpServer *server);
+static void tcpServerStatsHandler(event *e);
+static void tcpServerResume(tcpServer *server);
+static void tcpSourceKey(sockAddrEx *sa, unsigned char *ip);
+static tcpSource *tcpSourceAcquire(tcpServer *server, sockAddrEx *sa);
+static void tcpSourceRelease(tcpServer *server, tcpSource *src);
+static tcpDest *tcpDestAcquire(tcpServer *server, char *host);
+static void tcpDestRelease(tcpServer *server, tcpDest *dest);
+static int tcpServerReject(tcpServer *server, sockAddrEx *sa);
+
+static void tcpConnectionClassify(tcpClient *client, int nread);
+static void tcpConnectionSetClass(tcpClient *client, int cls);
+static void tcpConnectionThrottle(tcpClient *client);
+static void tcpConnectionOnResume(limitWaiter *w);
 static void tcpClientFree(tcpClient *client);
 static void tcpRemoteFree(tcpRemote *remote);
 
@@ -33,6 +53,14 @@ static void tcpClientOnClose(void *data);
 static void tcpClientOnError(void *data);
 static void tcpClientOnTimeout(void *data);
 
+static tcpRemote *tcpRemoteNewGeneric(tcpClient *client, int type, char *host, int port,
+                                      sockAddrEx *addrs, int naddrs, tcpConnectHandler onConnect);
+static int tcpRemoteConnect(char *err, tcpRemote *remote, char *host, int port, sockAddrEx *addrs,
+                            int naddrs);
+static int tcpRemoteFailover(tcpRemote *remote);
+static void tcpRemoteDropOnClose(void *data);
+
+static void tcpRemoteOnConnect(void *data, int status);
 static void tcpRemoteOnRead(void *data);
 static void tcpRemoteOnClose(void *data);
 static void tcpRemoteOnError(void *data);
@@ -48,7 +76,7 @@ tcpServer *tcpServerNew(char *host, int port, tcpEventHandler onAccept) {
     }
 
     char err[XS_ERR_LEN];
-    tcpListener *ln = tcpListen(err, app->el, host, port, server, onAccept);
+    tcpListener *ln = tcpListen(err, app->el, host, port, app->config->backlog, server, onAccept);
     if (!ln) {
         LOGE(err);
         tcpServerFree(server);
@@ -56,12 +84,34 @@ tcpServer *tcpServerNew(char *host, int port, tcpEventHandler onAccept) {
     }
     server->ln = ln;
 
+    if (netSetSockOpts(err, ln->fd, &app->config->listen_sockopts) == NET_ERR)
+        LOGW("TCP server set socket options error: %s", err);
+
+    if (app->config->priority) {
+        server->stats_te = NEW_EVENT_REPEAT(TCP_STATS_INTERVAL, tcpServerStatsHandler, server);
+        ADD_EVENT(app, server->stats_te);
+    }
+
     return server;
 }
 
 void tcpServerFree(tcpServer *server) {
     if (!server) return;
 
+    tcpSource *src, *src_tmp;
+    tcpDest *dest, *dest_tmp;
+
+    HASH_ITER(hh, server->sources, src, src_tmp) {
+        HASH_DEL(server->sources, src);
+        xs_free(src);
+    }
+    HASH_ITER(hh, server->dests, dest, dest_tmp) {
+        HASH_DEL(server->dests, dest);
+        xs_free(dest);
+    }
+
+    xs_free(server->rejects);
+    CLR_EVENT(server->stats_te);
     CONN_CLOSE(server->ln);
     xs_free(server);
 }
@@ -77,13 +127,146 @@ void tcpConnectionFree(tcpClient *client) {
     LOGD("TCP client current count: %d", server->client_count);
     LOGD("TCP remote current count: %d", server->remote_count);
 
+    if (client->flow_class == TCP_CLASS_BULK) server->bulk_count--;
+    rateLimiterCancel(app->limiter, &client->waiter);
+    resolverCancel(client->query);
+    tcpSourceRelease(server, client->source);
+    sockmapDelPair(client->sockmap_slot);
     tcpRemoteFree(client->remote);
     tcpClientFree(client);
+
+    if (server->paused) tcpServerResume(server);
+}
+
+static void tcpServerStatsHandler(event *e) {
+    tcpServer *server = e->data;
+    tcpLatency *in = &server->latency[TCP_CLASS_INTERACTIVE];
+    tcpLatency *bulk = &server->latency[TCP_CLASS_BULK];
+
+    if (in->chunks + bulk->chunks == 0) return;
+
+    LOGI("TCP sessions: %d, bulk: %d, relay delay interactive avg %.2fms max %.2fms of %llu "
+         "chunks, bulk avg %.2fms max %.2fms of %llu chunks",
+         server->client_count, server->bulk_count,
+         in->chunks ? in->total / MILLISECOND_UNIT_F / in->chunks : 0, in->max / MILLISECOND_UNIT_F,
+         (unsigned long long)in->chunks,
+         bulk->chunks ? bulk->total / MILLISECOND_UNIT_F / bulk->chunks : 0,
+         bulk->max / MILLISECOND_UNIT_F, (unsigned long long)bulk->chunks);
+
+    memset(server->latency, 0, sizeof(server->latency));
+}
+
+/*
+ Stop accepting, the pending conns wait in the listen backlog instead of being
+ accepted only to fail on the limits.
+ */
+static void tcpServerPause(tcpServer *server) {
+    if (server->paused) return;
+
+    DEL_EVENT_READ(server->ln);
+    server->paused = 1;
+    LOGW("TCP server pauses accept with %d clients", server->client_count);
 }
 
-static tcpConn *tcpConnNew(int type, tcpConn *conn) {
+/*
+ Accept again once the clients drop 10% below max_clients, so it is not flipped
+ on every close at the limit.
+ */
+static void tcpServerResume(tcpServer *server) {
+    int max = app->config->max_clients;
+
+    if (max > 0 && server->client_count >= max - max / 10) return;
+
+    ADD_EVENT_READ(server->ln);
+    server->paused = 0;
+    LOGI("TCP server resumes accept with %d clients", server->client_count);
+}
+
+static void tcpSourceKey(sockAddrEx *sa, unsigned char *ip) {
+    memset(ip, 0, 16);
+    if (sa->sa.ss_family == AF_INET6) {
+        memcpy(ip, &((struct sockaddr_in6 *)&sa->sa)->sin6_addr, 16);
+    } else {
+        ip[10] = ip[11] = 0xff;
+        memcpy(ip + 12, &((struct sockaddr_in *)&sa->sa)->sin_addr, 4);
+    }
+}
+
+static tcpSource *tcpSourceAcquire(tcpServer *server, sockAddrEx *sa) {
+    unsigned char ip[16];
+    tcpSource *src;
+
+    tcpSourceKey(sa, ip);
+    HASH_FIND(hh, server->sources, ip, sizeof(ip), src);
+    if (!src) {
+        if ((src = xs_calloc(sizeof(*src))) == NULL) return NULL;
+        memcpy(src->ip, ip, sizeof(ip));
+        HASH_ADD(hh, server->sources, ip, sizeof(src->ip), src);
+    } else if (src->count >= app->config->max_clients_per_ip) {
+        return NULL;
+    }
+    src->count++;
+
+    return src;
+}
+
+static void tcpSourceRelease(tcpServer *server, tcpSource *src) {
+    if (!src || --src->count > 0) return;
+
+    HASH_DEL(server->sources, src);
+    xs_free(src);
+}
+
+/*
+ Count a failed handshake of the source, returns the count so far
+ */
+static int tcpServerReject(tcpServer *server, sockAddrEx *sa) {
+    unsigned char ip[16];
+    uint32_t hash = 2166136261u;
+    tcpReject *r;
+
+    if (!server->rejects && (server->rejects = xs_calloc(TCP_REJECT_SLOTS * sizeof(tcpReject))) == NULL)
+        return 0;
+
+    tcpSourceKey(sa, ip);
+    for (int i = 0; i < 16; i++) hash = (hash ^ ip[i]) * 16777619u;
+
+    r = &server->rejects[hash % TCP_REJECT_SLOTS];
+    if (memcmp(r->ip, ip, sizeof(ip)) != 0) {
+        memcpy(r->ip, ip, sizeof(ip));
+        r->count = 0;
+    }
+
+    return ++r->count;
+}
+
+static tcpDest *tcpDestAcquire(tcpServer *server, char *host) {
+    size_t len = strlen(host);
+    tcpDest *dest;
+
+    HASH_FIND(hh, server->dests, host, len, dest);
+    if (!dest) {
+        if ((dest = xs_calloc(sizeof(*dest) + len + 1)) == NULL) return NULL;
+        memcpy(dest->host, host, len);
+        HASH_ADD_KEYPTR(hh, server->dests, dest->host, len, dest);
+    } else if (dest->count >= app->config->max_connects_per_dest) {
+        return NULL;
+    }
+    dest->count++;
+
+    return dest;
+}
+
+static void tcpDestRelease(tcpServer *server, tcpDest *dest) {
+    if (!dest || --dest->count > 0) return;
+
+    HASH_DEL(server->dests, dest);
+    xs_free(dest);
+}
+
+static tcpConn *tcpConnNew(int type, tcpConn *conn, crypto_t *crypto) {
     switch (type) {
-        case CONN_TYPE_SHADOWSOCKS: return (tcpConn *)tcpShadowsocksConnNew(conn, app->crypto);
+        case CONN_TYPE_SHADOWSOCKS: return (tcpConn *)tcpShadowsocksConnNew(conn, crypto);
         case CONN_TYPE_RAW: return (tcpConn *)tcpRawConnNew(conn);
         case CONN_TYPE_SOCKS5: return (tcpConn *)tcpSocks5ConnNew(conn);
         default: return conn;
@@ -93,20 +276,44 @@ static tcpConn *tcpConnNew(int type, tcpConn *conn) {
 tcpClient *tcpClientNew(tcpServer *server, int type, tcpEventHandler onRead) {
     tcpClient *client;
     tcpConn *conn;
+    arena *a;
     char err[XS_ERR_LEN];
 
-    if ((client = xs_calloc(sizeof(*client))) == NULL) {
+    if ((a = arenaNew(TCP_SESSION_ARENA_SIZE)) == NULL ||
+        (client = arenaAlloc(a, sizeof(*client))) == NULL) {
         LOGE("TCP client is NULL, please check the memory");
+        arenaFree(a);
         return NULL;
     }
+    client->arena = a;
 
-    if ((conn = tcpAccept(err, app->el, server->ln->fd, app->config->timeout, client)) == NULL) {
+    if ((conn = tcpAccept(err, app->el, server->ln->fd, app->config->handshake_timeout, client)) == NULL) {
+        // Out of fds, the listener would keep firing until a client goes away
+        if ((errno == EMFILE || errno == ENFILE) && server->client_count > 0) tcpServerPause(server);
         LOGW(err);
         tcpClientFree(client);
         return NULL;
     }
-    client->conn = tcpConnNew(type, conn);
+    if (app->config->max_clients_per_ip > 0 &&
+        (client->source = tcpSourceAcquire(server, &conn->rsa)) == NULL) {
+        LOGD("TCP client %s is over the max clients per IP", netFormatSockAddr(&conn->rsa));
+        CONN_CLOSE(conn);
+        tcpClientFree(client);
+        return NULL;
+    }
+    tcpSetIdleTimeout(conn, app->config->idle_timeout);
+    if (tcpSetSockOpts(err, conn, &app->config->client_sockopts) == TCP_ERR)
+        LOGD("TCP client set socket options error: %s", err);
+    client->type = type;
+    client->conn = tcpConnNew(type, conn, app->crypto);
     client->server = server;
+    client->sockmap_slot = -1;
+    if (app->limiter) tokenBucketInit(&client->bucket, app->limiter->session_rate);
+
+    server->client_count++;
+    LOGD("TCP client current count: %d", server->client_count);
+    if (app->config->max_clients > 0 && server->client_count >= app->config->max_clients)
+        tcpServerPause(server);
 
     CONN_ON_READ(client->conn, onRead);
     CONN_ON_CLOSE(client->conn, tcpClientOnClose);
@@ -122,7 +329,7 @@ static void tcpClientFree(tcpClient *client) {
     if (!client) return;
 
     CONN_CLOSE(client->conn);
-    xs_free(client);
+    arenaFree(client->arena);
 }
 
 static void tcpClientOnClose(void *data) {
@@ -137,6 +344,15 @@ static void tcpClientOnError(void *data) {
     tcpClient *client = data;
     tcpRemote *remote = client->remote;
 
+    // Drained by the conn until closed, the source may be probing
+    if (client->type == CONN_TYPE_SHADOWSOCKS &&
+        ((tcpShadowsocksConn *)client->conn)->state == SHADOWSOCKS_STATE_REJECT) {
+        int count = tcpServerReject(client->server, &client->conn->rsa);
+        LOGI("TCP client %s rejected (%d from the source): %s",
+             netFormatSockAddr(&client->conn->rsa), count, client->conn->errstr);
+        return;
+    }
+
     LOGW("TCP client %s pipe error: %s", CONN_GET_ADDRINFO(client->conn),
          client->conn->err != 0 ? client->conn->errstr : remote->conn->errstr);
 }
@@ -149,54 +365,313 @@ static void tcpClientOnTimeout(void *data) {
 
 tcpRemote *tcpRemoteNew(tcpClient *client, int type, char *host, int port,
                         tcpConnectHandler onConnect) {
+    return tcpRemoteNewGeneric(client, type, host, port, NULL, 0, onConnect);
+}
+
+/*
+ Connect to the addresses resolved by the caller, host only names the destination
+ */
+tcpRemote *tcpRemoteNewAddr(tcpClient *client, int type, char *host, sockAddrEx *addrs, int naddrs,
+                            tcpConnectHandler onConnect) {
+    return tcpRemoteNewGeneric(client, type, host, 0, addrs, naddrs, onConnect);
+}
+
+static tcpRemote *tcpRemoteNewGeneric(tcpClient *client, int type, char *host, int port,
+                                      sockAddrEx *addrs, int naddrs, tcpConnectHandler onConnect) {
     tcpRemote *remote;
-    tcpConn *conn;
     char err[XS_ERR_LEN];
 
-    remote = xs_calloc(sizeof(*remote));
+    remote = arenaAlloc(client->arena, sizeof(*remote));
     if (!remote) {
         LOGE("TCP remote is NULL, please check the memory");
         return NULL;
     }
-
-    conn = tcpConnect(err, app->el, host, port, app->config->timeout, remote);
-    if (!conn) {
-        LOGW("TCP remote %s connect error: %s", CONN_GET_ADDRINFO(client->conn), err);
-        tcpRemoteFree(remote);
+    remote->type = type;
+    remote->client = client;
+    remote->onConnect = onConnect;
+
+    // Proxied conns go to the best upstream server instead
+    if (type == CONN_TYPE_SHADOWSOCKS && app->upstreams) {
+        remote->upstream = upstreamSelect(app->upstreams, NULL);
+        upstreamAcquire(remote->upstream);
+    } else if (host && app->config->max_connects_per_dest > 0 &&
+               (remote->dest = tcpDestAcquire(client->server, host)) == NULL) {
+        LOGW("TCP remote %s is over the max connects to %s", CONN_GET_ADDRINFO(client->conn), host);
         return NULL;
     }
-    remote->client = client;
-    remote->conn = tcpConnNew(type, conn);
 
-    CONN_ON_CONNECT(remote->conn, onConnect);
-    CONN_ON_READ(remote->conn, tcpRemoteOnRead);
-    CONN_ON_CLOSE(remote->conn, tcpRemoteOnClose);
-    CONN_ON_ERROR(remote->conn, tcpRemoteOnError);
-    CONN_ON_TIMEOUT(remote->conn, tcpRemoteOnTimeout);
+    if (tcpRemoteConnect(err, remote, host, port, addrs, naddrs) == TCP_ERR) {
+        LOGW("TCP remote %s connect error: %s", CONN_GET_ADDRINFO(client->conn), err);
+        if (!remote->upstream || tcpRemoteFailover(remote) == TCP_ERR) {
+            tcpRemoteFree(remote);
+            return NULL;
+        }
+    }
 
     LOGD("TCP remote %s is connecting ...", CONN_GET_ADDRINFO(client->conn));
-    LOGD("TCP remote current count: %d", ++client->server->remote_count);
+    client->server->remote_count++;
+    LOGD("TCP remote current count: %d", client->server->remote_count);
 
     // Prepare remote connect
     client->remote = remote;
+    tcpSetIdleTimeout(client->conn, -1);
     tcpSetTimeout(client->conn, -1);
     DEL_EVENT_READ(client->conn);
 
     return remote;
 }
 
+static int tcpRemoteConnect(char *err, tcpRemote *remote, char *host, int port, sockAddrEx *addrs,
+                            int naddrs) {
+    crypto_t *crypto = app->crypto;
+    tcpConn *conn = NULL;
+
+    remote->attempts++;
+    if (remote->upstream) {
+        host = remote->upstream->host;
+        port = remote->upstream->port;
+        crypto = remote->upstream->crypto;
+        addrs = NULL;
+    }
+
+    if (addrs) {
+        conn = tcpConnectAddr(err, app->el, host, addrs, naddrs, app->config->connect_timeout, remote);
+    } else {
+        if (remote->type == CONN_TYPE_SHADOWSOCKS && tcpPoolMatch(app->pool, host, port))
+            conn = tcpPoolGet(app->pool, app->config->connect_timeout, remote);
+        if (!conn) conn = tcpConnect(err, app->el, host, port, app->config->connect_timeout, remote);
+    }
+    if (!conn) return TCP_ERR;
+
+    tcpSetIdleTimeout(conn, app->config->idle_timeout);
+    if (tcpSetSockOpts(err, conn, &app->config->remote_sockopts) == TCP_ERR)
+        LOGD("TCP remote set socket options error: %s", err);
+    remote->conn = tcpConnNew(remote->type, conn, crypto);
+    remote->connect_start = timerStart();
+
+    CONN_ON_CONNECT(remote->conn, tcpRemoteOnConnect);
+    CONN_ON_READ(remote->conn, tcpRemoteOnRead);
+    CONN_ON_CLOSE(remote->conn, tcpRemoteOnClose);
+    CONN_ON_ERROR(remote->conn, tcpRemoteOnError);
+    CONN_ON_TIMEOUT(remote->conn, tcpRemoteOnTimeout);
+
+    return TCP_OK;
+}
+
+/*
+ The upstream server failed, connect to the next one with the same dest. The client is
+ untouched, and the failed conn is closed by the close event that follows.
+ */
+static int tcpRemoteFailover(tcpRemote *remote) {
+    tcpShadowsocksConn *old = (tcpShadowsocksConn *)remote->conn;
+    tcpShadowsocksConn *conn;
+    char err[XS_ERR_LEN];
+
+    remote->conn = NULL;
+    while (!remote->conn) {
+        upstream *up = remote->upstream;
+
+        upstreamConnectDone(up, TCP_ERR, 0);
+        if (remote->attempts >= app->upstreams->size) {
+            remote->conn = (tcpConn *)old;
+            return TCP_ERR;
+        }
+
+        remote->upstream = upstreamSelect(app->upstreams, up);
+        upstreamRelease(up);
+        upstreamAcquire(remote->upstream);
+
+        if (tcpRemoteConnect(err, remote, NULL, 0, NULL, 0) == TCP_ERR)
+            LOGW("TCP remote %s failover error: %s", CONN_GET_ADDRINFO(remote->client->conn), err);
+    }
+
+    LOGI("TCP remote %s fails over to %s:%d", CONN_GET_ADDRINFO(remote->client->conn),
+         remote->upstream->host, remote->upstream->port);
+
+    if (old) {
+        conn = (tcpShadowsocksConn *)remote->conn;
+        memcpy(conn->addrbuf_dest, old->addrbuf_dest, old->addrbuf_dest_len);
+        conn->addrbuf_dest_len = old->addrbuf_dest_len;
+
+        old->conn.data = old;
+        CONN_ON_CONNECT(&old->conn, NULL);
+        CONN_ON_TIMEOUT(&old->conn, NULL);
+        CONN_ON_ERROR(&old->conn, NULL);
+        CONN_ON_READ(&old->conn, NULL);
+        CONN_ON_CLOSE(&old->conn, tcpRemoteDropOnClose);
+    }
+
+    return TCP_OK;
+}
+
+/*
+ Close the remote of a client before it carried anything, so the client can connect elsewhere
+ */
+void tcpRemoteDrop(tcpClient *client) {
+    if (!client->remote) return;
+
+    tcpRemoteFree(client->remote);
+    client->remote = NULL;
+    client->server->remote_count--;
+}
+
+static void tcpRemoteDropOnClose(void *data) {
+    tcpConn *conn = data;
+
+    CONN_CLOSE(conn);
+}
+
 static void tcpRemoteFree(tcpRemote *remote) {
     if (!remote) return;
 
+    tcpDestRelease(remote->client->server, remote->dest);
+    if (remote->upstream) upstreamRelease(remote->upstream);
     CONN_CLOSE(remote->conn);
-    xs_free(remote);
+}
+
+static void tcpRemoteOnConnect(void *data, int status) {
+    tcpRemote *remote = data;
+
+    tcpDestRelease(remote->client->server, remote->dest);
+    remote->dest = NULL;
+
+    if (remote->upstream) {
+        if (status == TCP_OK)
+            upstreamConnectDone(remote->upstream, TCP_OK, remote->connect_start);
+        else if (tcpRemoteFailover(remote) == TCP_OK)
+            return;
+    }
+
+    remote->onConnect(remote, status);
 }
 
 static void tcpRemoteOnRead(void *data) {
     tcpRemote *remote = data;
     tcpClient *client = remote->client;
 
-    tcpPipe(remote->conn, client->conn);
+    if (tcpConnectionPipe(client, remote->conn, client->conn) > 0) tcpConnectionSockmap(client);
+}
+
+/*
+ Relay one chunk of the session. The session is freed when it returns an error or 0.
+ */
+int tcpConnectionPipe(tcpClient *client, tcpConn *src, tcpConn *dst) {
+    int nread = tcpPipe(src, dst);
+
+    if (nread <= 0) return nread;
+
+    if (app->config->priority) tcpConnectionClassify(client, nread);
+    if (app->limiter && rateLimiterTake(app->limiter, &client->bucket, nread) == LIMIT_WAIT)
+        tcpConnectionThrottle(client);
+
+    return nread;
+}
+
+/*
+ A session relaying fast with mostly full reads is bulk, its events then wait for the
+ others of the same poll. It goes back to interactive after a slow window.
+ */
+static void tcpConnectionClassify(tcpClient *client, int nread) {
+    tcpLatency *latency = &client->server->latency[client->flow_class];
+    uint64_t now = timerStart();
+    uint64_t wake = eventLoopWakeTime(app->el);
+    uint64_t delay = now > wake ? now - wake : 0;
+    uint64_t elapsed;
+    int bulk;
+
+    latency->chunks++;
+    latency->total += delay;
+    if (delay > latency->max) latency->max = delay;
+
+    if (client->flow_start == 0) client->flow_start = now;
+    client->flow_bytes += nread;
+    client->flow_reads++;
+    if (nread <= TCP_FLOW_SMALL_READ) client->flow_small++;
+
+    elapsed = now - client->flow_start;
+    if (elapsed < TCP_FLOW_WINDOW) return;
+
+    bulk = client->flow_bytes * MICROSECOND_UNIT / elapsed >= TCP_FLOW_BULK_RATE &&
+           client->flow_small * 2 < client->flow_reads;
+
+    client->flow_start = now;
+    client->flow_bytes = 0;
+    client->flow_reads = 0;
+    client->flow_small = 0;
+
+    tcpConnectionSetClass(client, bulk ? TCP_CLASS_BULK : TCP_CLASS_INTERACTIVE);
+}
+
+/*
+ The bytes stay in the socket buffers meanwhile, so the peer is slowed by TCP itself
+ */
+static void tcpConnectionThrottle(tcpClient *client) {
+    tcpPause(client->conn);
+    if (client->remote) tcpPause(client->remote->conn);
+
+    client->waiter.bucket = &client->bucket;
+    client->waiter.onResume = tcpConnectionOnResume;
+    client->waiter.data = client;
+    rateLimiterWait(app->limiter, &client->waiter);
+}
+
+static void tcpConnectionOnResume(limitWaiter *w) {
+    tcpClient *client = w->data;
+
+    tcpResume(client->conn);
+    if (client->remote) tcpResume(client->remote->conn);
+}
+
+static void tcpConnectionSetClass(tcpClient *client, int cls) {
+    int priority = cls == TCP_CLASS_BULK ? EVENT_PRIORITY_LOW : EVENT_PRIORITY_NORMAL;
+
+    if (cls == client->flow_class) return;
+
+    client->flow_class = cls;
+    client->server->bulk_count += cls == TCP_CLASS_BULK ? 1 : -1;
+
+    tcpSetPriority(client->conn, priority);
+    if (client->remote) tcpSetPriority(client->remote->conn, priority);
+
+    LOGD("TCP client %s is now %s", CONN_GET_ADDRINFO(client->conn),
+         cls == TCP_CLASS_BULK ? "bulk" : "interactive");
+}
+
+/*
+ Hand a connected bypass pair over to the kernel sockmap. It is only done when
+ nothing is queued in userland or in the receive buffers, else it is tried again
+ after the next pipe. The read events are kept to catch EOF and the errors.
+ */
+void tcpConnectionSockmap(tcpClient *client) {
+    tcpRemote *remote = client->remote;
+    tcpConn *c = client->conn;
+    tcpConn *r;
+    char err[XS_ERR_LEN];
+
+    // The kernel relay is not shaped
+    if (!sockmapIsEnabled() || client->sockmap_slot != -1 || app->limiter) return;
+    if (!remote || remote->type != CONN_TYPE_RAW || !tcpIsConnected(remote->conn)) return;
+
+    r = remote->conn;
+    if (c->rbuf_off || c->wbuf_len || r->rbuf_off || r->wbuf_len) return;
+    if (netReadPending(c->fd) != 0 || netReadPending(r->fd) != 0) return;
+
+    if ((client->sockmap_slot = sockmapAddPair(err, c->fd, r->fd)) == NET_ERR) {
+        LOGD("TCP client %s sockmap error: %s", CONN_GET_ADDRINFO(c), err);
+        client->sockmap_slot = -1;
+        return;
+    }
+
+    // Userland sees no more traffic, so let keepalive find the dead peers
+    tcpSetIdleTimeout(c, -1);
+    tcpSetIdleTimeout(r, -1);
+    if (app->config->idle_timeout > 0) {
+        int interval = MAX(app->config->idle_timeout, 3);
+        anetKeepAlive(NULL, c->fd, interval);
+        anetKeepAlive(NULL, r->fd, interval);
+    }
+
+    LOGD("TCP client %s is relayed by sockmap", CONN_GET_ADDRINFO(c));
 }
 
 static void tcpRemoteOnClose(void *data) {
@@ -221,6 +696,8 @@ static void tcpRemoteOnTimeout(void *data) {
     tcpClient *client = remote->client;
     char *addr_info = CONN_GET_ADDRINFO(client->conn);
 
+    if (remote->upstream && !tcpIsConnected(remote->conn) && tcpRemoteFailover(remote) == TCP_OK) return;
+
     if (tcpIsConnected(remote->conn))
         LOGI("TCP remote %s read timeout", addr_info);
     else
@@ -20,25 +20,95 @@
 #ifndef __MODULE_TCP_H
 #define __MODULE_TCP_H
 
+#include "module_limit.h"
+
+#include "lib/core/arena.h"
 #include "lib/protocol/tcp.h"
 
+#include "shadowsocks-libev/uthash.h"
+
+#define TCP_SOCKMAP_SIZE 4096
+#define TCP_SESSION_ARENA_SIZE 256
+#define TCP_REJECT_SLOTS 1024
+#define TCP_FLOW_WINDOW 1000000 /* us, the sessions are classified once per window */
+#define TCP_FLOW_SMALL_READ 512 /* Bytes, a keystroke or a game tick fits in one read */
+#define TCP_FLOW_BULK_RATE (256 * 1024) /* Bytes/s, above it mostly full reads is bulk */
+#define TCP_STATS_INTERVAL 60000 /* ms */
+
+enum {
+    TCP_CLASS_INTERACTIVE = 0,
+    TCP_CLASS_BULK = 1,
+    TCP_CLASS_MAX = 2,
+};
+
+/* Delay from the poll wakeup to the relay of a chunk, reset every report */
+typedef struct tcpLatency {
+    uint64_t chunks;
+    uint64_t total; // us
+    uint64_t max; // us
+} tcpLatency;
+
 typedef struct tcpServer {
     tcpListener *ln;
     int client_count;
     int remote_count;
+    int paused; // Accept is stopped until the clients drop below the watermark
+    struct tcpSource *sources; // Only kept with max_clients_per_ip
+    struct tcpDest *dests; // Only kept with max_connects_per_dest
+    struct tcpReject *rejects; // TCP_REJECT_SLOTS, allocated on the first reject
+    int bulk_count; // Sessions classified as bulk, only kept with priority
+    tcpLatency latency[TCP_CLASS_MAX];
+    event *stats_te;
 } tcpServer;
 
+/* Clients of one source IP, IPv4 is keyed in its IPv6 mapped form */
+typedef struct tcpSource {
+    unsigned char ip[16];
+    int count;
+    UT_hash_handle hh;
+} tcpSource;
+
+/* Handshakes failed by one source IP, the slot is taken over by another IP on collision */
+typedef struct tcpReject {
+    unsigned char ip[16];
+    int count;
+} tcpReject;
+
+/* Remotes connecting to one dest host */
+typedef struct tcpDest {
+    int count;
+    UT_hash_handle hh;
+    char host[];
+} tcpDest;
+
 typedef struct tcpClient {
+    arena *arena; // The client and its remote live here, freed in one go
     int type;
     tcpConn *conn;
     tcpServer *server;
+    tcpSource *source;
     struct tcpRemote *remote;
+    int sockmap_slot; // -1 unless the pair is relayed by the kernel
+    void *data; // Owned by the app, e.g. in the arena
+    int flow_class; // TCP_CLASS_*, both directions of the session count
+    uint64_t flow_start; // Current classify window, from its first relayed chunk
+    uint64_t flow_bytes;
+    int flow_reads;
+    int flow_small; // Reads up to TCP_FLOW_SMALL_READ
+    tokenBucket bucket; // Only used with session_rate_limit
+    limitWaiter waiter; // Both conns stop reading while waiting
+    struct resolverQuery *query; // Lookup of the dest host for the ACL
 } tcpClient;
 
 typedef struct tcpRemote {
     int type;
     tcpConn *conn;
     tcpClient *client;
+    tcpConnectHandler onConnect;
+    struct upstream *upstream; // Proxied conns only
+    tcpDest *dest; // Held until the connect is done
+    int attempts;
+    uint64_t connect_start;
 } tcpRemote;
 
 tcpServer *tcpServerNew(char *host, int port, tcpEventHandler onAccept);
@@ -47,6 +117,11 @@ void tcpServerFree(tcpServer *server);
 tcpClient *tcpClientNew(tcpServer *server, int type, tcpEventHandler onRead);
 tcpRemote *tcpRemoteNew(tcpClient *client, int type, char *host, int port,
                         tcpConnectHandler onConnect);
+tcpRemote *tcpRemoteNewAddr(tcpClient *client, int type, char *host, sockAddrEx *addrs, int naddrs,
+                            tcpConnectHandler onConnect);
+void tcpRemoteDrop(tcpClient *client);
 void tcpConnectionFree(tcpClient *client);
+void tcpConnectionSockmap(tcpClient *client);
+int tcpConnectionPipe(tcpClient *client, tcpConn *src, tcpConn *dst);
 
 #endif /* __MODULE_TCP_H */
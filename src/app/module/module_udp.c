@@ -19,14 +19,18 @@
 
 #include "module_udp.h"
 #include "module.h"
+#include "module_upstream.h"
 
 #include "lib/protocol/raw.h"
 #include "lib/protocol/udp_shadowsocks.h"
 
-static udpConn *udpConnNew(int type, udpConn *conn);
+static udpConn *udpConnNew(int type, udpConn *conn, crypto_t *crypto);
 
+static void udpServerOnResume(limitWaiter *w);
 static void udpClientFree(udpClient *client);
 static void udpRemoteFree(udpRemote *remote);
+static int udpRemoteSetAddr(udpClient *client, sockAddrEx *addrs, int naddrs, int af);
+static void udpRemoteOnResolved(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err);
 
 static void udpRemoteOnRead(void *data);
 static void udpRemoteOnClose(void *data);
@@ -49,7 +53,7 @@ udpServer *udpServerNew(char *host, int port, int type, udpEventHandler onRead)
         udpServerFree(server);
         return NULL;
     }
-    server->conn = udpConnNew(type, conn);
+    server->conn = udpConnNew(type, conn, app->crypto);
 
     CONN_ON_READ(server->conn, onRead);
 
@@ -59,13 +63,33 @@ udpServer *udpServerNew(char *host, int port, int type, udpEventHandler onRead)
 void udpServerFree(udpServer *server) {
     if (!server) return;
 
+    rateLimiterCancel(app->limiter, &server->waiter);
     CONN_CLOSE(server->conn);
     xs_free(server);
 }
 
-static udpConn *udpConnNew(int type, udpConn *conn) {
+/*
+ Charge a relayed datagram to the port. Once it is over, the datagrams queue in the
+ socket buffer of the server until the rate allows, or the kernel drops them.
+ */
+void udpServerCharge(udpServer *server, int len) {
+    if (!app->limiter || rateLimiterTake(app->limiter, NULL, len) == LIMIT_OK) return;
+
+    DEL_EVENT_READ(server->conn);
+    server->waiter.onResume = udpServerOnResume;
+    server->waiter.data = server;
+    rateLimiterWait(app->limiter, &server->waiter);
+}
+
+static void udpServerOnResume(limitWaiter *w) {
+    udpServer *server = w->data;
+
+    ADD_EVENT_READ(server->conn);
+}
+
+static udpConn *udpConnNew(int type, udpConn *conn, crypto_t *crypto) {
     switch (type) {
-        case CONN_TYPE_SHADOWSOCKS: return (udpConn *)udpShadowsocksConnNew(conn, app->crypto);
+        case CONN_TYPE_SHADOWSOCKS: return (udpConn *)udpShadowsocksConnNew(conn, crypto);
         case CONN_TYPE_RAW: return (udpConn *)udpRawConnNew(conn);
         default: return conn;
     }
@@ -73,11 +97,15 @@ static udpConn *udpConnNew(int type, udpConn *conn) {
 
 udpClient *udpClientNew(udpServer *server) {
     udpClient *client;
+    arena *a;
 
-    if (CALLOC_P(client) == NULL) {
+    if ((a = arenaNew(UDP_SESSION_ARENA_SIZE)) == NULL ||
+        (client = arenaAlloc(a, sizeof(*client))) == NULL) {
         LOGW("UDP client is NULL, please check the memory");
+        arenaFree(a);
         return NULL;
     }
+    client->arena = a;
 
     client->server = server;
     netSockAddrExInit(&client->sa_client);
@@ -91,19 +119,52 @@ udpRemote *udpRemoteNew(udpClient *client, int type, char *host, int port) {
     udpConn *conn;
     char err[XS_ERR_LEN];
 
-    if (CALLOC_P(remote) == NULL) {
+    if ((remote = arenaAlloc(client->arena, sizeof(*remote))) == NULL) {
         LOGW("UDP remote is NULL, please check the memory");
         return NULL;
     }
 
-    conn = udpCreate(err, app->el, NULL, 0, app->config->ipv6_first, app->config->timeout, remote);
+    // Proxied packets go to the best upstream server, a down one is skipped
+    crypto_t *crypto = app->crypto;
+    if (type == CONN_TYPE_SHADOWSOCKS && app->upstreams) {
+        upstream *up = upstreamSelect(app->upstreams, NULL);
+        host = up->host;
+        port = up->port;
+        crypto = up->crypto;
+    }
+
+    remote->client = client;
+
+    // A name is looked up on the loop, the socket is of the family it has to answer with
+    sockAddrEx addrs[NET_CONNECT_MAX_ADDRS];
+    int af = app->config->ipv6_first ? AF_INET6 : AF_INET;
+    int naddrs;
+
+    naddrs = resolverResolve(err, host, port, addrs, NET_CONNECT_MAX_ADDRS, udpRemoteOnResolved,
+                             remote, &remote->query);
+    if (naddrs == NET_ERR) {
+        LOGW("Get UDP remote sockaddr error: %s", err);
+        udpRemoteFree(remote);
+        return NULL;
+    }
+    if (naddrs > 0) {
+        udpRemoteSetAddr(client, addrs, naddrs, AF_UNSPEC);
+        af = client->sa_remote.sa.ss_family;
+    }
+
+    // Source address of the family of the remote
+    char ip[NET_IP_MAX_STR_LEN];
+    char *bindaddr = NULL;
+    sockAddrEx *sa = netOutboundGet(af);
+    if (sa && netIpPresentBySockAddr(NULL, ip, sizeof(ip), NULL, sa) == NET_OK) bindaddr = ip;
+
+    conn = udpCreate(err, app->el, bindaddr, 0, af == AF_INET6, app->config->timeout, remote);
     if (!conn) {
         LOGW("UDP remote create error: %s", err);
         udpRemoteFree(remote);
         return NULL;
     }
-    remote->client = client;
-    remote->conn = udpConnNew(type, conn);
+    remote->conn = udpConnNew(type, conn, crypto);
 
     CONN_ON_READ(remote->conn, udpRemoteOnRead);
     CONN_ON_CLOSE(remote->conn, udpRemoteOnClose);
@@ -111,17 +172,29 @@ udpRemote *udpRemoteNew(udpClient *client, int type, char *host, int port) {
     CONN_ON_TIMEOUT(remote->conn, udpRemoteOnTimeout);
 
     client->remote = remote;
-    if (netUdpGetSockAddrEx(err, host, port, app->config->ipv6_first, &client->sa_remote) == NET_ERR) {
-        LOGW("Get UDP remote sockaddr error: %s", err);
-        udpRemoteFree(remote);
-        return NULL;
-    }
 
-    LOGD("UDP remote current count: %d", ++client->server->remote_count);
+    client->server->remote_count++;
+    LOGD("UDP remote current count: %d", client->server->remote_count);
 
     return remote;
 }
 
+/*
+ Write a datagram to the remote, or hold it while the remote host is looked up. A
+ session carries one datagram each way, so only the first one is held.
+ */
+int udpRemoteWrite(udpRemote *remote, ioBuf *b) {
+    if (!remote->query) return UDP_WRITE(remote->conn, b, &remote->client->sa_remote);
+    if (remote->pending) return 0;
+
+    // The read buffer of the server is reused by the next read
+    remote->pending = ioBufNew(UDP_BUF_HEADROOM + b->len + UDP_BUF_TAILROOM, UDP_BUF_HEADROOM);
+    if (!remote->pending) return UDP_ERR;
+    ioBufAppend(remote->pending, IOBUF_DATA(b), b->len);
+
+    return b->len;
+}
+
 void udpConnectionFree(udpClient *client) {
     if (!client) return;
 
@@ -137,35 +210,75 @@ void udpConnectionFree(udpClient *client) {
 static void udpClientFree(udpClient *client) {
     if (!client) return;
 
-    FREE_P(client);
+    arenaFree(client->arena);
 }
 
 static void udpRemoteFree(udpRemote *remote) {
     if (!remote) return;
 
+    resolverCancel(remote->query);
+    ioBufRelease(remote->pending);
     CONN_CLOSE(remote->conn);
-    FREE_P(remote);
+}
+
+/*
+ The first address of af, or of the preferred family when af is AF_UNSPEC
+ */
+static int udpRemoteSetAddr(udpClient *client, sockAddrEx *addrs, int naddrs, int af) {
+    int prefer_af = app->config->ipv6_first ? AF_INET6 : AF_INET;
+
+    for (int i = 0; i < naddrs; i++) {
+        if (addrs[i].sa.ss_family == (af == AF_UNSPEC ? prefer_af : af)) {
+            memcpy(&client->sa_remote, &addrs[i], sizeof(addrs[i]));
+            return NET_OK;
+        }
+    }
+    if (af != AF_UNSPEC || naddrs == 0) return NET_ERR;
+
+    memcpy(&client->sa_remote, &addrs[0], sizeof(addrs[0]));
+    return NET_OK;
+}
+
+static void udpRemoteOnResolved(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err) {
+    udpRemote *remote = data;
+    udpClient *client = remote->client;
+    int af = app->config->ipv6_first ? AF_INET6 : AF_INET;
+
+    remote->query = NULL;
+    if (naddrs == NET_ERR || udpRemoteSetAddr(client, addrs, naddrs, af) == NET_ERR) {
+        LOGW("UDP remote resolve %s error: %s", host,
+             naddrs == NET_ERR ? err : "No addr of the family");
+        udpConnectionFree(client);
+        return;
+    }
+
+    if (remote->pending) {
+        UDP_WRITE(remote->conn, remote->pending, &client->sa_remote);
+        ioBufRelease(remote->pending);
+        remote->pending = NULL;
+    }
 }
 
 static void udpRemoteOnRead(void *data) {
     udpRemote *remote = data;
     udpClient *client = remote->client;
 
-    char buf[NET_IOBUF_LEN];
-    int buf_len = sizeof(buf);
+    ioBuf *rbuf = remote->conn->rbuf;
     int nread;
 
     char rip[HOSTNAME_MAX_LEN];
     int rip_len = sizeof(rip);
     int rport;
 
-    nread = UDP_READ(remote->conn, buf, buf_len, NULL);
+    nread = UDP_READ(remote->conn, rbuf, NULL);
     if (nread == UDP_ERR) return;
+    udpServerCharge(client->server, nread);
 
     if (netIpPresentBySockAddr(NULL, rip, rip_len, &rport, &client->sa_remote) == NET_OK)
         LOGD("UDP remote read from %s:%d", rip, rport);
 
-    UDP_WRITE(client->server->conn, buf, nread, &client->sa_client);
+    if (client->server->onReply) client->server->onReply(client, rbuf);
+    UDP_WRITE(client->server->conn, rbuf, &client->sa_client);
 
     udpConnectionFree(client);
 }
@@ -20,30 +20,48 @@
 #ifndef __MODULE_UDP_H
 #define __MODULE_UDP_H
 
+#include "module_limit.h"
+
+#include "lib/core/arena.h"
+#include "lib/protocol/resolver.h"
 #include "lib/protocol/udp.h"
 
+#define UDP_SESSION_ARENA_SIZE 256
+
+struct udpClient;
+
+typedef void (*udpReplyHandler)(struct udpClient *client, ioBuf *b);
+
 typedef struct udpServer {
     udpConn *conn;
     int remote_count;
+    limitWaiter waiter; // The server stops reading while the port is over its rate
+    udpReplyHandler onReply; // Sees each reply before it is written to the client
 } udpServer;
 
 typedef struct udpClient {
+    arena *arena; // The client and its remote live here, freed in one go
     udpServer *server;
     struct udpRemote *remote;
     sockAddrEx sa_client;
     sockAddrEx sa_remote;
+    struct dnsCacheKey *dns_key; // Query of xs-tunnel whose answer is to be cached
 } udpClient;
 
 typedef struct udpRemote {
     udpConn *conn;
     udpClient *client;
+    resolverQuery *query; // Remote host lookup in flight
+    ioBuf *pending; // Datagram held until the lookup is done
 } udpRemote;
 
 udpServer *udpServerNew(char *host, int port, int type, udpEventHandler onRead);
 void udpServerFree(udpServer *server);
+void udpServerCharge(udpServer *server, int len);
 
 udpClient *udpClientNew(udpServer *server);
 udpRemote *udpRemoteNew(udpClient *client, int type, char *host, int port);
+int udpRemoteWrite(udpRemote *remote, ioBuf *b);
 void udpConnectionFree(udpClient *client);
 
 #endif /* __MODULE_UDP_H */
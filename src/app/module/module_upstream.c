@@ -0,0 +1,205 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "module_upstream.h"
+#include "module.h"
+
+#define UPSTREAM_PROBE_INTERVAL 10000 /* ms */
+#define UPSTREAM_MAX_FAILS 3
+#define UPSTREAM_RTT_ALPHA 0.3 /* Weight of a new sample */
+
+static upstream *upstreamNew(char *host, int port, crypto_t *crypto, int own_crypto);
+static void upstreamFree(upstream *up);
+
+static void upstreamProbe(upstream *up);
+static void upstreamProbeHandler(event *e);
+static void upstreamProbeOnConnect(void *data, int status);
+static void upstreamProbeOnTimeout(void *data);
+static void upstreamProbeOnClose(void *data);
+
+/*
+ The remote_addr server comes first, then the servers list. A server without its own
+ password, key or method shares the cipher of the remote_addr server.
+ */
+upstreamGroup *upstreamGroupNew(xsocksConfig *config, crypto_t *crypto) {
+    upstreamGroup *group;
+
+    if (CALLOC_P(group) == NULL) {
+        LOGW("Upstream group is NULL, please check the memory");
+        return NULL;
+    }
+
+    group->servers = xs_calloc((config->server_count + 1) * sizeof(upstream *));
+    group->servers[group->size++] = upstreamNew(config->remote_addr, config->remote_port, crypto, 0);
+
+    for (int i = 0; i < config->server_count; i++) {
+        xsocksServer *s = &config->servers[i];
+        crypto_t *c = crypto;
+        int own = 0;
+
+        if (s->password || s->key || s->method) {
+            c = crypto_init(s->password ? s->password : config->password, s->key,
+                            s->method ? s->method : config->method);
+            if (!c) FATAL("Failed to initialize ciphers of server %s:%d", s->addr, s->port);
+            own = 1;
+        }
+        group->servers[group->size++] = upstreamNew(s->addr, s->port, c, own);
+    }
+
+    if (group->size > 1) {
+        group->te = NEW_EVENT_REPEAT(UPSTREAM_PROBE_INTERVAL, upstreamProbeHandler, group);
+        ADD_EVENT(app, group->te);
+    }
+
+    return group;
+}
+
+void upstreamGroupFree(upstreamGroup *group) {
+    if (!group) return;
+
+    CLR_EVENT(group->te);
+    for (int i = 0; i < group->size; i++) upstreamFree(group->servers[i]);
+    xs_free(group->servers);
+    xs_free(group);
+}
+
+static upstream *upstreamNew(char *host, int port, crypto_t *crypto, int own_crypto) {
+    upstream *up = xs_calloc(sizeof(*up));
+
+    up->host = xs_strdup(host);
+    up->port = port;
+    up->crypto = crypto;
+    up->own_crypto = own_crypto;
+
+    return up;
+}
+
+static void upstreamFree(upstream *up) {
+    CONN_CLOSE(up->probe);
+    if (up->own_crypto) {
+        free(up->crypto->cipher);
+        free(up->crypto);
+    }
+    xs_free(up->host);
+    xs_free(up);
+}
+
+int upstreamIsDown(upstream *up) {
+    return up->fails >= UPSTREAM_MAX_FAILS;
+}
+
+/*
+ Pick the server with the least EWMA connect time weighted by its outstanding conns,
+ a down server is only picked when all of them are down
+ */
+upstream *upstreamSelect(upstreamGroup *group, upstream *exclude) {
+    upstream *best = NULL;
+    double best_score = 0;
+
+    for (int i = 0; i < group->size; i++) {
+        upstream *up = group->servers[i];
+        if (up == exclude) continue;
+
+        double score = (up->rtt + 1) * (up->conns + 1);
+        if (upstreamIsDown(up)) score += 1e9 * up->fails;
+
+        if (!best || score < best_score) {
+            best = up;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+void upstreamAcquire(upstream *up) {
+    up->conns++;
+}
+
+void upstreamRelease(upstream *up) {
+    up->conns--;
+}
+
+void upstreamConnectDone(upstream *up, int status, uint64_t start) {
+    if (status == TCP_ERR) {
+        if (++up->fails == UPSTREAM_MAX_FAILS) LOGW("Upstream %s:%d is down", up->host, up->port);
+        return;
+    }
+
+    double rtt = timerStop(start, MILLISECOND_UNIT, NULL);
+    up->rtt = up->rtt == 0 ? rtt : up->rtt + UPSTREAM_RTT_ALPHA * (rtt - up->rtt);
+
+    if (upstreamIsDown(up)) LOGN("Upstream %s:%d is up", up->host, up->port);
+    up->fails = 0;
+}
+
+static void upstreamProbeHandler(event *e) {
+    upstreamGroup *group = e->data;
+
+    for (int i = 0; i < group->size; i++) upstreamProbe(group->servers[i]);
+}
+
+/*
+ A bare TCP connect, closed on the next round if it succeeded
+ */
+static void upstreamProbe(upstream *up) {
+    char err[XS_ERR_LEN];
+    tcpConn *conn;
+
+    if (up->probe) {
+        if (!tcpIsConnected(up->probe)) return;
+        CONN_CLOSE(up->probe);
+        up->probe = NULL;
+    }
+
+    conn = tcpConnect(err, app->el, up->host, up->port, app->config->connect_timeout, up);
+    if (!conn) {
+        LOGD("Upstream %s:%d probe error: %s", up->host, up->port, err);
+        upstreamConnectDone(up, TCP_ERR, 0);
+        return;
+    }
+    tcpInit(conn);
+
+    CONN_ON_CONNECT(conn, upstreamProbeOnConnect);
+    CONN_ON_TIMEOUT(conn, upstreamProbeOnTimeout);
+    CONN_ON_CLOSE(conn, upstreamProbeOnClose);
+
+    up->probe = conn;
+    up->probe_start = timerStart();
+}
+
+static void upstreamProbeOnConnect(void *data, int status) {
+    upstream *up = data;
+
+    upstreamConnectDone(up, status, up->probe_start);
+    if (status == TCP_OK) tcpSetTimeout(up->probe, -1);
+}
+
+static void upstreamProbeOnTimeout(void *data) {
+    upstream *up = data;
+
+    if (!tcpIsConnected(up->probe)) upstreamConnectDone(up, TCP_ERR, 0);
+}
+
+static void upstreamProbeOnClose(void *data) {
+    upstream *up = data;
+
+    CONN_CLOSE(up->probe);
+    up->probe = NULL;
+}
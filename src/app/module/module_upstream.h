@@ -0,0 +1,55 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MODULE_UPSTREAM_H
+#define __MODULE_UPSTREAM_H
+
+#include "lib/core/config.h"
+#include "lib/protocol/tcp.h"
+
+#include "shadowsocks-libev/crypto.h"
+
+typedef struct upstream {
+    char *host;
+    int port;
+    crypto_t *crypto;
+    int own_crypto;
+    int conns; // Outstanding conns
+    int fails; // Connect failures in a row
+    double rtt; // EWMA of the connect time in ms, 0 until measured
+    tcpConn *probe;
+    uint64_t probe_start;
+} upstream;
+
+typedef struct upstreamGroup {
+    upstream **servers;
+    int size;
+    event *te;
+} upstreamGroup;
+
+upstreamGroup *upstreamGroupNew(xsocksConfig *config, crypto_t *crypto);
+void upstreamGroupFree(upstreamGroup *group);
+
+upstream *upstreamSelect(upstreamGroup *group, upstream *exclude);
+int upstreamIsDown(upstream *up);
+void upstreamAcquire(upstream *up);
+void upstreamRelease(upstream *up);
+void upstreamConnectDone(upstream *up, int status, uint64_t start);
+
+#endif /* __MODULE_UPSTREAM_H */
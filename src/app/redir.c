@@ -18,16 +18,34 @@
  */
 
 #include "module/module.h"
+#include "module/module_fakeip.h"
+#include "module/module_mux.h"
+#include "module/module_pool.h"
 #include "module/module_tcp.h"
 
+#include "lib/core/sockmap.h"
+#include "lib/protocol/sniff.h"
 #include "lib/protocol/tcp_shadowsocks.h"
 #include "lib/protocol/tcp_socks5.h"
 
+#define REDIR_SNIFF_TIMEOUT 300 /* ms, the protocols where the server speaks first send nothing */
+#define REDIR_SNIFF_INTERVAL 10 /* ms */
+
 typedef struct server {
     module mod;
     tcpServer *ts;
 } server;
 
+/* A client waiting for its first bytes, lives in the client arena */
+typedef struct redirSniff {
+    tcpClient *client;
+    sockAddrEx sa;
+    char ip[NET_IP_MAX_STR_LEN];
+    int port;
+    event *te;
+    uint64_t start;
+} redirSniff;
+
 static void redirInit();
 static void redirRun();
 static void redirExit();
@@ -36,6 +54,13 @@ static void tcpServerOnAccept(void *data);
 static void tcpClientOnRead(void *data);
 static void tcpRemoteOnConnect(void *data, int status);
 
+static int redirRoute(tcpClient *client, sockAddrEx *sa, char *ip, int port, char *domain);
+static int redirSniffStart(tcpClient *client, sockAddrEx *sa, char *ip, int port);
+static void redirSniffPeek(redirSniff *sniff);
+static void redirSniffDone(redirSniff *sniff, char *domain);
+static void redirSniffOnRead(void *data);
+static void redirSniffTimeHandler(event *e);
+
 static int isBypass(char *ip);
 
 static server s;
@@ -66,24 +91,37 @@ static void redirRun() {
 
     if (!s.ts) exit(EXIT_ERR);
     if (s.ts) LOGN("TCP server listen at: %s", s.ts->ln->addrinfo);
+
+    if (app->config->pool_size > 0)
+        app->pool = tcpPoolNew(app->config->remote_addr, app->config->remote_port,
+                               app->config->pool_size, app->config->pool_ttl);
+
+    if (app->config->mux > 0)
+        app->mux = tcpMuxNew(app->config->remote_addr, app->config->remote_port, app->config->mux);
+
+    if (app->config->sockmap) {
+        char err[XS_ERR_LEN];
+        if (sockmapInit(err, TCP_SOCKMAP_SIZE) == NET_ERR)
+            LOGW("Sockmap is disabled, bypass connections fall back to userland: %s", err);
+    }
 }
 
 static void redirExit() {
+    sockmapFree();
+    tcpMuxFree(app->mux);
+    tcpPoolFree(app->pool);
     tcpServerFree(s.ts);
 }
 
 static void tcpServerOnAccept(void *data) {
     tcpServer *server = data;
     tcpClient *client;
-    tcpRemote *remote;
 
     if ((client = tcpClientNew(server, CONN_TYPE_RAW, tcpClientOnRead)) == NULL) return;
 
     LOGD("TCP server accepted client %s", CONN_GET_ADDRINFO(client->conn));
-    LOGD("TCP client current count: %d", ++server->client_count);
 
-    char host[HOSTNAME_MAX_LEN];
-    int host_len = sizeof(host);
+    char ip[NET_IP_MAX_STR_LEN];
     int port;
     char err[NET_ERR_LEN];
     sockAddrEx sa;
@@ -92,38 +130,155 @@ static void tcpServerOnAccept(void *data) {
         LOGW("TCP client get dest sockaddr error: %s", err);
         goto error;
     }
-    if (netIpPresentBySockAddr(err, host, host_len, &port, &sa) == NET_ERR) {
+    if (netIpPresentBySockAddr(err, ip, sizeof(ip), &port, &sa) == NET_ERR) {
         LOGW("TCP client get dest addr error: %s", err);
         goto error;
     }
 
-    int bypass = isBypass(host);
+    if (app->fakeip && fakeIpMatch(app->fakeip, &sa)) {
+        char domain[FAKEIP_DOMAIN_LEN];
 
-    if (bypass) {
-        if ((remote = tcpRemoteNew(client, CONN_TYPE_RAW, host, port, tcpRemoteOnConnect)) == NULL)
+        // The fake IP means nothing beyond this box, only its domain does
+        if (fakeIpLookup(app->fakeip, &sa, domain, sizeof(domain)) == FAKEIP_ERR) {
+            LOGW("TCP client fake IP %s has no domain", ip);
             goto error;
+        }
+        if (redirRoute(client, NULL, ip, port, domain) == TCP_ERR) goto error;
+    } else if (app->config->sniff) {
+        if (redirSniffStart(client, &sa, ip, port) == TCP_ERR) goto error;
+    } else if (redirRoute(client, &sa, ip, port, NULL) == TCP_ERR) {
+        goto error;
+    }
+
+    return;
+
+error:
+    tcpConnectionFree(client);
+}
+
+/*
+ The sniffed domain takes over the dest IP for the ACL and for the remote, which then
+ resolves it near the dest. Bypassed conns still go to the original dest IP, unless sa
+ is NULL for a fake IP, then they resolve the domain here.
+ */
+static int redirRoute(tcpClient *client, sockAddrEx *sa, char *ip, int port, char *domain) {
+    char *host = domain ? domain : ip;
+    tcpRemote *remote;
+    int host_match = 0;
+    int bypass;
+
+    if (domain && app->config->acl) host_match = acl_match_host(domain);
+    bypass = host_match != 0 ? host_match > 0 : isBypass(sa ? ip : domain);
+
+    if (bypass) {
+        // Connect to the original dest as is, only a fake IP needs its domain resolved
+        if (sa)
+            remote = tcpRemoteNewAddr(client, CONN_TYPE_RAW, NULL, sa, 1, tcpRemoteOnConnect);
+        else
+            remote = tcpRemoteNew(client, CONN_TYPE_RAW, domain, port, tcpRemoteOnConnect);
+        if (!remote) return TCP_ERR;
 
         LOGD("TCP client bypass dest addr: %s:%d", host, port);
+    } else if (app->mux) {
+        // The client conn is carried by the mux stream from now on
+        if (tcpMuxOpen(app->mux, client->conn, host, port) == MUX_ERR) return TCP_ERR;
+
+        LOGD("TCP client mux dest addr: %s:%d", host, port);
+        client->conn = NULL;
+        tcpConnectionFree(client);
     } else {
         if ((remote = tcpRemoteNew(client, CONN_TYPE_SHADOWSOCKS, app->config->remote_addr,
                                    app->config->remote_port, tcpRemoteOnConnect)) == NULL)
-            goto error;
+            return TCP_ERR;
 
         tcpShadowsocksConnInit((tcpShadowsocksConn *)remote->conn, host, port);
         LOGD("TCP client proxy dest addr: %s:%d", host, port);
     }
 
-    return;
+    return TCP_OK;
+}
 
-error:
-    tcpConnectionFree(client);
+/*
+ Wait up to REDIR_SNIFF_TIMEOUT for a TLS ClientHello or an HTTP request. The bytes are
+ only peeked, the relay reads them as usual.
+ */
+static int redirSniffStart(tcpClient *client, sockAddrEx *sa, char *ip, int port) {
+    redirSniff *sniff;
+
+    if ((sniff = arenaAlloc(client->arena, sizeof(*sniff))) == NULL) return TCP_ERR;
+
+    sniff->client = client;
+    memcpy(&sniff->sa, sa, sizeof(*sa));
+    memcpy(sniff->ip, ip, sizeof(sniff->ip));
+    sniff->port = port;
+    sniff->start = timerStart();
+    sniff->te = NEW_EVENT_REPEAT(REDIR_SNIFF_INTERVAL, redirSniffTimeHandler, sniff);
+    ADD_EVENT(app, sniff->te);
+
+    client->data = sniff;
+    CONN_ON_READ(client->conn, redirSniffOnRead);
+
+    return TCP_OK;
+}
+
+static void redirSniffPeek(redirSniff *sniff) {
+    tcpConn *conn = sniff->client->conn;
+    char host[HOSTNAME_MAX_LEN];
+    char err[NET_ERR_LEN];
+    int n;
+
+    n = netTcpPeek(err, conn->fd, conn->rbuf, MIN(conn->rbuf_len, SNIFF_BUF_LEN));
+    if (n == NET_ERR) {
+        LOGD("TCP client %s sniff error: %s", CONN_GET_ADDRINFO(conn), err);
+        CLR_EVENT(sniff->te);
+        tcpConnectionFree(sniff->client);
+        return;
+    }
+    if (n == 0) return;
+
+    switch (sniffHost(conn->rbuf, n, host, sizeof(host))) {
+        case SNIFF_OK: redirSniffDone(sniff, host); break;
+        case SNIFF_ERR: redirSniffDone(sniff, NULL); break;
+        default:
+            // Part of the head is queued, check again on the timer instead of spinning
+            DEL_EVENT_READ(conn);
+            break;
+    }
+}
+
+static void redirSniffDone(redirSniff *sniff, char *domain) {
+    tcpClient *client = sniff->client;
+
+    CLR_EVENT(sniff->te);
+    client->data = NULL;
+    CONN_ON_READ(client->conn, tcpClientOnRead);
+
+    if (domain) LOGD("TCP client %s sniffed domain: %s", CONN_GET_ADDRINFO(client->conn), domain);
+
+    if (redirRoute(client, &sniff->sa, sniff->ip, sniff->port, domain) == TCP_ERR)
+        tcpConnectionFree(client);
+}
+
+static void redirSniffOnRead(void *data) {
+    tcpClient *client = data;
+
+    redirSniffPeek(client->data);
+}
+
+static void redirSniffTimeHandler(event *e) {
+    redirSniff *sniff = e->data;
+
+    if (timerStop(sniff->start, MILLISECOND_UNIT, NULL) >= REDIR_SNIFF_TIMEOUT)
+        redirSniffDone(sniff, NULL);
+    else
+        redirSniffPeek(sniff);
 }
 
 static void tcpClientOnRead(void *data) {
     tcpClient *client = data;
     tcpRemote *remote = client->remote;
 
-    tcpPipe(client->conn, remote->conn);
+    if (tcpConnectionPipe(client, client->conn, remote->conn) > 0) tcpConnectionSockmap(client);
 }
 
 static void tcpRemoteOnConnect(void *data, int status) {
@@ -140,6 +295,7 @@ static void tcpRemoteOnConnect(void *data, int status) {
     // Prepare pipe
     ADD_EVENT_READ(remote->conn);
     ADD_EVENT_READ(client->conn);
+    tcpConnectionSockmap(client);
 }
 
 static int isBypass(char *ip) {
@@ -18,9 +18,11 @@
  */
 
 #include "module/module.h"
+#include "module/module_mux.h"
 #include "module/module_tcp.h"
 #include "module/module_udp.h"
 
+#include "lib/protocol/raw.h"
 #include "lib/protocol/socks5.h"
 #include "lib/protocol/tcp_shadowsocks.h"
 #include "lib/protocol/udp_shadowsocks.h"
@@ -38,6 +40,8 @@ static void serverExit();
 static void tcpServerOnAccept(void *data);
 static void tcpClientOnRead(void *data);
 static void tcpRemoteOnConnect(void *data, int status);
+static int muxStreamOnOpen(muxStream *stream, char *host, int port);
+static int tcpAddrBlocked(sockAddrEx *sa);
 
 static void udpServerOnRead(void *data);
 
@@ -59,6 +63,13 @@ static void serverInit() {
 }
 
 static void serverRun() {
+    // The ACL sees the addresses the names resolve to, before any connect
+    if (app->config->acl) tcpSetAddrFilter(tcpAddrBlocked);
+
+    // Accept wakes up only once the shadowsocks header has arrived
+    if (app->config->listen_sockopts.defer_accept == -1)
+        app->config->listen_sockopts.defer_accept = app->config->handshake_timeout;
+
     if (app->config->mode & MODE_TCP_ONLY)
         s.ts = tcpServerNew(app->config->remote_addr, app->config->remote_port, tcpServerOnAccept);
     if (app->config->mode & MODE_UDP_ONLY)
@@ -68,7 +79,7 @@ static void serverRun() {
     if (!s.ts && !s.us) exit(EXIT_ERR);
 
     if (s.ts) LOGN("TCP server listen at: %s", s.ts->ln->addrinfo);
-    if (s.us) LOGN("UDP server listen at: %s", s.us->conn->addrinfo);
+    if (s.us) LOGN("UDP server listen at: %s", CONN_GET_ADDRINFO(s.us->conn));
 }
 
 static void serverExit() {
@@ -79,11 +90,7 @@ static void serverExit() {
 static void tcpServerOnAccept(void *data) {
     tcpServer *server = data;
     tcpClient *client = tcpClientNew(server, CONN_TYPE_SHADOWSOCKS, tcpClientOnRead);
-    if (client) {
-        tcpConn *conn = client->conn;
-        LOGD("TCP server accepted client %s", conn->addrinfo_peer);
-        LOGD("TCP client current count: %d", ++server->client_count);
-    }
+    if (client) LOGD("TCP server accepted client %s", tcpGetAddrinfo(client->conn));
 }
 
 static void tcpClientOnRead(void *data) {
@@ -97,48 +104,37 @@ static void tcpClientOnRead(void *data) {
 
         char host[HOSTNAME_MAX_LEN];
         int host_len = sizeof(host);
-        char ip[NET_IP_MAX_STR_LEN];
-        int ip_len = sizeof(ip);
         int port;
         int atyp;
 
-        socks5AddrParse(conn_client->addrbuf_dest->data, conn_client->addrbuf_dest->len, &atyp, host,
+        socks5AddrParse(conn_client->addrbuf_dest, conn_client->addrbuf_dest_len, &atyp, host,
                         &host_len, &port);
 
-        LOGD("TCP client proxy dest addr: %s:%d", host, port);
-
-        if (app->config->acl) {
-            int resolved = 0;
-
-            if (atyp != SOCKS5_ATYP_DOMAIN) {
-                memcpy(ip, host, ip_len);
-                resolved = 1;
-            } else if (anetResolve(NULL, host, ip, ip_len) == ANET_OK)
-                resolved = 1;
+        if (strcmp(host, MUX_HOST) == 0) {
+            int rbuf_off = conn_client->addrbuf_dest_len;
 
-            if (resolved && outbound_block_match_host(ip)) {
-                LOGW("Outbound blocked %s", ip);
-                tcpConnectionFree(client);
-                return;
+            // The client conn is carried by the mux session from now on
+            if (muxSessionAccept(client->conn, client->conn->rbuf + rbuf_off, nread - rbuf_off,
+                                 muxStreamOnOpen) != NULL) {
+                LOGD("TCP client %s opened mux session", CONN_GET_ADDRINFO(client->conn));
+                client->conn = NULL;
             }
+            tcpConnectionFree(client);
+            return;
         }
 
+        LOGD("TCP client proxy dest addr: %s:%d", host, port);
+
         client->remote = tcpRemoteNew(client, CONN_TYPE_RAW, host, port, tcpRemoteOnConnect);
         if (!client->remote) {
             tcpConnectionFree(client);
             return;
         }
 
-        // Rewind rbuffer
-        int rbuf_off = conn_client->addrbuf_dest->len;
-        int rbuf_len = nread - rbuf_off;
-
-        if (rbuf_len > 0) {
-            memmove(client->conn->rbuf, client->conn->rbuf + rbuf_off, rbuf_len);
-            client->conn->rbuf_off += rbuf_len;
-        }
+        // The payload left after the addr is written from where it is once connected
+        client->conn->rbuf_off = nread - conn_client->addrbuf_dest_len;
     } else {
-        tcpPipe(client->conn, remote->conn);
+        tcpConnectionPipe(client, client->conn, remote->conn);
     }
 }
 
@@ -155,7 +151,9 @@ static void tcpRemoteOnConnect(void *data, int status) {
 
     // Write shadowsocks client handshake left buffer
     if (client->conn->rbuf_off) {
-        int nwrite = TCP_WRITE(remote->conn, client->conn->rbuf, client->conn->rbuf_off);
+        tcpShadowsocksConn *conn_client = (tcpShadowsocksConn *)client->conn;
+        char *rbuf = client->conn->rbuf + conn_client->addrbuf_dest_len;
+        int nwrite = TCP_WRITE(remote->conn, rbuf, client->conn->rbuf_off);
         if (nwrite == TCP_ERR)
             return;
         else if (nwrite < client->conn->rbuf_off) {
@@ -170,14 +168,44 @@ static void tcpRemoteOnConnect(void *data, int status) {
     ADD_EVENT_READ(client->conn);
 }
 
+static int muxStreamOnOpen(muxStream *stream, char *host, int port) {
+    tcpConn *conn;
+    char err[XS_ERR_LEN];
+
+    LOGD("TCP mux stream proxy dest addr: %s:%d", host, port);
+
+    if ((conn = tcpConnect(err, app->el, host, port, app->config->connect_timeout, stream)) ==
+        NULL) {
+        LOGW("TCP mux stream %s:%d connect error: %s", host, port, err);
+        return MUX_ERR;
+    }
+    tcpSetIdleTimeout(conn, app->config->idle_timeout);
+    if (tcpSetSockOpts(err, conn, &app->config->remote_sockopts) == TCP_ERR)
+        LOGD("TCP mux stream set socket options error: %s", err);
+    muxStreamAttach(stream, (tcpConn *)tcpRawConnNew(conn));
+
+    return MUX_OK;
+}
+
+static int tcpAddrBlocked(sockAddrEx *sa) {
+    char ip[NET_IP_MAX_STR_LEN];
+
+    if (netIpPresentBySockAddr(NULL, ip, sizeof(ip), NULL, sa) == NET_OK &&
+        outbound_block_match_host(ip)) {
+        LOGW("Outbound blocked %s", ip);
+        return 1;
+    }
+
+    return 0;
+}
+
 static void udpServerOnRead(void *data) {
     udpServer *server = data;
     udpShadowsocksConn *conn = (udpShadowsocksConn *)server->conn;
     udpClient *client;
     udpRemote *remote;
 
-    char buf[NET_IOBUF_LEN];
-    int buf_len = sizeof(buf);
+    ioBuf *rbuf = server->conn->rbuf;
     int nread;
 
     char host[HOSTNAME_MAX_LEN];
@@ -190,13 +218,14 @@ static void udpServerOnRead(void *data) {
 
     if ((client = udpClientNew(server)) == NULL) return;
 
-    nread = UDP_READ(server->conn, buf, buf_len, &client->sa_client);
+    nread = UDP_READ(server->conn, rbuf, &client->sa_client);
     if (nread == UDP_ERR) goto error;
+    udpServerCharge(server, nread);
 
     if (netIpPresentBySockAddr(NULL, cip, cip_len, &cport, &client->sa_client) == NET_OK)
         LOGD("UDP server read from %s:%d", cip, cport);
 
-    socks5AddrParse(conn->addrbuf_dest->data, conn->addrbuf_dest->len, NULL, host, &host_len,
+    socks5AddrParse(conn->addrbuf_dest, conn->addrbuf_dest_len, NULL, host, &host_len,
                     &port);
 
     LOGD("UDP client proxy dest addr: %s:%d", host, port);
@@ -204,7 +233,7 @@ static void udpServerOnRead(void *data) {
     remote = udpRemoteNew(client, CONN_TYPE_RAW, host, port);
     if (!remote) goto error;
 
-    UDP_WRITE(remote->conn, buf, nread, &client->sa_remote);
+    udpRemoteWrite(remote, rbuf);
 
     return;
 
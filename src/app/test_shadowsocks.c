@@ -0,0 +1,272 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "lib/protocol/tcp_shadowsocks.h"
+
+#include "shadowsocks-libev/aead.h"
+
+#define TEST_HOST "127.0.0.1"
+#define TEST_PORT 19998
+#define TEST_METHOD "chacha20-ietf-poly1305"
+
+#define CHECK(cond)                                  \
+    do {                                             \
+        if (!(cond)) {                               \
+            LOGE("Check failed: %s", #cond);         \
+            failed++;                                \
+        }                                            \
+    } while (0)
+
+typedef struct test {
+    eventLoop *el;
+    crypto_t *crypto;
+    tcpListener *ln;
+    tcpConn *client;
+} test;
+
+static test t;
+static test *app = &t;
+static int failed;
+static char payload[SHADOWSOCKS_CHUNK_MAX];
+
+static void initTest();
+static void testReject();
+static void testRejectOnAccept(void *data);
+static void testRejectOnRead(void *data);
+static void testStreamDrain();
+static void testFirstChunk();
+static void testFirstChunkOnAccept(void *data);
+static void testFirstChunkOnConnect(void *data, int status);
+static void testFirstChunkOnRead(void *data);
+
+int main() {
+    initTest();
+
+    testReject();
+    testStreamDrain();
+    testFirstChunk();
+
+    if (failed) {
+        LOGE("%d checks failed", failed);
+        return EXIT_ERR;
+    }
+    LOGI("All checks passed");
+
+    return EXIT_OK;
+}
+
+static void initTest() {
+    setupIgnoreHandlers();
+    setupSigsegvHandlers();
+
+    logger *log = getLogger();
+    log->level = LOGLEVEL_INFO;
+    log->color_enabled = 1;
+    log->syslog_ident = "xs-test-shadowsocks";
+
+    app->el = eventLoopNew(1024);
+    app->crypto = crypto_init("foobar", NULL, TEST_METHOD);
+    if (!app->crypto) FATAL("Failed to initialize ciphers");
+}
+
+/*
+ A first chunk failing the tag rejects the conn, which is then closed while drained
+ */
+static void testReject() {
+    char err[XS_ERR_LEN];
+    char probe[64];
+    int fd;
+
+    app->ln = tcpListen(err, app->el, TEST_HOST, TEST_PORT, SOMAXCONN, NULL, testRejectOnAccept);
+    if (!app->ln) FATAL(err);
+
+    if ((fd = anetTcpConnect(err, TEST_HOST, TEST_PORT)) == ANET_ERR) FATAL(err);
+    memset(probe, 'x', sizeof(probe));
+    if (write(fd, probe, sizeof(probe)) != sizeof(probe)) FATAL("Write probe error: %s", STRERR);
+
+    eventLoopRun(app->el);
+
+    close(fd);
+    CONN_CLOSE(app->ln);
+}
+
+static void testRejectOnAccept(void *data) {
+    char err[XS_ERR_LEN];
+    tcpConn *conn;
+
+    UNUSED(data);
+
+    if ((conn = tcpAccept(err, app->el, app->ln->fd, 10, NULL)) == NULL) FATAL(err);
+    conn = (tcpConn *)tcpShadowsocksConnNew(conn, app->crypto);
+    conn->data = conn;
+
+    CONN_ON_READ(conn, testRejectOnRead);
+    ADD_EVENT_READ(conn);
+}
+
+static void testRejectOnRead(void *data) {
+    tcpShadowsocksConn *c = data;
+    tcpConn *conn = data;
+
+    CHECK(TCP_READ(conn, conn->rbuf, conn->rbuf_len) == 0);
+    CHECK(c->state == SHADOWSOCKS_STATE_REJECT);
+    CHECK(c->d_ctx == NULL);
+
+    // The cipher ctx dropped by the reject is not released again
+    CONN_CLOSE(conn);
+    eventLoopStop(app->el);
+}
+
+/*
+ Reads of the relay rbuf size never leave a complete chunk buffered, whatever is left
+ over from the read before, so the last read of a stream yields all of it
+ */
+static void testStreamDrain() {
+    static const int sizes[] = {SHADOWSOCKS_CHUNK_MAX, 100, SHADOWSOCKS_CHUNK_MAX, 5000,
+                                SHADOWSOCKS_CHUNK_MAX, 1, 12345, SHADOWSOCKS_CHUNK_MAX};
+    static char buf[NET_IOBUF_LEN];
+    cipher_ctx_t e_ctx, d_ctx;
+    buffer_t stream, chunk;
+    size_t plain_len = 0, total = 0, offset = 0;
+    unsigned i;
+
+    app->crypto->ctx_init(app->crypto->cipher, &e_ctx, 1);
+    app->crypto->ctx_init(app->crypto->cipher, &d_ctx, 0);
+    balloc(&stream, NET_IOBUF_LEN);
+    balloc(&chunk, NET_IOBUF_LEN);
+    stream.len = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        chunk.idx = 0;
+        chunk.len = sizes[i];
+        brealloc(&chunk, chunk.len, NET_IOBUF_LEN);
+        for (size_t j = 0; j < chunk.len; j++) chunk.data[j] = (plain_len + j) % 251;
+        plain_len += chunk.len;
+
+        CHECK(app->crypto->encrypt(&chunk, &e_ctx, NET_IOBUF_LEN) == CRYPTO_OK);
+        brealloc(&stream, stream.len + chunk.len, NET_IOBUF_LEN);
+        memcpy(stream.data + stream.len, chunk.data, chunk.len);
+        stream.len += chunk.len;
+    }
+
+    while (offset < stream.len) {
+        size_t room = sizeof(buf);
+        size_t plen;
+        int rc;
+
+        if (aead_ctx_ready(&d_ctx)) room = aead_decrypt_room(&d_ctx, sizeof(buf));
+        CHECK(room > 0);
+        if (room > stream.len - offset) room = stream.len - offset;
+
+        if (aead_ctx_ready(&d_ctx)) {
+            memcpy(buf, stream.data + offset, room);
+            rc = aead_decrypt_chunks(&d_ctx, buf, room, buf, &plen, sizeof(buf));
+        } else {
+            chunk.idx = 0;
+            chunk.len = room;
+            brealloc(&chunk, chunk.len, NET_IOBUF_LEN);
+            memcpy(chunk.data, stream.data + offset, room);
+            rc = app->crypto->decrypt(&chunk, &d_ctx, NET_IOBUF_LEN);
+            plen = chunk.len;
+            memcpy(buf, chunk.data, rc == CRYPTO_OK ? plen : 0);
+        }
+        offset += room;
+
+        CHECK(rc != CRYPTO_ERROR);
+        if (rc == CRYPTO_ERROR) break;
+        if (rc == CRYPTO_NEED_MORE) continue;
+
+        size_t j = 0;
+        while (j < plen && (unsigned char)buf[j] == (total + j) % 251) j++;
+        CHECK(j == plen);
+        total += plen;
+    }
+
+    CHECK(total == plain_len);
+
+    bfree(&stream);
+    bfree(&chunk);
+    app->crypto->ctx_release(&e_ctx);
+    app->crypto->ctx_release(&d_ctx);
+}
+
+/*
+ A full chunk written first leaves room for the dest addr on the client, and for the
+ salt of a 256-bit key on the server
+ */
+static void testFirstChunk() {
+    char err[XS_ERR_LEN];
+    tcpConn *conn;
+
+    memset(payload, 'x', sizeof(payload));
+
+    app->ln = tcpListen(err, app->el, TEST_HOST, TEST_PORT + 1, SOMAXCONN, NULL,
+                        testFirstChunkOnAccept);
+    if (!app->ln) FATAL(err);
+
+    if ((conn = tcpConnect(err, app->el, TEST_HOST, TEST_PORT + 1, 10, NULL)) == NULL) FATAL(err);
+    app->client = (tcpConn *)tcpShadowsocksConnNew(conn, app->crypto);
+    app->client->data = app->client;
+    tcpShadowsocksConnInit((tcpShadowsocksConn *)app->client, "example.com", 80);
+    CONN_ON_CONNECT(app->client, testFirstChunkOnConnect);
+
+    eventLoopRun(app->el);
+
+    CONN_CLOSE(app->client);
+    CONN_CLOSE(app->ln);
+}
+
+static void testFirstChunkOnAccept(void *data) {
+    char err[XS_ERR_LEN];
+    tcpConn *conn;
+
+    UNUSED(data);
+
+    if ((conn = tcpAccept(err, app->el, app->ln->fd, 10, NULL)) == NULL) FATAL(err);
+    conn = (tcpConn *)tcpShadowsocksConnNew(conn, app->crypto);
+    conn->data = conn;
+
+    CONN_ON_READ(conn, testFirstChunkOnRead);
+    ADD_EVENT_READ(conn);
+}
+
+static void testFirstChunkOnConnect(void *data, int status) {
+    tcpShadowsocksConn *c = data;
+    tcpConn *conn = data;
+
+    if (status == TCP_ERR) FATAL("Connect error: %s", conn->errstr);
+
+    CHECK(TCP_WRITE(conn, payload, sizeof(payload)) == SHADOWSOCKS_CHUNK_MAX - c->addrbuf_dest_len);
+}
+
+static void testFirstChunkOnRead(void *data) {
+    tcpShadowsocksConn *c = data;
+    tcpConn *conn = data;
+    int nread = TCP_READ(conn, conn->rbuf, conn->rbuf_len);
+
+    if (nread == 0) return;
+
+    CHECK(nread > 0);
+    if (nread > 0) {
+        CHECK(c->state == SHADOWSOCKS_STATE_HANDSHAKE);
+        CHECK(TCP_WRITE(conn, payload, sizeof(payload)) == SHADOWSOCKS_CHUNK_MAX);
+        CONN_CLOSE(conn);
+    }
+    eventLoopStop(app->el);
+}
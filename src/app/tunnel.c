@@ -18,8 +18,11 @@
  */
 
 #include "module/module.h"
+#include "module/module_dnscache.h"
+#include "module/module_fakeip.h"
 #include "module/module_udp.h"
 
+#include "lib/protocol/dns.h"
 #include "lib/protocol/udp_shadowsocks.h"
 
 typedef struct server {
@@ -31,6 +34,10 @@ static void tunnelInit();
 static void tunnelRun();
 static void tunnelExit();
 
+static int udpServerFakeIp(udpServer *server, udpClient *client, ioBuf *rbuf);
+static int udpServerDnsCache(udpServer *server, udpClient *client, ioBuf *rbuf);
+static void udpServerOnReply(udpClient *client, ioBuf *rbuf);
+static void udpServerOnCachedAnswer(void *data, ioBuf *b, sockAddrEx *sa);
 static void udpServerOnRead(void *data);
 
 static server s;
@@ -57,12 +64,14 @@ static void tunnelInit() {
                             udpServerOnRead);
 
     if (!s.us) exit(EXIT_ERR);
+
+    if (app->dnscache) s.us->onReply = udpServerOnReply;
 }
 
 static void tunnelRun() {
     LOGI("Use tunnel addr: %s:%d", app->config->tunnel_addr, app->config->tunnel_port);
 
-    if (s.us) LOGN("UDP server listen at: %s", s.us->conn->addrinfo);
+    if (s.us) LOGN("UDP server listen at: %s", CONN_GET_ADDRINFO(s.us->conn));
 }
 
 static void tunnelExit() {
@@ -74,8 +83,7 @@ static void udpServerOnRead(void *data) {
     udpClient *client;
     udpRemote *remote;
 
-    char buf[NET_IOBUF_LEN];
-    int buf_len = sizeof(buf);
+    ioBuf *rbuf = server->conn->rbuf;
     int nread;
 
     char cip[HOSTNAME_MAX_LEN];
@@ -84,12 +92,16 @@ static void udpServerOnRead(void *data) {
 
     if ((client = udpClientNew(server)) == NULL) return;
 
-    nread = UDP_READ(server->conn, buf, buf_len, &client->sa_client);
+    nread = UDP_READ(server->conn, rbuf, &client->sa_client);
     if (nread == UDP_ERR) goto error;
+    udpServerCharge(server, nread);
 
     if (netIpPresentBySockAddr(NULL, cip, cip_len, &cport, &client->sa_client) == NET_OK)
         LOGD("UDP server read from %s:%d", cip, cport);
 
+    if (app->fakeip && udpServerFakeIp(server, client, rbuf) == FAKEIP_OK) goto end;
+    if (app->dnscache && udpServerDnsCache(server, client, rbuf) != DNSCACHE_MISS) goto end;
+
     remote = udpRemoteNew(client, CONN_TYPE_SHADOWSOCKS, app->config->remote_addr,
                           app->config->remote_port);
     if (!remote) goto error;
@@ -99,10 +111,73 @@ static void udpServerOnRead(void *data) {
 
     LOGD("UDP client proxy dest addr: %s:%d", app->config->tunnel_addr, app->config->tunnel_port);
 
-    UDP_WRITE(remote->conn, buf, nread, &client->sa_remote);
+    udpRemoteWrite(remote, rbuf);
 
     return;
 
 error:
+end:
     udpConnectionFree(client);
 }
+
+/*
+ Answer A queries locally with a fake IP, AAAA with no records so clients
+ fall back to A, everything else is forwarded to the tunnel address.
+ */
+static int udpServerFakeIp(udpServer *server, udpClient *client, ioBuf *rbuf) {
+    char domain[FAKEIP_DOMAIN_LEN];
+    ipV4Addr ip;
+    int qlen, qtype, len;
+
+    qlen = dnsParseQuery(IOBUF_DATA(rbuf), rbuf->len, domain, sizeof(domain), &qtype);
+    if (qlen == DNS_ERR || !strchr(domain, '.')) return FAKEIP_ERR;
+    if (qtype != DNS_TYPE_A && qtype != DNS_TYPE_AAAA) return FAKEIP_ERR;
+
+    if (qtype == DNS_TYPE_A && fakeIpAssign(app->fakeip, domain, &ip) == FAKEIP_ERR)
+        return FAKEIP_ERR;
+
+    len = dnsBuildAnswer(IOBUF_DATA(rbuf), qlen, rbuf->len + IOBUF_TAILROOM(rbuf), qtype,
+                         qtype == DNS_TYPE_A ? &ip : NULL, FAKEIP_TTL);
+    if (len == DNS_ERR) return FAKEIP_ERR;
+    rbuf->len = len;
+
+    LOGD("UDP server fake %s answer for %s", qtype == DNS_TYPE_A ? "A" : "AAAA", domain);
+
+    UDP_WRITE(server->conn, rbuf, &client->sa_client);
+    return FAKEIP_OK;
+}
+
+/*
+ Answer the query from the cache, or let it wait for the same one in flight. A query
+ forwarded keeps its key for udpServerOnReply to cache the answer.
+ */
+static int udpServerDnsCache(udpServer *server, udpClient *client, ioBuf *rbuf) {
+    dnsCacheKey key;
+    int ret;
+
+    key.len = dnsQueryKey(IOBUF_DATA(rbuf), rbuf->len, key.data, sizeof(key.data));
+    if (key.len == DNS_ERR) return DNSCACHE_MISS;
+
+    ret = dnsCacheLookup(app->dnscache, &key, rbuf, &client->sa_client);
+    if (ret == DNSCACHE_HIT) {
+        LOGD("UDP server cached answer");
+        UDP_WRITE(server->conn, rbuf, &client->sa_client);
+    } else if (ret == DNSCACHE_MISS) {
+        client->dns_key = arenaAlloc(client->arena, sizeof(key));
+        if (client->dns_key) memcpy(client->dns_key, &key, sizeof(key));
+    }
+
+    return ret;
+}
+
+static void udpServerOnReply(udpClient *client, ioBuf *rbuf) {
+    if (!client->dns_key) return;
+
+    dnsCacheStore(app->dnscache, client->dns_key, rbuf, udpServerOnCachedAnswer, client->server);
+}
+
+static void udpServerOnCachedAnswer(void *data, ioBuf *b, sockAddrEx *sa) {
+    udpServer *server = data;
+
+    UDP_WRITE(server->conn, b, sa);
+}
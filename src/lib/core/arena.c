@@ -0,0 +1,89 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include "arena.h"
+#include "utils.h"
+
+#define ARENA_ALIGN 16
+
+static arenaBlock *arenaBlockNew(size_t size) {
+    arenaBlock *b = xs_malloc(sizeof(*b) + size);
+    if (!b) return NULL;
+
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+
+    return b;
+}
+
+static void *arenaBlockAlloc(arenaBlock *b, size_t size) {
+    uintptr_t p = (uintptr_t)(b->data + b->used);
+    size_t pad = (ARENA_ALIGN - p % ARENA_ALIGN) % ARENA_ALIGN;
+
+    if (b->size - b->used < pad + size) return NULL;
+    b->used += pad + size;
+
+    return memset((void *)(p + pad), 0, size);
+}
+
+/*
+ The arena itself is the first object of its first block
+ */
+arena *arenaNew(size_t block_size) {
+    arenaBlock *b;
+    arena *a;
+
+    if ((b = arenaBlockNew(sizeof(*a) + ARENA_ALIGN + block_size)) == NULL) return NULL;
+
+    a = arenaBlockAlloc(b, sizeof(*a));
+    a->head = b;
+    a->block_size = block_size;
+
+    return a;
+}
+
+void arenaFree(arena *a) {
+    if (!a) return;
+
+    arenaBlock *b = a->head;
+    while (b) {
+        arenaBlock *next = b->next;
+        xs_free(b);
+        b = next;
+    }
+}
+
+/*
+ Returns zeroed memory, a new block is chained when the current one is full
+ */
+void *arenaAlloc(arena *a, size_t size) {
+    arenaBlock *b;
+    void *p;
+
+    if ((p = arenaBlockAlloc(a->head, size)) != NULL) return p;
+
+    if ((b = arenaBlockNew(ARENA_ALIGN + MAX(size, a->block_size))) == NULL) return NULL;
+    b->next = a->head;
+    a->head = b;
+
+    return arenaBlockAlloc(b, size);
+}
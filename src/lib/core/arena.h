@@ -0,0 +1,45 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/*
+ Bump allocator for objects sharing one lifetime, e.g. the structs of a proxy
+ session. Nothing is freed on its own, arenaFree releases all of them at once.
+ */
+typedef struct arenaBlock {
+    struct arenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arenaBlock;
+
+typedef struct arena {
+    arenaBlock *head;
+    size_t block_size;
+} arena;
+
+arena *arenaNew(size_t block_size);
+void arenaFree(arena *a);
+void *arenaAlloc(arena *a, size_t size);
+
+#endif /* __ARENA_H */
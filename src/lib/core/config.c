@@ -42,6 +42,13 @@ configEnum loglevel_enum[] = {
     {NULL, 0},
 };
 
+configEnum acl_resolve_enum[] = {
+    {"strict", ACL_RESOLVE_STRICT},
+    {"proxy", ACL_RESOLVE_PROXY},
+    {"async", ACL_RESOLVE_ASYNC},
+    {NULL, 0},
+};
+
 #define configStringDup(d, s) \
     do { \
         char *_s = s; \
@@ -71,6 +78,29 @@ enum {
     // GETOPT_VAL_MPTCP,
     GETOPT_VAL_PASSWORD,
     GETOPT_VAL_KEY,
+    GETOPT_VAL_POOL_SIZE,
+    GETOPT_VAL_POOL_TTL,
+    GETOPT_VAL_CONNECT_TIMEOUT,
+    GETOPT_VAL_HANDSHAKE_TIMEOUT,
+    GETOPT_VAL_IDLE_TIMEOUT,
+    GETOPT_VAL_MUX,
+    GETOPT_VAL_SOCKMAP,
+    GETOPT_VAL_SNIFF,
+    GETOPT_VAL_PRIORITY,
+    GETOPT_VAL_FAKE_IP,
+    GETOPT_VAL_FAKE_IP_MAP,
+    GETOPT_VAL_BACKLOG,
+    GETOPT_VAL_NOFILE,
+    GETOPT_VAL_OUTBOUND_ADDRS,
+    GETOPT_VAL_MAX_CLIENTS,
+    GETOPT_VAL_MAX_CLIENTS_PER_IP,
+    GETOPT_VAL_MAX_CONNECTS_PER_DEST,
+    GETOPT_VAL_RATE_LIMIT,
+    GETOPT_VAL_SESSION_RATE_LIMIT,
+    GETOPT_VAL_NAMESERVER,
+    GETOPT_VAL_DNS_CACHE,
+    GETOPT_VAL_ACL_RESOLVE,
+    GETOPT_VAL_TUNNEL_DNS_CACHE,
 };
 
 xsocksConfig *configNew() {
@@ -87,6 +117,9 @@ xsocksConfig *configNew() {
     config->key = NULL;
     configStringDup(config->method, CONFIG_DEFAULT_METHOD);
     config->timeout = CONFIG_DEFAULT_TIMEOUT;
+    config->connect_timeout = CONFIG_DEFAULT_CONNECT_TIMEOUT;
+    config->handshake_timeout = CONFIG_DEFAULT_HANDSHAKE_TIMEOUT;
+    config->idle_timeout = -1;
     config->fast_open = 0;
     config->reuse_port = 0;
     config->mode = CONFIG_DEFAULT_MODE;
@@ -99,6 +132,31 @@ xsocksConfig *configNew() {
     config->ipv6_only = 1;
     config->no_delay = 0;
     config->acl = NULL;
+    config->acl_resolve = CONFIG_DEFAULT_ACL_RESOLVE;
+    config->pool_size = CONFIG_DEFAULT_POOL_SIZE;
+    config->pool_ttl = CONFIG_DEFAULT_POOL_TTL;
+    config->mux = CONFIG_DEFAULT_MUX;
+    config->sockmap = CONFIG_DEFAULT_SOCKMAP;
+    config->sniff = CONFIG_DEFAULT_SNIFF;
+    config->priority = CONFIG_DEFAULT_PRIORITY;
+    config->fake_ip = NULL;
+    configStringDup(config->fake_ip_map, CONFIG_DEFAULT_FAKE_IP_MAP);
+    config->backlog = CONFIG_DEFAULT_BACKLOG;
+    config->nofile = CONFIG_DEFAULT_NOFILE;
+    config->outbound_addrs = NULL;
+    config->nameserver = NULL;
+    config->dns_cache = CONFIG_DEFAULT_DNS_CACHE;
+    config->tunnel_dns_cache = CONFIG_DEFAULT_TUNNEL_DNS_CACHE;
+    config->max_clients = CONFIG_DEFAULT_MAX_CLIENTS;
+    config->max_clients_per_ip = CONFIG_DEFAULT_MAX_CLIENTS_PER_IP;
+    config->max_connects_per_dest = CONFIG_DEFAULT_MAX_CONNECTS_PER_DEST;
+    config->rate_limit = CONFIG_DEFAULT_RATE_LIMIT;
+    config->session_rate_limit = CONFIG_DEFAULT_SESSION_RATE_LIMIT;
+    config->servers = NULL;
+    config->server_count = 0;
+    netSockOptsInit(&config->listen_sockopts);
+    netSockOptsInit(&config->client_sockopts);
+    netSockOptsInit(&config->remote_sockopts);
 
     return config;
 }
@@ -152,6 +210,75 @@ static int testLogfile(char **err, char *file) {
     return CONFIG_OK;
 }
 
+static void configLoadSockOpts(netSockOpts *opts, json_value *obj) {
+    check_json_value_type(obj, json_object, "invalid config file: socket options must be an object");
+
+    for (uint64_t i = 0; i < obj->u.object.length; i++) {
+        char *name = obj->u.object.values[i].name;
+        json_value *value = obj->u.object.values[i].value;
+
+        if (strcmp(name, "no_delay") == 0) {
+            check_json_value_type(value, json_boolean, "invalid config file: socket option 'no_delay' must be a boolean");
+            opts->no_delay = to_integer(value);
+        } else if (strcmp(name, "rcvbuf") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: socket option 'rcvbuf' must be an integer");
+            opts->rcvbuf = to_integer(value);
+        } else if (strcmp(name, "sndbuf") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: socket option 'sndbuf' must be an integer");
+            opts->sndbuf = to_integer(value);
+        } else if (strcmp(name, "keepalive") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: socket option 'keepalive' must be an integer");
+            opts->keepalive = to_integer(value);
+        } else if (strcmp(name, "quickack") == 0) {
+            check_json_value_type(value, json_boolean, "invalid config file: socket option 'quickack' must be a boolean");
+            opts->quickack = to_integer(value);
+        } else if (strcmp(name, "defer_accept") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: socket option 'defer_accept' must be an integer");
+            opts->defer_accept = to_integer(value);
+        } else if (strcmp(name, "congestion") == 0) {
+            xs_free(opts->congestion);
+            opts->congestion = to_string(value);
+        } else {
+            LOGW("ignore unknown socket option: %s", name);
+        }
+    }
+}
+
+static void configLoadServers(xsocksConfig *config, json_value *arr) {
+    check_json_value_type(arr, json_array, "invalid config file: option 'servers' must be an array");
+
+    config->servers = xs_calloc(arr->u.array.length * sizeof(xsocksServer));
+    config->server_count = 0;
+
+    for (unsigned int i = 0; i < arr->u.array.length; i++) {
+        json_value *obj = arr->u.array.values[i];
+        xsocksServer *server = &config->servers[config->server_count++];
+
+        check_json_value_type(obj, json_object, "invalid config file: option 'servers' must be an array of objects");
+
+        for (uint64_t j = 0; j < obj->u.object.length; j++) {
+            char *name = obj->u.object.values[j].name;
+            json_value *value = obj->u.object.values[j].value;
+
+            if (strcmp(name, "server") == 0) {
+                server->addr = to_string(value);
+            } else if (strcmp(name, "server_port") == 0) {
+                server->port = to_integer(value);
+            } else if (strcmp(name, "password") == 0) {
+                server->password = to_string(value);
+            } else if (strcmp(name, "key") == 0) {
+                server->key = to_string(value);
+            } else if (strcmp(name, "method") == 0) {
+                server->method = to_string(value);
+            } else {
+                LOGW("ignore unknown server option: %s", name);
+            }
+        }
+
+        if (!server->addr || server->port <= 0) FATAL("invalid config file: server address or port is missing");
+    }
+}
+
 void configLoad(xsocksConfig *config, char *filename) {
     char *err = NULL;
     json_value *obj = NULL;
@@ -196,6 +323,15 @@ void configLoad(xsocksConfig *config, char *filename) {
             config->method = to_string(value);
         } else if (strcmp(name, "timeout") == 0) {
             config->timeout = to_integer(value);
+        } else if (strcmp(name, "connect_timeout") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'connect_timeout' must be an integer");
+            config->connect_timeout = to_integer(value);
+        } else if (strcmp(name, "handshake_timeout") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'handshake_timeout' must be an integer");
+            config->handshake_timeout = to_integer(value);
+        } else if (strcmp(name, "idle_timeout") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'idle_timeout' must be an integer");
+            config->idle_timeout = to_integer(value);
         } else if (strcmp(name, "user") == 0) {
             // conf.user = to_string(value);
         } else if (strcmp(name, "fast_open") == 0) {
@@ -259,6 +395,99 @@ void configLoad(xsocksConfig *config, char *filename) {
             config->no_delay = to_integer(value);
         } else if (strcmp(name, "acl") == 0) {
             config->acl = to_string(value);
+        } else if (strcmp(name, "acl_resolve") == 0) {
+            char *acl_resolve = to_string(value);
+            config->acl_resolve = configEnumGetValue(acl_resolve_enum, acl_resolve);
+            xs_free(acl_resolve);
+
+            if (config->acl_resolve == INT_MIN) {
+                err = "Invalid acl resolve mode. Must be one of strict, proxy, async";
+                goto loaderr;
+            }
+        } else if (strcmp(name, "pool_size") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'pool_size' must be an integer");
+            config->pool_size = to_integer(value);
+        } else if (strcmp(name, "pool_ttl") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'pool_ttl' must be an integer");
+            config->pool_ttl = to_integer(value);
+        } else if (strcmp(name, "mux") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'mux' must be an integer");
+            config->mux = to_integer(value);
+        } else if (strcmp(name, "sockmap") == 0) {
+            check_json_value_type(value, json_boolean, "invalid config file: option 'sockmap' must be a boolean");
+            config->sockmap = to_integer(value);
+        } else if (strcmp(name, "sniff") == 0) {
+            check_json_value_type(value, json_boolean, "invalid config file: option 'sniff' must be a boolean");
+            config->sniff = to_integer(value);
+        } else if (strcmp(name, "priority") == 0) {
+            check_json_value_type(value, json_boolean, "invalid config file: option 'priority' must be a boolean");
+            config->priority = to_integer(value);
+        } else if (strcmp(name, "fake_ip") == 0) {
+            config->fake_ip = to_string(value);
+        } else if (strcmp(name, "fake_ip_map") == 0) {
+            xs_free(config->fake_ip_map);
+            config->fake_ip_map = to_string(value);
+        } else if (strcmp(name, "nofile") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'nofile' must be an integer");
+            config->nofile = to_integer(value);
+        } else if (strcmp(name, "outbound_addrs") == 0) {
+            xs_free(config->outbound_addrs);
+    xs_free(config->fake_ip);
+    xs_free(config->fake_ip_map);
+    for (int i = 0; i < config->server_count; i++) {
+        xs_free(config->servers[i].addr);
+        xs_free(config->servers[i].password);
+        xs_free(config->servers[i].key);
+        xs_free(config->servers[i].method);
+    }
+    xs_free(config->servers);
+            if (value->type == json_array) {
+                sds addrs = sdsempty();
+                for (unsigned int j = 0; j < value->u.array.length; j++) {
+                    check_json_value_type(value->u.array.values[j], json_string,
+                                          "invalid config file: option 'outbound_addrs' must be an array of strings");
+                    addrs = sdscatprintf(addrs, "%s%s", j ? "," : "", value->u.array.values[j]->u.string.ptr);
+                }
+                config->outbound_addrs = xs_strdup(addrs);
+                sdsfree(addrs);
+            } else {
+                config->outbound_addrs = to_string(value);
+            }
+        } else if (strcmp(name, "nameserver") == 0) {
+            xs_free(config->nameserver);
+            config->nameserver = to_string(value);
+        } else if (strcmp(name, "dns_cache") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'dns_cache' must be an integer");
+            config->dns_cache = to_integer(value);
+        } else if (strcmp(name, "tunnel_dns_cache") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'tunnel_dns_cache' must be an integer");
+            config->tunnel_dns_cache = to_integer(value);
+        } else if (strcmp(name, "servers") == 0) {
+            configLoadServers(config, value);
+        } else if (strcmp(name, "backlog") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'backlog' must be an integer");
+            config->backlog = to_integer(value);
+        } else if (strcmp(name, "max_clients") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'max_clients' must be an integer");
+            config->max_clients = to_integer(value);
+        } else if (strcmp(name, "max_clients_per_ip") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'max_clients_per_ip' must be an integer");
+            config->max_clients_per_ip = to_integer(value);
+        } else if (strcmp(name, "max_connects_per_dest") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'max_connects_per_dest' must be an integer");
+            config->max_connects_per_dest = to_integer(value);
+        } else if (strcmp(name, "rate_limit") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'rate_limit' must be an integer");
+            config->rate_limit = to_integer(value);
+        } else if (strcmp(name, "session_rate_limit") == 0) {
+            check_json_value_type(value, json_integer, "invalid config file: option 'session_rate_limit' must be an integer");
+            config->session_rate_limit = to_integer(value);
+        } else if (strcmp(name, "listen_socket") == 0) {
+            configLoadSockOpts(&config->listen_sockopts, value);
+        } else if (strcmp(name, "client_socket") == 0) {
+            configLoadSockOpts(&config->client_sockopts, value);
+        } else if (strcmp(name, "remote_socket") == 0) {
+            configLoadSockOpts(&config->remote_sockopts, value);
         } else {
             err = sdscatprintf(sdsempty(), "Bad directive: %s", name);
             goto loaderr;
@@ -298,6 +527,29 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
         { "password",    required_argument, NULL, GETOPT_VAL_PASSWORD    },
         { "key",         required_argument, NULL, GETOPT_VAL_KEY         },
         { "acl",         required_argument, NULL, GETOPT_VAL_ACL         },
+        { "acl-resolve", required_argument, NULL, GETOPT_VAL_ACL_RESOLVE },
+        { "pool-size",   required_argument, NULL, GETOPT_VAL_POOL_SIZE   },
+        { "pool-ttl",    required_argument, NULL, GETOPT_VAL_POOL_TTL    },
+        { "connect-timeout",   required_argument, NULL, GETOPT_VAL_CONNECT_TIMEOUT   },
+        { "handshake-timeout", required_argument, NULL, GETOPT_VAL_HANDSHAKE_TIMEOUT },
+        { "idle-timeout",      required_argument, NULL, GETOPT_VAL_IDLE_TIMEOUT      },
+        { "mux",         required_argument, NULL, GETOPT_VAL_MUX         },
+        { "sockmap",     no_argument,       NULL, GETOPT_VAL_SOCKMAP     },
+        { "sniff",       no_argument,       NULL, GETOPT_VAL_SNIFF       },
+        { "priority",    no_argument,       NULL, GETOPT_VAL_PRIORITY    },
+        { "fake-ip",     required_argument, NULL, GETOPT_VAL_FAKE_IP     },
+        { "fake-ip-map", required_argument, NULL, GETOPT_VAL_FAKE_IP_MAP },
+        { "backlog",     required_argument, NULL, GETOPT_VAL_BACKLOG     },
+        { "nofile",      required_argument, NULL, GETOPT_VAL_NOFILE      },
+        { "outbound-addrs",    required_argument, NULL, GETOPT_VAL_OUTBOUND_ADDRS    },
+        { "max-clients",       required_argument, NULL, GETOPT_VAL_MAX_CLIENTS       },
+        { "max-clients-per-ip",    required_argument, NULL, GETOPT_VAL_MAX_CLIENTS_PER_IP    },
+        { "max-connects-per-dest", required_argument, NULL, GETOPT_VAL_MAX_CONNECTS_PER_DEST },
+        { "rate-limit",            required_argument, NULL, GETOPT_VAL_RATE_LIMIT            },
+        { "session-rate-limit",    required_argument, NULL, GETOPT_VAL_SESSION_RATE_LIMIT    },
+        { "nameserver",  required_argument, NULL, GETOPT_VAL_NAMESERVER  },
+        { "dns-cache",   required_argument, NULL, GETOPT_VAL_DNS_CACHE   },
+        { "tunnel-dns-cache",  required_argument, NULL, GETOPT_VAL_TUNNEL_DNS_CACHE  },
         { "version",     no_argument,       NULL, 'V'                    },
         { NULL,          0,                 NULL, 0                      },
     };
@@ -312,6 +564,10 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
     char *pidfile = NULL;
     char *method = NULL;
     char *acl = NULL;
+    char *fake_ip = NULL;
+    char *fake_ip_map = NULL;
+    char *outbound_addrs = NULL;
+    char *nameserver = NULL;
     int fast_open = -1;
     int mtu = -1;
     int no_delay = -1;
@@ -323,12 +579,31 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
     int timeout = -1;
     int mode = -1;
     int ipv6_first = -1;
+    int pool_size = -1;
+    int pool_ttl = -1;
+    int connect_timeout = -1;
+    int handshake_timeout = -1;
+    int idle_timeout = -1;
+    int mux = -1;
+    int sockmap = -1;
+    int sniff = -1;
+    int priority = -1;
+    int backlog = -1;
+    int nofile = -1;
+    int max_clients = -1;
+    int max_clients_per_ip = -1;
+    int max_connects_per_dest = -1;
+    int rate_limit = -1;
+    int session_rate_limit = -1;
+    int dns_cache = -1;
+    int tunnel_dns_cache = -1;
+    int acl_resolve = -1;
     int help = 0;
 
     char *err = NULL;
     int c;
 
-    while ((c = getopt_long(argc, argv, "f:s:p:l:L:k:t:m:c:b:huUvV6", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "f:s:p:l:L:k:t:m:c:b:n:huUvV6", long_options, NULL)) != -1) {
         switch (c) {
             case GETOPT_VAL_FAST_OPEN: fast_open = 1; break;
             case GETOPT_VAL_MTU: mtu = atoi(optarg); break;
@@ -336,6 +611,33 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
             case GETOPT_VAL_KEY: key = optarg; break;
             case GETOPT_VAL_REUSE_PORT: reuse_port = 1; break;
             case GETOPT_VAL_ACL: acl = optarg; break;
+            case GETOPT_VAL_ACL_RESOLVE:
+                acl_resolve = configEnumGetValue(acl_resolve_enum, optarg);
+                if (acl_resolve == INT_MIN)
+                    err = "Invalid acl resolve mode. Must be one of strict, proxy, async";
+                break;
+            case GETOPT_VAL_POOL_SIZE: pool_size = atoi(optarg); break;
+            case GETOPT_VAL_POOL_TTL: pool_ttl = atoi(optarg); break;
+            case GETOPT_VAL_CONNECT_TIMEOUT: connect_timeout = atoi(optarg); break;
+            case GETOPT_VAL_HANDSHAKE_TIMEOUT: handshake_timeout = atoi(optarg); break;
+            case GETOPT_VAL_IDLE_TIMEOUT: idle_timeout = atoi(optarg); break;
+            case GETOPT_VAL_MUX: mux = atoi(optarg); break;
+            case GETOPT_VAL_SOCKMAP: sockmap = 1; break;
+            case GETOPT_VAL_SNIFF: sniff = 1; break;
+            case GETOPT_VAL_PRIORITY: priority = 1; break;
+            case GETOPT_VAL_FAKE_IP: fake_ip = optarg; break;
+            case GETOPT_VAL_FAKE_IP_MAP: fake_ip_map = optarg; break;
+            case GETOPT_VAL_BACKLOG: backlog = atoi(optarg); break;
+            case GETOPT_VAL_NOFILE: nofile = atoi(optarg); break;
+            case GETOPT_VAL_OUTBOUND_ADDRS: outbound_addrs = optarg; break;
+            case GETOPT_VAL_MAX_CLIENTS: max_clients = atoi(optarg); break;
+            case GETOPT_VAL_MAX_CLIENTS_PER_IP: max_clients_per_ip = atoi(optarg); break;
+            case GETOPT_VAL_MAX_CONNECTS_PER_DEST: max_connects_per_dest = atoi(optarg); break;
+            case GETOPT_VAL_RATE_LIMIT: rate_limit = atoi(optarg); break;
+            case GETOPT_VAL_SESSION_RATE_LIMIT: session_rate_limit = atoi(optarg); break;
+            case GETOPT_VAL_NAMESERVER: nameserver = optarg; break;
+            case GETOPT_VAL_DNS_CACHE: dns_cache = atoi(optarg); break;
+            case GETOPT_VAL_TUNNEL_DNS_CACHE: tunnel_dns_cache = atoi(optarg); break;
             case GETOPT_VAL_LOGLEVEL:
                 loglevel = configEnumGetValue(loglevel_enum, optarg);
                 if (loglevel == INT_MIN)
@@ -358,6 +660,7 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
                 pidfile = optarg;
                 break;
             case 't': timeout = atoi(optarg); break;
+            case 'n': nofile = atoi(optarg); break;
             case 'm': method = optarg; break;
             case 'c': conf_path = optarg; break;
             case 'u': mode = MODE_TCP_AND_UDP; break;
@@ -385,6 +688,10 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
     configStringDup(config->pidfile, pidfile);
     configStringDup(config->method, method);
     configStringDup(config->acl, acl);
+    configStringDup(config->fake_ip, fake_ip);
+    configStringDup(config->fake_ip_map, fake_ip_map);
+    configStringDup(config->outbound_addrs, outbound_addrs);
+    configStringDup(config->nameserver, nameserver);
     configIntDup(config->loglevel, loglevel);
     configIntDup(config->remote_port, remote_port);
     configIntDup(config->local_port, local_port);
@@ -396,6 +703,37 @@ int configParse(xsocksConfig *config, int argc, char *argv[]) {
     configIntDup(config->no_delay, no_delay);
     configIntDup(config->mtu, mtu);
     configIntDup(config->fast_open, fast_open);
+    configIntDup(config->pool_size, pool_size);
+    configIntDup(config->pool_ttl, pool_ttl);
+    configIntDup(config->connect_timeout, connect_timeout);
+    configIntDup(config->handshake_timeout, handshake_timeout);
+    configIntDup(config->idle_timeout, idle_timeout);
+    configIntDup(config->mux, mux);
+    configIntDup(config->sockmap, sockmap);
+    configIntDup(config->sniff, sniff);
+    configIntDup(config->priority, priority);
+    configIntDup(config->backlog, backlog);
+    configIntDup(config->nofile, nofile);
+    configIntDup(config->max_clients, max_clients);
+    configIntDup(config->max_clients_per_ip, max_clients_per_ip);
+    configIntDup(config->max_connects_per_dest, max_connects_per_dest);
+    configIntDup(config->rate_limit, rate_limit);
+    configIntDup(config->session_rate_limit, session_rate_limit);
+    configIntDup(config->dns_cache, dns_cache);
+    configIntDup(config->tunnel_dns_cache, tunnel_dns_cache);
+    configIntDup(config->acl_resolve, acl_resolve);
+
+    // no_delay is the default of both conn sides
+    if (config->client_sockopts.no_delay == -1) config->client_sockopts.no_delay = config->no_delay;
+    if (config->remote_sockopts.no_delay == -1) config->remote_sockopts.no_delay = config->no_delay;
+
+    if (config->idle_timeout < 0) config->idle_timeout = config->timeout;
+
+    // The clients carried by mux streams are gone, no cap, rate or class would apply to them
+    if (config->mux > 0 && (config->max_clients > 0 || config->max_clients_per_ip > 0 ||
+                            config->rate_limit > 0 || config->session_rate_limit > 0 ||
+                            config->priority))
+        err = "Option mux can not be used with max clients, rate limits or priority";
 
     if (config->tunnel_address) {
         config->tunnel_addr = xs_calloc(HOSTNAME_MAX_LEN);
@@ -419,6 +757,18 @@ void configFree(xsocksConfig *config) {
     xs_free(config->key);
     xs_free(config->method);
     xs_free(config->logfile);
+    xs_free(config->outbound_addrs);
+    xs_free(config->nameserver);
+    for (int i = 0; i < config->server_count; i++) {
+        xs_free(config->servers[i].addr);
+        xs_free(config->servers[i].password);
+        xs_free(config->servers[i].key);
+        xs_free(config->servers[i].method);
+    }
+    xs_free(config->servers);
+    xs_free(config->listen_sockopts.congestion);
+    xs_free(config->client_sockopts.congestion);
+    xs_free(config->remote_sockopts.congestion);
 
     xs_free(config);
 }
@@ -20,6 +20,8 @@
 #ifndef __XS_CONFIG_H
 #define __XS_CONFIG_H
 
+#include "net.h"
+
 /* Error codes */
 enum {
     CONFIG_OK = 0,
@@ -32,6 +34,13 @@ enum {
     MODE_TCP_AND_UDP = MODE_TCP_ONLY|MODE_UDP_ONLY,
 };
 
+/* How xs-local routes a domain no ACL rule matches */
+enum {
+    ACL_RESOLVE_STRICT = 0, // Wait for its IP and route by the IP rules
+    ACL_RESOLVE_PROXY, // Proxy it, no lookup
+    ACL_RESOLVE_ASYNC, // Proxy it at once, go direct if its IP bypasses before connected
+};
+
 #define CONFIG_DEFAULT_DAEMONIZE 0
 #define CONFIG_DEFAULT_PASSWORD "foobar"
 #define CONFIG_DEFAULT_METHOD "aes-256-cfb"
@@ -40,10 +49,37 @@ enum {
 #define CONFIG_DEFAULT_LOCAL_PORT 1080
 #define CONFIG_DEFAULT_TUNNEL_ADDRESS "8.8.8.8:53"
 #define CONFIG_DEFAULT_TIMEOUT 60
+#define CONFIG_DEFAULT_CONNECT_TIMEOUT 10
+#define CONFIG_DEFAULT_HANDSHAKE_TIMEOUT 10
 #define CONFIG_DEFAULT_MODE MODE_TCP_ONLY
 #define CONFIG_DEFAULT_MTU 0
 #define CONFIG_DEFAULT_LOGLEVEL LOGLEVEL_NOTICE
 #define CONFIG_DEFAULT_SYSLOG_ENABLED 1
+#define CONFIG_DEFAULT_POOL_SIZE 0
+#define CONFIG_DEFAULT_POOL_TTL (CONFIG_DEFAULT_HANDSHAKE_TIMEOUT - 2)
+#define CONFIG_DEFAULT_MUX 0
+#define CONFIG_DEFAULT_SOCKMAP 0
+#define CONFIG_DEFAULT_SNIFF 0
+#define CONFIG_DEFAULT_PRIORITY 0
+#define CONFIG_DEFAULT_FAKE_IP_MAP "/tmp/xsocks-fakeip.map"
+#define CONFIG_DEFAULT_BACKLOG 1024
+#define CONFIG_DEFAULT_NOFILE 0
+#define CONFIG_DEFAULT_MAX_CLIENTS 0
+#define CONFIG_DEFAULT_MAX_CLIENTS_PER_IP 0
+#define CONFIG_DEFAULT_MAX_CONNECTS_PER_DEST 0
+#define CONFIG_DEFAULT_RATE_LIMIT 0
+#define CONFIG_DEFAULT_SESSION_RATE_LIMIT 0
+#define CONFIG_DEFAULT_DNS_CACHE 10000
+#define CONFIG_DEFAULT_TUNNEL_DNS_CACHE 0
+#define CONFIG_DEFAULT_ACL_RESOLVE ACL_RESOLVE_STRICT
+
+typedef struct xsocksServer {
+    char *addr;
+    int port;
+    char *password;
+    char *key;
+    char *method;
+} xsocksServer;
 
 typedef struct xsocksConfig {
     char *pidfile;
@@ -59,11 +95,18 @@ typedef struct xsocksConfig {
     char *key;
     char *method;
     int timeout;
+    int connect_timeout;
+    int handshake_timeout;
+    int idle_timeout; // falls back to timeout
     // char *user;
     int fast_open;
     int reuse_port;
-    // int nofile;
-    // char *nameserver;
+    int nofile; // 0 raises to the hard limit
+    char *outbound_addrs; // Comma separated source IPs of the outgoing conns
+    xsocksServer *servers; // Upstream servers besides remote_addr
+    int server_count;
+    char *nameserver; // Comma separated DNS servers, /etc/resolv.conf when NULL
+    int dns_cache; // Max cached names, 0 disables the cache
     int mode;
     int mtu;
     int loglevel;
@@ -74,8 +117,25 @@ typedef struct xsocksConfig {
     int ipv6_only;
     int no_delay;
     char *acl;
-    //
-    // int max_clients;
+    int acl_resolve; // ACL_RESOLVE_*
+    int pool_size;
+    int pool_ttl;
+    int mux;
+    int sockmap;
+    int sniff; // Route xs-redir conns by the TLS SNI or the HTTP Host
+    int priority; // Relay the interactive TCP sessions ahead of the bulk ones
+    char *fake_ip; // CIDR of the fake IPs answered by xs-tunnel, NULL is disabled
+    char *fake_ip_map; // Slots file shared by xs-tunnel and xs-redir
+    int tunnel_dns_cache; // Max DNS answers cached by xs-tunnel, 0 forwards every query
+    int backlog;
+    netSockOpts listen_sockopts;
+    netSockOpts client_sockopts; // Accepted conns
+    netSockOpts remote_sockopts; // Outgoing conns
+    int max_clients; // 0 is unlimited, as are the two below
+    int max_clients_per_ip;
+    int max_connects_per_dest; // Concurrent connects to one dest host
+    int rate_limit; // KB/s of the listening port, both directions of all the sessions
+    int session_rate_limit; // KB/s of every TCP session, both directions
 } xsocksConfig;
 
 xsocksConfig *configNew();
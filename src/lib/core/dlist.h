@@ -0,0 +1,48 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DLIST_H
+#define __DLIST_H
+
+#include <stddef.h>
+
+/*
+ Doubly linked list of nodes embedded in the structs they link, so linking and
+ unlinking never allocate. A node not on the list has both links NULL, which a
+ calloc'd struct starts with. DLIST_ENTRY gets the struct back from its node.
+ */
+typedef struct dlistNode {
+    struct dlistNode *prev;
+    struct dlistNode *next;
+} dlistNode;
+
+typedef struct dlist {
+    dlistNode *head;
+    dlistNode *tail;
+} dlist;
+
+#define DLIST_ENTRY(node, type, member) \
+    ((node) ? (type *)((char *)(node) - offsetof(type, member)) : NULL)
+
+int dlistIsLinked(dlist *l, dlistNode *n);
+void dlistPushHead(dlist *l, dlistNode *n);
+void dlistPushTail(dlist *l, dlistNode *n);
+void dlistUnlink(dlist *l, dlistNode *n);
+
+#endif /* __DLIST_H */
@@ -21,6 +21,14 @@
 
 #include <stdarg.h>
 
+/*
+ Error text of the conns, shared as it is only read right after the error is set
+ */
+char *errorBuffer() {
+    static __thread char buf[XS_ERR_LEN];
+    return buf;
+}
+
 void errorSet(char *err, const char *fmt, ...) {
     va_list ap;
 
@@ -32,6 +32,7 @@
 #define LOG_STRERROR(err) do { LOGE("%s: %s", err, STRERR); } while (0)
 
 void errorSet(char *err, const char *fmt, ...);
+char *errorBuffer();
 
 #define xs_error errorSet
 
@@ -0,0 +1,95 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include "iobuf.h"
+
+/*
+ The size includes the headroom, the payload starts empty right after it
+ */
+ioBuf *ioBufNew(int size, int headroom) {
+    ioBuf *b;
+
+    assert(headroom >= 0 && headroom <= size);
+
+    b = xs_malloc(sizeof(*b) + size);
+    if (!b) return NULL;
+
+    b->refcount = 1;
+    b->size = size;
+    b->off = headroom;
+    b->len = 0;
+
+    return b;
+}
+
+ioBuf *ioBufRetain(ioBuf *b) {
+    if (b) b->refcount++;
+    return b;
+}
+
+void ioBufRelease(ioBuf *b) {
+    if (!b) return;
+
+    assert(b->refcount > 0);
+    if (--b->refcount == 0) xs_free(b);
+}
+
+void ioBufReset(ioBuf *b, int headroom) {
+    assert(headroom >= 0 && headroom <= b->size);
+
+    b->off = headroom;
+    b->len = 0;
+}
+
+/*
+ Put a header in front of the payload, returns NULL if the headroom is too small
+ */
+char *ioBufPrepend(ioBuf *b, char *data, int len) {
+    if (len > b->off) return NULL;
+
+    b->off -= len;
+    b->len += len;
+    if (data) memcpy(IOBUF_DATA(b), data, len);
+
+    return IOBUF_DATA(b);
+}
+
+/*
+ Returns the number of bytes appended, which may be less than len
+ */
+int ioBufAppend(ioBuf *b, char *data, int len) {
+    if (len > IOBUF_TAILROOM(b)) len = IOBUF_TAILROOM(b);
+
+    memcpy(IOBUF_DATA(b) + b->len, data, len);
+    b->len += len;
+
+    return len;
+}
+
+/*
+ Drop bytes from the front of the payload, the freed space joins the headroom
+ */
+void ioBufConsume(ioBuf *b, int len) {
+    if (len > b->len) len = b->len;
+
+    b->off += len;
+    b->len -= len;
+}
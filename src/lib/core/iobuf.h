@@ -0,0 +1,49 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IOBUF_H
+#define __IOBUF_H
+
+/*
+ Refcounted I/O buffer. The payload sits between a headroom and a tailroom, so a
+ protocol layer prepends its header or grows the payload in place instead of copying
+ it into a buffer of its own.
+ */
+typedef struct ioBuf {
+    int refcount;
+    int size;  // Bytes allocated in data
+    int off;   // Start of the payload, bytes before it are headroom
+    int len;   // Payload length
+    char data[];
+} ioBuf;
+
+#define IOBUF_DATA(b) ((b)->data + (b)->off)
+#define IOBUF_HEADROOM(b) ((b)->off)
+#define IOBUF_TAILROOM(b) ((b)->size - (b)->off - (b)->len)
+
+ioBuf *ioBufNew(int size, int headroom);
+ioBuf *ioBufRetain(ioBuf *b);
+void ioBufRelease(ioBuf *b);
+
+void ioBufReset(ioBuf *b, int headroom);
+char *ioBufPrepend(ioBuf *b, char *data, int len);
+int ioBufAppend(ioBuf *b, char *data, int len);
+void ioBufConsume(ioBuf *b, int len);
+
+#endif /* __IOBUF_H */
@@ -56,13 +56,20 @@ void loggerLog(logger *log, int level, const char *file, int line, const char *f
 void setLogger(logger *log);
 logger *getLogger();
 
-#define log(level, ...) loggerLog(NULL, level, __FILE__, __LINE__, __VA_ARGS__)
-#define logDebug(...) loggerLog(NULL, LOGLEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define logInfo(...) loggerLog(NULL, LOGLEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define logNotice(...) loggerLog(NULL, LOGLEVEL_NOTICE, __FILE__, __LINE__, __VA_ARGS__)
-#define logWarn(...) loggerLog(NULL, LOGLEVEL_WARNING, __FILE__, __LINE__, __VA_ARGS__)
-#define logErr(...) loggerLog(NULL, LOGLEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define logRaw(level, ...) loggerLog(NULL, level|LOGLEVEL_RAW, __FILE__, __LINE__, __VA_ARGS__)
+/* The arguments are only evaluated when the level is enabled, keep side effects out */
+#define LOG_ENABLED(lv) (((lv) & 0xFF) >= getLogger()->level)
+#define LOG_IF(lv, ...)                                                          \
+    do {                                                                         \
+        if (LOG_ENABLED(lv)) loggerLog(NULL, lv, __FILE__, __LINE__, __VA_ARGS__); \
+    } while (0)
+
+#define log(level, ...) LOG_IF(level, __VA_ARGS__)
+#define logDebug(...) LOG_IF(LOGLEVEL_DEBUG, __VA_ARGS__)
+#define logInfo(...) LOG_IF(LOGLEVEL_INFO, __VA_ARGS__)
+#define logNotice(...) LOG_IF(LOGLEVEL_NOTICE, __VA_ARGS__)
+#define logWarn(...) LOG_IF(LOGLEVEL_WARNING, __VA_ARGS__)
+#define logErr(...) LOG_IF(LOGLEVEL_ERROR, __VA_ARGS__)
+#define logRaw(level, ...) LOG_IF((level) | LOGLEVEL_RAW, __VA_ARGS__)
 
 #define LOGD logDebug
 #define LOGI logInfo
@@ -21,10 +21,13 @@
 
 #include "error.h"
 #include "net.h"
+#include "utils.h"
 
 #include "redis/anet.h"
 
 #include <stdarg.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
 
 #ifdef __linux__
 #include <linux/if.h>
@@ -34,9 +37,27 @@
 
 #define anetSetError errorSet
 
+#define NET_AF_CACHE_SIZE 256
+
+/* Which address family won the last connect race to a host, direct mapped */
+typedef struct netAfCacheEntry {
+    char host[HOSTNAME_MAX_LEN];
+    int af;
+} netAfCacheEntry;
+
+static netAfCacheEntry afCache[NET_AF_CACHE_SIZE];
+
+/* Source addresses of the outgoing conns, taken round-robin */
+static struct netOutbound {
+    sockAddrEx addrs[NET_OUTBOUND_MAX_ADDRS];
+    int count;
+    int next;
+} outbound;
+
 static int _netUdpServer(char *err, int port, char *bindaddr, int af);
 static int anetSetReuseAddr(char *err, int fd);
 static int anetBind(char *err, int s, sockAddr *saddr, socklen_t slen);
+static int netOutboundBind(char *err, int s, int af);
 
 int isIPv6Addr(char *ip) {
     return strchr(ip, ':') ? 1 : 0;
@@ -87,6 +108,26 @@ int netTcpWrite(char *err, int fd, char *buf, int buflen) {
     return total_len;
 }
 
+/*
+ Look at the bytes queued on fd without taking them, 0 if there are none yet
+ */
+int netTcpPeek(char *err, int fd, char *buf, int buflen) {
+    int nread;
+
+    while ((nread = recv(fd, buf, buflen, MSG_PEEK)) == -1 && errno == EINTR) continue;
+
+    if (nread == -1) {
+        if (errno == EAGAIN) return 0;
+        errorSet(err, "%s", STRERR);
+        return NET_ERR;
+    } else if (nread == 0) {
+        errorSet(err, "Connection closed");
+        return NET_ERR;
+    }
+
+    return nread;
+}
+
 int netUdpRead(char *err, int fd, char *buf, int buflen, sockAddrEx *sa) {
     int nread;
     sockAddr *psa = sa ? (sockAddr *)&sa->sa : NULL;
@@ -110,51 +151,238 @@ int netUdpWrite(char *err, int fd, char *buf, int buflen, sockAddrEx *sa) {
 }
 
 int netTcpNonBlockConnect(char *err, char *addr, int port, sockAddrEx *sa) {
-    int s = NET_ERR, rv;
-    char portstr[6]; /* strlen("65535") + 1; */
+    sockAddrEx addrs[NET_CONNECT_MAX_ADDRS];
+    int naddrs, s, i;
+
+    naddrs = netTcpResolve(err, addr, port, addrs, NET_CONNECT_MAX_ADDRS);
+    if (naddrs == NET_ERR) return NET_ERR;
+
+    for (i = 0; i < naddrs; i++) {
+        if ((s = netTcpNonBlockConnectAddr(err, &addrs[i])) == NET_ERR) continue;
+
+        if (sa) memcpy(sa, &addrs[i], sizeof(*sa));
+        return s;
+    }
+
+    return NET_ERR;
+}
+
+/*
+ Accept a conn and keep its peer address binary
+ */
+int netTcpAccept(char *err, int s, sockAddrEx *sa) {
+    int fd;
+
+    while (1) {
+        sa->sa_len = sizeof(sa->sa);
+        fd = accept(s, (sockAddr *)&sa->sa, &sa->sa_len);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            anetSetError(err, "accept: %s", strerror(errno));
+            return NET_ERR;
+        }
+        break;
+    }
+
+    return fd;
+}
+
+int netTcpNonBlockConnectAddr(char *err, sockAddrEx *sa) {
+    int s;
+
+    if ((s = socket(sa->sa.ss_family, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+        anetSetError(err, "creating socket: %s", STRERR);
+        return NET_ERR;
+    }
+    if (anetSetReuseAddr(err, s) == ANET_ERR) goto error;
+    if (netOutboundBind(err, s, sa->sa.ss_family) == NET_ERR) goto error;
+    if (anetNonBlock(err, s) == ANET_ERR) goto error;
+    if (connect(s, (sockAddr *)&sa->sa, sa->sa_len) == -1 && errno != EINPROGRESS) {
+        anetSetError(err, "connect: %s", STRERR);
+        goto error;
+    }
+
+    return s;
+
+error:
+    close(s);
+    return NET_ERR;
+}
+
+/*
+ Fill sa from an IP literal, NET_ERR if ip is not one
+ */
+int netSockAddrExFromIp(char *ip, int port, sockAddrEx *sa) {
+    bzero(sa, sizeof(*sa));
+
+    sockAddrIpV4 *sa4 = (sockAddrIpV4 *)&sa->sa;
+    if (inet_pton(AF_INET, ip, &sa4->sin_addr) == 1) {
+        sa4->sin_family = AF_INET;
+        sa4->sin_port = htons(port);
+        sa->sa_len = sizeof(sockAddrIpV4);
+        return NET_OK;
+    }
+
+    sockAddrIpV6 *sa6 = (sockAddrIpV6 *)&sa->sa;
+    if (inet_pton(AF_INET6, ip, &sa6->sin6_addr) == 1) {
+        sa6->sin6_family = AF_INET6;
+        sa6->sin6_port = htons(port);
+        sa->sa_len = sizeof(sockAddrIpV6);
+        return NET_OK;
+    }
+
+    return NET_ERR;
+}
+
+/*
+ Set the outbound addresses from a comma separated list of IPs
+ */
+int netOutboundSet(char *err, char *addrs) {
+    char buf[NET_IP_MAX_STR_LEN];
+    char *p = addrs, *end;
+    int len;
+
+    outbound.count = 0;
+    outbound.next = 0;
+
+    while (p && *p) {
+        end = strchr(p, ',');
+        len = end ? end - p : (int)strlen(p);
+        if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+
+        memcpy(buf, p, len);
+        buf[len] = '\0';
+        p = end ? end + 1 : NULL;
+        if (len == 0) continue;
+
+        if (outbound.count == NET_OUTBOUND_MAX_ADDRS) {
+            anetSetError(err, "too many outbound addresses, max %d", NET_OUTBOUND_MAX_ADDRS);
+            return NET_ERR;
+        }
+
+        if (netSockAddrExFromIp(buf, 0, &outbound.addrs[outbound.count]) == NET_ERR) {
+            anetSetError(err, "invalid outbound address: %s", buf);
+            return NET_ERR;
+        }
+        outbound.count++;
+    }
+
+    return outbound.count;
+}
+
+/*
+ Next outbound address of the family, NULL if there is none
+ */
+sockAddrEx *netOutboundGet(int af) {
+    for (int i = 0; i < outbound.count; i++) {
+        int idx = (outbound.next + i) % outbound.count;
+
+        if (outbound.addrs[idx].sa.ss_family == af) {
+            outbound.next = idx + 1;
+            return &outbound.addrs[idx];
+        }
+    }
+    return NULL;
+}
+
+/*
+ Bind s to the next outbound address, the port is still picked at connect time
+ so the 4-tuples are shared with the other destinations
+ */
+static int netOutboundBind(char *err, int s, int af) {
+    sockAddrEx *sa = netOutboundGet(af);
+    if (!sa) return NET_OK;
+
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    int yes = 1;
+    setsockopt(s, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+#endif
+    if (anetBind(err, s, (sockAddr *)&sa->sa, sa->sa_len) == ANET_ERR) return NET_ERR;
+
+    return NET_OK;
+}
+
+/*
+ Resolve host into at most size addresses, ordered as RFC 8305 section 4 suggests:
+ the preferred family first, then the families interleaved. The preferred family is
+ the one that won the last race to this host, or else the first one getaddrinfo gave.
+ */
+int netTcpResolve(char *err, char *host, int port, sockAddrEx *addrs, int size) {
+    int rv, af, n = 0, n_pref = 0, n_other = 0;
+    char port_s[PORT_MAX_STR_LEN];
     addrInfo hints, *servinfo, *p;
+    addrInfo *pref[NET_CONNECT_MAX_ADDRS], *other[NET_CONNECT_MAX_ADDRS];
+
+    // IP literals never reach the resolver
+    if (size > 0 && netSockAddrExFromIp(host, port, &addrs[0]) == NET_OK) return 1;
 
-    snprintf(portstr, sizeof(portstr), "%d", port);
-    memset(&hints, 0, sizeof(hints));
+    snprintf(port_s, sizeof(port_s), "%d", port);
+    bzero(&hints, sizeof(hints));
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
 
-    if ((rv = getaddrinfo(addr, portstr, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(host, port_s, &hints, &servinfo)) != 0) {
         anetSetError(err, "%s", gai_strerror(rv));
         return NET_ERR;
     }
+
+    if (size > NET_CONNECT_MAX_ADDRS) size = NET_CONNECT_MAX_ADDRS;
+
+    af = netAfCacheGet(host);
+    if (af == AF_UNSPEC) af = servinfo->ai_family;
+
     for (p = servinfo; p != NULL; p = p->ai_next) {
-        if ((s = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
-        if (anetSetReuseAddr(err, s) == ANET_ERR) goto error;
-        if (anetNonBlock(err, s) == ANET_ERR) goto error;
-        if (connect(s, p->ai_addr, p->ai_addrlen) == -1) {
-            if (errno == EINPROGRESS) break;
+        if (p->ai_family != AF_INET && p->ai_family != AF_INET6) continue;
 
-            close(s);
-            s = NET_ERR;
-            continue;
+        if (p->ai_family == af) {
+            if (n_pref < size) pref[n_pref++] = p;
+        } else {
+            if (n_other < size) other[n_other++] = p;
         }
-        break;
     }
-    if (p) {
-        if (sa) {
-            memcpy(&sa->sa, p->ai_addr, p->ai_addrlen);
-            sa->sa_len = p->ai_addrlen;
+
+    for (int i = 0; n < size && (i < n_pref || i < n_other); i++) {
+        if (i < n_pref) {
+            memcpy(&addrs[n].sa, pref[i]->ai_addr, pref[i]->ai_addrlen);
+            addrs[n++].sa_len = pref[i]->ai_addrlen;
+        }
+        if (i < n_other && n < size) {
+            memcpy(&addrs[n].sa, other[i]->ai_addr, other[i]->ai_addrlen);
+            addrs[n++].sa_len = other[i]->ai_addrlen;
         }
-        goto end;
     }
 
-    anetSetError(err, "creating socket: %s", STRERR);
+    freeaddrinfo(servinfo);
 
-error:
-    if (s != NET_ERR) {
-        close(s);
-        s = NET_ERR;
+    if (n == 0) {
+        anetSetError(err, "Failed to resolve addr");
+        return NET_ERR;
     }
 
-end:
-    freeaddrinfo(servinfo);
-    return s;
+    return n;
+}
+
+static unsigned int netAfCacheSlot(char *host) {
+    unsigned int h = 5381;
+    while (*host) h = (h << 5) + h + (unsigned char)*host++;
+    return h % NET_AF_CACHE_SIZE;
+}
+
+int netAfCacheGet(char *host) {
+    if (!host) return AF_UNSPEC;
+
+    netAfCacheEntry *entry = &afCache[netAfCacheSlot(host)];
+
+    return strcmp(entry->host, host) == 0 ? entry->af : AF_UNSPEC;
+}
+
+void netAfCacheSet(char *host, int af) {
+    if (!host) return;
+
+    netAfCacheEntry *entry = &afCache[netAfCacheSlot(host)];
+
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->af = af;
 }
 
 int netUdpServer(char *err, int port, char *bindaddr) {
@@ -197,6 +425,66 @@ int netSetIpV6Only(char *err, int fd, int ipv6_only) {
     return NET_OK;
 }
 
+/* Bytes queued in the receive buffer of fd, or -1 on error */
+int netReadPending(int fd) {
+    int pending;
+
+    if (ioctl(fd, FIONREAD, &pending) == -1) return -1;
+    return pending;
+}
+
+void netSockOptsInit(netSockOpts *opts) {
+    opts->no_delay = -1;
+    opts->rcvbuf = -1;
+    opts->sndbuf = -1;
+    opts->keepalive = -1;
+    opts->quickack = -1;
+    opts->defer_accept = -1;
+    opts->congestion = NULL;
+}
+
+static int netSetSockOptInt(char *err, int fd, int level, int name, char *name_str, int val) {
+    if (setsockopt(fd, level, name, &val, sizeof(val)) == -1) {
+        anetSetError(err, "setsockopt %s: %s", name_str, STRERR);
+        return NET_ERR;
+    }
+    return NET_OK;
+}
+
+/* Options missing on the platform are skipped */
+int netSetSockOpts(char *err, int fd, netSockOpts *opts) {
+    if (opts->no_delay != -1 &&
+        netSetSockOptInt(err, fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", opts->no_delay) == NET_ERR)
+        return NET_ERR;
+    if (opts->rcvbuf > 0 &&
+        netSetSockOptInt(err, fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", opts->rcvbuf) == NET_ERR)
+        return NET_ERR;
+    if (opts->sndbuf > 0 &&
+        netSetSockOptInt(err, fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", opts->sndbuf) == NET_ERR)
+        return NET_ERR;
+    if (opts->keepalive > 0 && anetKeepAlive(err, fd, MAX(opts->keepalive, 3)) == ANET_ERR)
+        return NET_ERR;
+#ifdef TCP_QUICKACK
+    if (opts->quickack != -1 &&
+        netSetSockOptInt(err, fd, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", opts->quickack) == NET_ERR)
+        return NET_ERR;
+#endif
+#ifdef TCP_DEFER_ACCEPT
+    if (opts->defer_accept > 0 &&
+        netSetSockOptInt(err, fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT",
+                         opts->defer_accept) == NET_ERR)
+        return NET_ERR;
+#endif
+#ifdef TCP_CONGESTION
+    if (opts->congestion &&
+        setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, opts->congestion, strlen(opts->congestion)) == -1) {
+        anetSetError(err, "setsockopt TCP_CONGESTION %s: %s", opts->congestion, STRERR);
+        return NET_ERR;
+    }
+#endif
+    return NET_OK;
+}
+
 int netNoSigPipe(char *err, int fd) {
 #ifdef SO_NOSIGPIPE
     int yes = 1;
@@ -314,6 +602,44 @@ int netIpPresentBySockAddr(char *err, char *ip, int ip_len, int *port, sockAddrE
     return NET_OK;
 }
 
+/*
+ The addresses of the conns are kept binary and only formatted here when a log line
+ wants them. The strings live in a few rotating buffers, enough for one log line.
+ */
+static char *netAddrinfoBuffer() {
+    static __thread char bufs[NET_ADDRINFO_BUFS][ADDR_INFO_STR_LEN];
+    static __thread int idx = 0;
+
+    idx = (idx + 1) % NET_ADDRINFO_BUFS;
+    return bufs[idx];
+}
+
+char *netFormatAddr(char *host, int port) {
+    char *buf = netAddrinfoBuffer();
+
+    anetFormatAddr(buf, ADDR_INFO_STR_LEN, host, port);
+    return buf;
+}
+
+char *netFormatSockAddr(sockAddrEx *sa) {
+    char ip[NET_IP_MAX_STR_LEN];
+    int port;
+
+    if (netIpPresentBySockAddr(NULL, ip, sizeof(ip), &port, sa) == NET_ERR) return "?:0";
+    return netFormatAddr(ip, port);
+}
+
+/*
+ Local address of the socket
+ */
+char *netFormatSock(int fd) {
+    sockAddrEx sa;
+
+    sa.sa_len = sizeof(sa.sa);
+    if (fd == -1 || getsockname(fd, (sockAddr *)&sa.sa, &sa.sa_len) == -1) return "?:0";
+    return netFormatSockAddr(&sa);
+}
+
 int netIpPresentByIpAddr(char *err, char *ip, int ip_len, void *addr, int is_ipv6) {
     if (!inet_ntop(!is_ipv6 ? AF_INET : AF_INET6, addr, ip, ip_len)) {
         anetSetError(err, "inet_ntop error: %s", STRERR);
@@ -34,6 +34,10 @@
 
 #define IOBUF_MIN_LEN  (1024)  /* Generic I/O buffer size */
 
+#define NET_CONNECT_MAX_ADDRS 8  /* Max addresses raced for one connect */
+#define NET_OUTBOUND_MAX_ADDRS 64  /* Max source addresses of the outgoing conns */
+#define NET_ADDRINFO_BUFS 4  /* Addresses formatted at once, e.g. in one log line */
+
 typedef struct in_addr ipV4Addr;
 typedef struct in6_addr ipV6Addr;
 typedef struct sockaddr_storage sockAddrStorage;
@@ -47,6 +51,17 @@ typedef struct sockAddrEx {
     socklen_t sa_len;
 } sockAddrEx;
 
+/* Socket tuning of one side, -1 (NULL for congestion) keeps the system default */
+typedef struct netSockOpts {
+    int no_delay;
+    int rcvbuf;
+    int sndbuf;
+    int keepalive; // Seconds before the first probe
+    int quickack;
+    int defer_accept; // Seconds, listeners only
+    char *congestion;
+} netSockOpts;
+
 enum {
     NET_OK = 0,
     NET_ERR = -1,
@@ -57,11 +72,20 @@ int isIPv6Addr(char *ip);
 
 int netTcpRead(char *err, int fd, char *buf, int buflen, int *closed);
 int netTcpWrite(char *err, int fd, char *buf, int buflen);
+int netTcpPeek(char *err, int fd, char *buf, int buflen);
 
 int netUdpRead(char *err, int fd, char *buf, int buflen, sockAddrEx *sa);
 int netUdpWrite(char *err, int fd, char *buf, int buflen, sockAddrEx *sa);
 
+int netTcpAccept(char *err, int s, sockAddrEx *sa);
 int netTcpNonBlockConnect(char *err, char *host, int port, sockAddrEx *sa);
+int netTcpNonBlockConnectAddr(char *err, sockAddrEx *sa);
+int netTcpResolve(char *err, char *host, int port, sockAddrEx *addrs, int size);
+int netSockAddrExFromIp(char *ip, int port, sockAddrEx *sa);
+int netAfCacheGet(char *host);
+void netAfCacheSet(char *host, int af);
+int netOutboundSet(char *err, char *addrs);
+sockAddrEx *netOutboundGet(int af);
 
 int netUdpServer(char *err, int port, char *bindaddr);
 int netUdp6Server(char *err, int port, char *bindaddr);
@@ -70,6 +94,9 @@ int netSendTimeout(char *err, int fd, int s);
 int netRecvTimeout(char *err, int fd, int s);
 int netSetIpV6Only(char *err, int fd, int ipv6_only);
 int netNoSigPipe(char *err, int fd);
+int netReadPending(int fd);
+void netSockOptsInit(netSockOpts *opts);
+int netSetSockOpts(char *err, int fd, netSockOpts *opts);
 
 void netSockAddrExInit(sockAddrEx *sa);
 int netTcpGetDestSockAddr(char *err, int fd, int ipv6_first, sockAddrEx *sa);
@@ -77,5 +104,8 @@ int netUdpGetSockAddrEx(char *err, char *host, int port, int ipv6_first, sockAdd
 int netIpPresentBySockAddr(char *err, char *ip, int ip_len, int *port, sockAddrEx *sae);
 int netIpPresentByIpAddr(char *err, char *ip, int ip_len, void *addr, int is_ipv6);
 int netHostPortParse(char *addr, char *host, int *port);
+char *netFormatAddr(char *host, int port);
+char *netFormatSockAddr(sockAddrEx *sa);
+char *netFormatSock(int fd);
 
 #endif /* __NET_H */
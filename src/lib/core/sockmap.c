@@ -0,0 +1,277 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+
+#include "error.h"
+#include "net.h"
+#include "sockmap.h"
+
+#if defined(__linux__) && defined(SO_COOKIE)
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+
+#define BPF_INSN(c, d, s, o, i) ((struct bpf_insn){.code = c, .dst_reg = d, .src_reg = s, .off = o, .imm = i})
+#define BPF_MOV64_REG(d, s) BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define BPF_MOV64_IMM(d, i) BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define BPF_ADD64_IMM(d, i) BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define BPF_LDX_MEM(sz, d, s, o) BPF_INSN(BPF_LDX | BPF_MEM | sz, d, s, o, 0)
+#define BPF_STX_MEM(sz, d, s, o) BPF_INSN(BPF_STX | BPF_MEM | sz, d, s, o, 0)
+#define BPF_LD_MAP_FD(d, fd) \
+    BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd), BPF_INSN(0, 0, 0, 0, 0)
+#define BPF_JEQ_IMM(d, i, o) BPF_INSN(BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define BPF_CALL_FUNC(f) BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define BPF_EXIT_INSN() BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/*
+ Sockets of pair slot k are at 2k and 2k+1 of the sockmap, the pairs map gives
+ the sockmap index of the peer by the socket cookie.
+ */
+static struct sockmapState {
+    int enabled;
+    int size;
+    int sockmap_fd;
+    int pairs_fd;
+    int parser_fd;
+    int verdict_fd;
+    int *free_slots;
+    int free_count;
+    uint64_t *cookies;
+} sm = {0, 0, -1, -1, -1, -1, NULL, 0, NULL};
+
+static int sys_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int sockmapMapCreate(char *err, int type, int key_size, int value_size, int max_entries) {
+    union bpf_attr attr;
+    int fd;
+
+    bzero(&attr, sizeof(attr));
+    attr.map_type = type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+
+    if ((fd = sys_bpf(BPF_MAP_CREATE, &attr)) == -1) errorSet(err, "bpf map create: %s", STRERR);
+    return fd;
+}
+
+static int sockmapProgLoad(char *err, struct bpf_insn *insns, int insn_cnt, int attach_type) {
+    union bpf_attr attr;
+    int fd;
+
+    bzero(&attr, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t)(unsigned long)insns;
+    attr.insn_cnt = insn_cnt;
+    attr.license = (uint64_t)(unsigned long)"GPL";
+
+    if ((fd = sys_bpf(BPF_PROG_LOAD, &attr)) == -1) {
+        errorSet(err, "bpf prog load: %s", STRERR);
+        return -1;
+    }
+
+    bzero(&attr, sizeof(attr));
+    attr.target_fd = sm.sockmap_fd;
+    attr.attach_bpf_fd = fd;
+    attr.attach_type = attach_type;
+
+    if (sys_bpf(BPF_PROG_ATTACH, &attr) == -1) {
+        errorSet(err, "bpf prog attach: %s", STRERR);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int sockmapUpdate(int map_fd, void *key, void *value) {
+    union bpf_attr attr;
+
+    bzero(&attr, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(unsigned long)key;
+    attr.value = (uint64_t)(unsigned long)value;
+    attr.flags = BPF_ANY;
+
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static void sockmapDelete(int map_fd, void *key) {
+    union bpf_attr attr;
+
+    bzero(&attr, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (uint64_t)(unsigned long)key;
+
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+int sockmapInit(char *err, int size) {
+    // Whole skb is one message
+    struct bpf_insn parser[] = {
+        BPF_LDX_MEM(BPF_W, BPF_REG_0, BPF_REG_1, offsetof(struct __sk_buff, len)),
+        BPF_EXIT_INSN(),
+    };
+
+    sm.sockmap_fd = sockmapMapCreate(err, BPF_MAP_TYPE_SOCKMAP, sizeof(uint32_t), sizeof(uint32_t), size * 2);
+    if (sm.sockmap_fd == -1) goto error;
+    sm.pairs_fd = sockmapMapCreate(err, BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint32_t), size * 2);
+    if (sm.pairs_fd == -1) goto error;
+
+    // Redirect to the peer of the socket, pass when it is not paired
+    struct bpf_insn verdict[] = {
+        BPF_MOV64_REG(BPF_REG_6, BPF_REG_1),
+        BPF_CALL_FUNC(BPF_FUNC_get_socket_cookie),
+        BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0, -8),
+        BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+        BPF_ADD64_IMM(BPF_REG_2, -8),
+        BPF_LD_MAP_FD(BPF_REG_1, sm.pairs_fd),
+        BPF_CALL_FUNC(BPF_FUNC_map_lookup_elem),
+        BPF_JEQ_IMM(BPF_REG_0, 0, 7),
+        BPF_LDX_MEM(BPF_W, BPF_REG_3, BPF_REG_0, 0),
+        BPF_MOV64_REG(BPF_REG_1, BPF_REG_6),
+        BPF_LD_MAP_FD(BPF_REG_2, sm.sockmap_fd),
+        BPF_MOV64_IMM(BPF_REG_4, 0),
+        BPF_CALL_FUNC(BPF_FUNC_sk_redirect_map),
+        BPF_EXIT_INSN(),
+        BPF_MOV64_IMM(BPF_REG_0, SK_PASS),
+        BPF_EXIT_INSN(),
+    };
+
+    sm.parser_fd = sockmapProgLoad(err, parser, sizeof(parser) / sizeof(parser[0]),
+                                   BPF_SK_SKB_STREAM_PARSER);
+    if (sm.parser_fd == -1) goto error;
+    sm.verdict_fd = sockmapProgLoad(err, verdict, sizeof(verdict) / sizeof(verdict[0]),
+                                    BPF_SK_SKB_STREAM_VERDICT);
+    if (sm.verdict_fd == -1) goto error;
+
+    sm.size = size;
+    sm.free_slots = xs_calloc(size * sizeof(int));
+    sm.cookies = xs_calloc(size * 2 * sizeof(uint64_t));
+    for (int i = 0; i < size; i++) sm.free_slots[i] = size - 1 - i;
+    sm.free_count = size;
+    sm.enabled = 1;
+
+    return NET_OK;
+
+error:
+    sockmapFree();
+    return NET_ERR;
+}
+
+void sockmapFree() {
+    if (sm.verdict_fd != -1) close(sm.verdict_fd);
+    if (sm.parser_fd != -1) close(sm.parser_fd);
+    if (sm.pairs_fd != -1) close(sm.pairs_fd);
+    if (sm.sockmap_fd != -1) close(sm.sockmap_fd);
+    sm.verdict_fd = sm.parser_fd = sm.pairs_fd = sm.sockmap_fd = -1;
+
+    xs_free(sm.free_slots);
+    xs_free(sm.cookies);
+    sm.free_count = 0;
+    sm.enabled = 0;
+}
+
+int sockmapIsEnabled() {
+    return sm.enabled;
+}
+
+/*
+ Hand the pair over to the kernel, return the pair slot. The caller makes sure
+ no data is queued on both sockets, or it may be relayed out of order.
+ */
+int sockmapAddPair(char *err, int fd1, int fd2) {
+    uint64_t cookie1, cookie2;
+    socklen_t len = sizeof(uint64_t);
+    uint32_t idx1, idx2;
+    int slot;
+
+    if (!sm.enabled || sm.free_count == 0) {
+        errorSet(err, "sockmap is disabled or full");
+        return NET_ERR;
+    }
+
+    if (getsockopt(fd1, SOL_SOCKET, SO_COOKIE, &cookie1, &len) == -1 ||
+        getsockopt(fd2, SOL_SOCKET, SO_COOKIE, &cookie2, &len) == -1) {
+        errorSet(err, "getsockopt SO_COOKIE: %s", STRERR);
+        return NET_ERR;
+    }
+
+    slot = sm.free_slots[--sm.free_count];
+    idx1 = slot * 2;
+    idx2 = slot * 2 + 1;
+    sm.cookies[idx1] = cookie1;
+    sm.cookies[idx2] = cookie2;
+
+    // Peers first, the sockets start to be redirected once they are in the sockmap
+    if (sockmapUpdate(sm.pairs_fd, &cookie1, &idx2) == -1 ||
+        sockmapUpdate(sm.pairs_fd, &cookie2, &idx1) == -1 ||
+        sockmapUpdate(sm.sockmap_fd, &idx1, &fd1) == -1 ||
+        sockmapUpdate(sm.sockmap_fd, &idx2, &fd2) == -1) {
+        errorSet(err, "bpf map update: %s", STRERR);
+        sockmapDelPair(slot);
+        return NET_ERR;
+    }
+
+    return slot;
+}
+
+void sockmapDelPair(int slot) {
+    uint32_t idx1 = slot * 2;
+    uint32_t idx2 = slot * 2 + 1;
+
+    if (!sm.enabled || slot < 0) return;
+
+    sockmapDelete(sm.sockmap_fd, &idx1);
+    sockmapDelete(sm.sockmap_fd, &idx2);
+    sockmapDelete(sm.pairs_fd, &sm.cookies[idx1]);
+    sockmapDelete(sm.pairs_fd, &sm.cookies[idx2]);
+
+    sm.free_slots[sm.free_count++] = slot;
+}
+
+#else
+
+int sockmapInit(char *err, int size) {
+    UNUSED(size);
+
+    errorSet(err, "sockmap is only supported on Linux");
+    return NET_ERR;
+}
+
+void sockmapFree() {}
+
+int sockmapIsEnabled() {
+    return 0;
+}
+
+int sockmapAddPair(char *err, int fd1, int fd2) {
+    UNUSED(fd1);
+    UNUSED(fd2);
+
+    errorSet(err, "sockmap is only supported on Linux");
+    return NET_ERR;
+}
+
+void sockmapDelPair(int slot) {
+    UNUSED(slot);
+}
+
+#endif
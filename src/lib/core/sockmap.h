@@ -0,0 +1,32 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SOCKMAP_H
+#define __SOCKMAP_H
+
+/* Kernel relay of socket pairs by an eBPF sockmap, Linux only */
+
+int sockmapInit(char *err, int size);
+void sockmapFree();
+int sockmapIsEnabled();
+
+int sockmapAddPair(char *err, int fd1, int fd2);
+void sockmapDelPair(int slot);
+
+#endif /* __SOCKMAP_H */
@@ -24,6 +24,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 
 void xs_daemonize() {
@@ -48,6 +49,31 @@ void setupIgnoreHandlers() {
     signal(SIGPIPE, SIG_IGN);
 }
 
+/*
+ Raise the soft RLIMIT_NOFILE to nofile, or to the hard limit if nofile <= 0.
+ The hard limit is only raised with the privilege to do so. Return the limit in effect.
+ */
+int setOpenFilesLimit(int nofile) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) return -1;
+
+    rlim_t want = nofile > 0 ? (rlim_t)nofile : limit.rlim_max;
+    if (want <= limit.rlim_cur) return (int)MIN(limit.rlim_cur, INT_MAX);
+
+    limit.rlim_cur = want;
+    if (want > limit.rlim_max) limit.rlim_max = want;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        // Unprivileged, try the hard limit at least
+        getrlimit(RLIMIT_NOFILE, &limit);
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    return (int)MIN(limit.rlim_cur, INT_MAX);
+}
+
 void hexdump(const void *memory, size_t bytes) {
     const unsigned char *p, *q;
     int i;
@@ -25,6 +25,7 @@
 void xs_daemonize();
 
 void setupIgnoreHandlers();
+int setOpenFilesLimit(int nofile);
 
 void hexdump(const void *memory, size_t bytes);
 char *xs_itoa(int i);
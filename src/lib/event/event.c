@@ -48,11 +48,19 @@ void eventLoopStop(eventLoop *el) {
     eventApiStop(el->ctx);
 }
 
+/*
+ Microseconds at which the loop came back from the last poll
+ */
+uint64_t eventLoopWakeTime(eventLoop *el) {
+    return eventApiWakeTime(el->ctx);
+}
+
 event *eventNew(int id, int type, int flags, eventHandler handler, void *data) {
     event *e = xs_calloc(sizeof(*e));
     e->id = id;
     e->type = type;
     e->flags = flags;
+    e->priority = EVENT_PRIORITY_NORMAL;
     e->handler = handler;
     e->data = data;
     e->el = NULL;
@@ -85,6 +93,16 @@ void eventDel(event *e) {
     e->el = NULL;
 }
 
+/*
+ Only IO events honor the priority, the ready low ones wait for the normal ones
+ */
+void eventSetPriority(event *e, int priority) {
+    if (!e || e->type != EVENT_TYPE_IO || e->priority == priority) return;
+
+    e->priority = priority;
+    eventApiSetPriority(e->el ? e->el->ctx : NULL, e->ctx);
+}
+
 char *eventGetApiName() {
     return eventApiName();
 }
@@ -38,6 +38,11 @@ enum {
     EVENT_FLAG_TIME_REPEAT = 1,
 };
 
+enum {
+    EVENT_PRIORITY_NORMAL = 0,
+    EVENT_PRIORITY_LOW = 1, // Handled after the normal IO events of the same poll
+};
+
 typedef struct eventLoop {
     struct eventLoopContext *ctx;
 } eventLoop;
@@ -49,6 +54,7 @@ typedef struct event {
     int id;
     int type;
     int flags;
+    int priority;
     eventHandler handler;
     void *data;
     struct eventLoop *el;
@@ -67,11 +73,13 @@ eventLoop *eventLoopNew(int size);
 void eventLoopFree(eventLoop *el);
 void eventLoopRun(eventLoop *el);
 void eventLoopStop(eventLoop *el);
+uint64_t eventLoopWakeTime(eventLoop *el);
 
 event *eventNew(int id, int type, int flags, eventHandler handler, void *data);
 void eventFree(event *e);
 int eventAdd(eventLoop *el, event *e);
 void eventDel(event *e);
+void eventSetPriority(event *e, int priority);
 
 char *eventGetApiName();
 
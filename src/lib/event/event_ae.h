@@ -20,6 +20,9 @@
 #ifndef __XS_EVENT_AE_H
 #define __XS_EVENT_AE_H
 
+#include "../core/dlist.h"
+#include "../core/time.h"
+
 #include "redis/ae.h"
 
 #include <signal.h>
@@ -31,21 +34,60 @@ typedef struct eventLoopContext {
 typedef struct eventContext {
     event *e;
     int mask;
+    dlistNode deferred; // Fired with a low priority, on the deferred list
 } eventContext;
 
 #define _MAX_SIGNUM NSIG
 
 static void *signals[_MAX_SIGNUM] = {NULL};
 
+/* Low priority IO events fired by the last poll, handled before the next one */
+static dlist deferred_list = {NULL, NULL};
+static uint64_t wake_time = 0;
+
+static void eventDeferredLink(eventContext *ctx) {
+    if (dlistIsLinked(&deferred_list, &ctx->deferred)) return;
+
+    dlistPushTail(&deferred_list, &ctx->deferred);
+}
+
+static void eventDeferredUnlink(eventContext *ctx) {
+    dlistUnlink(&deferred_list, &ctx->deferred);
+}
+
 static void eventIoHandler(aeEventLoop *el, int fd, void *data, int mask) {
     UNUSED(el);
     UNUSED(fd);
     UNUSED(mask);
 
     event *e = data;
+    if (e->priority == EVENT_PRIORITY_LOW) {
+        eventDeferredLink(e->ctx);
+        return;
+    }
     e->handler(e);
 }
 
+/*
+ ae fires the events of a poll in the fd order, so the low ones are queued and run
+ here, after all the normal ones and the timers. A handler may delete a queued event.
+ */
+static void eventBeforeSleep(aeEventLoop *el) {
+    UNUSED(el);
+
+    eventContext *ctx;
+    while ((ctx = DLIST_ENTRY(deferred_list.head, eventContext, deferred)) != NULL) {
+        eventDeferredUnlink(ctx);
+        ctx->e->handler(ctx->e);
+    }
+}
+
+static void eventAfterSleep(aeEventLoop *el) {
+    UNUSED(el);
+
+    wake_time = timerStart();
+}
+
 static int eventTimeHandler(aeEventLoop *el, long long id, void *data) {
     UNUSED(el);
     UNUSED(id);
@@ -70,6 +112,8 @@ static void eventSignalHandler(int signal, siginfo_t *siginfo, void *data) {
 static eventLoopContext *eventApiNewLoop(int size) {
     eventLoopContext *ctx = xs_calloc(sizeof(*ctx));
     ctx->el = aeCreateEventLoop(size);
+    aeSetBeforeSleepProc(ctx->el, eventBeforeSleep);
+    aeSetAfterSleepProc(ctx->el, eventAfterSleep);
 
     return ctx;
 }
@@ -95,13 +139,27 @@ static eventContext *eventApiNewEvent(event *e) {
 }
 
 static void eventApiFreeEvent(eventContext *ctx) {
+    eventDeferredUnlink(ctx);
     xs_free(ctx);
 }
 
+/*
+ The fd table grows on demand, doubled to keep the resizes rare
+ */
+static int eventApiFitSize(aeEventLoop *el, int fd) {
+    int size = aeGetSetSize(el);
+
+    if (fd < size) return AE_OK;
+    while (size <= fd) size *= 2;
+
+    return aeResizeSetSize(el, size);
+}
+
 static int eventApiAddEvent(eventLoopContext *elCtx, eventContext *eCtx) {
     event *e = eCtx->e;
 
     if (e->type == EVENT_TYPE_IO) {
+        if (eventApiFitSize(elCtx->el, e->id) == AE_ERR) return EVENT_ERR;
         if (aeCreateFileEvent(elCtx->el, e->id, eCtx->mask, eventIoHandler, e) == AE_ERR)
             return EVENT_ERR;
     } else if (e->type == EVENT_TYPE_TIME) {
@@ -126,13 +184,29 @@ static int eventApiAddEvent(eventLoopContext *elCtx, eventContext *eCtx) {
 static void eventApiDelEvent(eventLoopContext *elCtx, eventContext *eCtx) {
     event *e = eCtx->e;
     switch (e->type) {
-        case EVENT_TYPE_IO: aeDeleteFileEvent(elCtx->el, e->id, eCtx->mask); break;
+        case EVENT_TYPE_IO:
+            aeDeleteFileEvent(elCtx->el, e->id, eCtx->mask);
+            eventDeferredUnlink(eCtx);
+            break;
         case EVENT_TYPE_TIME: aeDeleteTimeEvent(elCtx->el, eCtx->mask); break;
         case EVENT_TYPE_SIGNAL: signals[e->id] = NULL; signal(e->id, SIG_DFL); break;
         default: LOGE("Unknown event type!"); break;
     }
 }
 
+static void eventApiSetPriority(eventLoopContext *elCtx, eventContext *eCtx) {
+    UNUSED(elCtx);
+    UNUSED(eCtx);
+
+    // Checked when the event fires, a queued one still runs this round
+}
+
+static uint64_t eventApiWakeTime(eventLoopContext *ctx) {
+    UNUSED(ctx);
+
+    return wake_time;
+}
+
 static void eventApiRun(eventLoopContext *ctx) {
     aeMain(ctx->el);
 }
@@ -136,6 +136,22 @@ static void eventApiDelEvent(eventLoopContext *elCtx, eventContext *eCtx) {
     }
 }
 
+/*
+ libev invokes the pending watchers by priority, it is only set on a stopped watcher
+ */
+static void eventApiSetPriority(eventLoopContext *elCtx, eventContext *eCtx) {
+    int active = elCtx && ev_is_active(&eCtx->w.io);
+    int priority = eCtx->e->priority == EVENT_PRIORITY_LOW ? EV_MINPRI : 0;
+
+    if (active) ev_io_stop(elCtx->el, &eCtx->w.io);
+    ev_set_priority(&eCtx->w.io, priority);
+    if (active) ev_io_start(elCtx->el, &eCtx->w.io);
+}
+
+static uint64_t eventApiWakeTime(eventLoopContext *ctx) {
+    return (uint64_t)(ev_now(ctx->el) * MICROSECOND_UNIT);
+}
+
 static void eventApiRun(eventLoopContext *ctx) {
     ev_run(ctx->el, 0);
 }
@@ -0,0 +1,329 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../core/common.h"
+
+#include "dns.h"
+
+#include <ctype.h>
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_RD 0x0100
+#define DNS_FLAG_RA 0x0080
+#define DNS_OPCODE_MASK 0x7800
+#define DNS_FLAG_TC 0x0200
+#define DNS_RCODE_MASK 0x000F
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_NAME_PTR 0xC00C /* Compression pointer to the question name */
+
+#define READ_U16(p) (((uint8_t)(p)[0] << 8) | (uint8_t)(p)[1])
+#define WRITE_U16(p, v) do { (p)[0] = (char)((v) >> 8); (p)[1] = (char)(v); } while (0)
+
+/*
+ Parse a standard query with a single IN question. The name is returned lowercased
+ and dotted, the length of the message up to the end of the question on success.
+ */
+int dnsParseQuery(char *buf, int buf_len, char *name, int name_len, int *qtype) {
+    char *p = buf + DNS_HEADER_LEN, *end = buf + buf_len;
+    int n = 0;
+
+    if (buf_len < DNS_HEADER_LEN) return DNS_ERR;
+    if (READ_U16(buf + 2) & (DNS_FLAG_QR | DNS_OPCODE_MASK)) return DNS_ERR;
+    if (READ_U16(buf + 4) != 1) return DNS_ERR;
+
+    while (p < end && *p != 0) {
+        int label_len = (uint8_t)*p;
+
+        if (label_len > 63 || end - p - 1 < label_len) return DNS_ERR;
+        if (n + label_len + 1 >= name_len) return DNS_ERR;
+
+        if (n > 0) name[n++] = '.';
+        for (int i = 0; i < label_len; i++) name[n++] = tolower((uint8_t)p[1 + i]);
+        p += 1 + label_len;
+    }
+    if (p >= end || n == 0) return DNS_ERR;
+    name[n] = '\0';
+    p++;
+
+    if (end - p < 4 || READ_U16(p + 2) != DNS_CLASS_IN) return DNS_ERR;
+    if (qtype) *qtype = READ_U16(p);
+
+    return p + 4 - buf;
+}
+
+static int dnsSkipName(char *buf, int buf_len, int off);
+static int dnsMatchName(char *buf, int buf_len, int off, char *name);
+
+/*
+ Turn the query of qlen bytes into its answer in place, with one record of addr or none
+ when addr is NULL. Whatever followed the question, e.g. EDNS, is dropped. Returns the
+ length of the answer.
+ */
+int dnsBuildAnswer(char *buf, int qlen, int buf_cap, int qtype, void *addr, int ttl) {
+    int addr_len = qtype == DNS_TYPE_AAAA ? 16 : 4;
+    char *p = buf + qlen;
+
+    if (addr && buf_cap - qlen < 12 + addr_len) return DNS_ERR;
+
+    WRITE_U16(buf + 2, DNS_FLAG_QR | DNS_FLAG_RA | (READ_U16(buf + 2) & DNS_FLAG_RD));
+    WRITE_U16(buf + 6, addr ? 1 : 0);
+    WRITE_U16(buf + 8, 0);
+    WRITE_U16(buf + 10, 0);
+    if (!addr) return qlen;
+
+    WRITE_U16(p, DNS_NAME_PTR);
+    WRITE_U16(p + 2, qtype);
+    WRITE_U16(p + 4, DNS_CLASS_IN);
+    WRITE_U16(p + 6, ttl >> 16);
+    WRITE_U16(p + 8, ttl & 0xFFFF);
+    WRITE_U16(p + 10, addr_len);
+    memcpy(p + 12, addr, addr_len);
+
+    return qlen + 12 + addr_len;
+}
+
+/*
+ Build a recursive query for one IN question of the dotted name, returns its length
+ */
+int dnsBuildQuery(char *buf, int buf_cap, int id, char *name, int qtype) {
+    int name_len = strlen(name);
+    char *p = buf + DNS_HEADER_LEN;
+
+    if (name_len > 0 && name[name_len - 1] == '.') name_len--;
+    if (name_len == 0 || name_len > 253 || buf_cap < DNS_HEADER_LEN + name_len + 6) return DNS_ERR;
+
+    memset(buf, 0, DNS_HEADER_LEN);
+    WRITE_U16(buf, id);
+    WRITE_U16(buf + 2, DNS_FLAG_RD);
+    WRITE_U16(buf + 4, 1);
+
+    for (char *label = name, *end = name + name_len; label < end;) {
+        char *dot = memchr(label, '.', end - label);
+        int label_len = (dot ? dot : end) - label;
+
+        if (label_len == 0 || label_len > 63) return DNS_ERR;
+        *p++ = (char)label_len;
+        memcpy(p, label, label_len);
+        p += label_len;
+        label += label_len + 1;
+    }
+    *p++ = 0;
+    WRITE_U16(p, qtype);
+    WRITE_U16(p + 2, DNS_CLASS_IN);
+
+    return p + 4 - buf;
+}
+
+/*
+ Parse the answer to a query built by dnsBuildQuery. The addresses of qtype found in
+ the answer section, CNAME targets included, are returned with the port and ttl is
+ their lowest TTL. A name error or an empty answer returns 0 addresses. DNS_ERR means
+ the message is not the answer to this query and is to be ignored.
+ */
+int dnsParseAnswer(char *buf, int buf_len, int id, char *name, int qtype, int port,
+                   sockAddrEx *addrs, int size, int *ttl) {
+    int flags, ancount, off, n = 0;
+
+    if (buf_len < DNS_HEADER_LEN || READ_U16(buf) != id) return DNS_ERR;
+
+    flags = READ_U16(buf + 2);
+    if (!(flags & DNS_FLAG_QR) || READ_U16(buf + 4) != 1) return DNS_ERR;
+
+    off = dnsMatchName(buf, buf_len, DNS_HEADER_LEN, name);
+    if (off == DNS_ERR || buf_len - off < 4) return DNS_ERR;
+    if (READ_U16(buf + off) != qtype || READ_U16(buf + off + 2) != DNS_CLASS_IN) return DNS_ERR;
+    off += 4;
+
+    if (flags & DNS_FLAG_TC) return DNS_ERR_TRUNCATED;
+    if ((flags & DNS_RCODE_MASK) == DNS_RCODE_NXDOMAIN) return 0;
+    if (flags & DNS_RCODE_MASK) return DNS_ERR_SERVER;
+
+    ancount = READ_U16(buf + 6);
+    if (ttl) *ttl = -1;
+
+    for (int i = 0; i < ancount; i++) {
+        int type, class, rr_ttl, rdlen;
+
+        if ((off = dnsSkipName(buf, buf_len, off)) == DNS_ERR || buf_len - off < 10) break;
+
+        type = READ_U16(buf + off);
+        class = READ_U16(buf + off + 2);
+        rr_ttl = (READ_U16(buf + off + 4) << 16 | READ_U16(buf + off + 6)) & 0x7FFFFFFF;
+        rdlen = READ_U16(buf + off + 8);
+        off += 10;
+        if (buf_len - off < rdlen) break;
+
+        if (class == DNS_CLASS_IN && ttl && (*ttl == -1 || rr_ttl < *ttl)) *ttl = rr_ttl;
+
+        if (class == DNS_CLASS_IN && type == qtype && n < size) {
+            sockAddrEx *sa = &addrs[n];
+
+            bzero(sa, sizeof(*sa));
+            if (type == DNS_TYPE_A && rdlen == 4) {
+                sockAddrIpV4 *sa4 = (sockAddrIpV4 *)&sa->sa;
+                sa4->sin_family = AF_INET;
+                sa4->sin_port = htons(port);
+                memcpy(&sa4->sin_addr, buf + off, 4);
+                sa->sa_len = sizeof(*sa4);
+                n++;
+            } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+                sockAddrIpV6 *sa6 = (sockAddrIpV6 *)&sa->sa;
+                sa6->sin6_family = AF_INET6;
+                sa6->sin6_port = htons(port);
+                memcpy(&sa6->sin6_addr, buf + off, 16);
+                sa->sa_len = sizeof(*sa6);
+                n++;
+            }
+        }
+        off += rdlen;
+    }
+
+    return n;
+}
+
+/*
+ The cache key of a standard query: its question with the name lowercased, then
+ whether it carries EDNS, as the answer to a query without must fit in 512 bytes.
+ Returns the length of the key.
+ */
+int dnsQueryKey(char *buf, int buf_len, char *key, int key_cap) {
+    int off = DNS_HEADER_LEN, n;
+
+    if (buf_len < DNS_HEADER_LEN) return DNS_ERR;
+    if (READ_U16(buf + 2) & (DNS_FLAG_QR | DNS_OPCODE_MASK)) return DNS_ERR;
+    if (READ_U16(buf + 4) != 1) return DNS_ERR;
+
+    while (off < buf_len && buf[off] != 0) {
+        int label_len = (uint8_t)buf[off];
+
+        if (label_len > 63 || buf_len - off - 1 < label_len) return DNS_ERR;
+        off += 1 + label_len;
+    }
+    if (buf_len - off < 5) return DNS_ERR;
+    off += 5;
+
+    n = off - DNS_HEADER_LEN;
+    if (n + 1 > key_cap) return DNS_ERR;
+
+    // Only the labels are lowered, the type and class bytes may look like letters
+    memcpy(key, buf + DNS_HEADER_LEN, n);
+    for (int i = 0; i < n - 5; i++) key[i] = tolower((uint8_t)key[i]);
+    key[n] = READ_U16(buf + 10) != 0;
+
+    return n + 1;
+}
+
+/*
+ The seconds an answer may be cached: the lowest TTL of its records, an SOA of the
+ authority section capped by its MINIMUM, the TTL of the negative answers. A positive
+ age first takes as many seconds off every record in place, to serve a cached copy.
+ DNS_ERR means not to cache it: truncated, failed, malformed or without records.
+ */
+int dnsAnswerTtl(char *buf, int buf_len, int age) {
+    int flags, rcode, ancount, nscount, count, off = DNS_HEADER_LEN, ttl = -1;
+
+    if (buf_len < DNS_HEADER_LEN) return DNS_ERR;
+
+    flags = READ_U16(buf + 2);
+    rcode = flags & DNS_RCODE_MASK;
+    if (!(flags & DNS_FLAG_QR) || flags & DNS_FLAG_TC) return DNS_ERR;
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) return DNS_ERR;
+
+    for (int i = READ_U16(buf + 4); i > 0; i--) {
+        if ((off = dnsSkipName(buf, buf_len, off)) == DNS_ERR || buf_len - off < 4) return DNS_ERR;
+        off += 4;
+    }
+
+    ancount = READ_U16(buf + 6);
+    nscount = READ_U16(buf + 8);
+    count = ancount + nscount + READ_U16(buf + 10);
+
+    for (int i = 0; i < count; i++) {
+        int type, rr_ttl, rdlen;
+        char *p;
+
+        if ((off = dnsSkipName(buf, buf_len, off)) == DNS_ERR || buf_len - off < 10) return DNS_ERR;
+
+        p = buf + off;
+        type = READ_U16(p);
+        rdlen = READ_U16(p + 8);
+        off += 10;
+        if (buf_len - off < rdlen) return DNS_ERR;
+        off += rdlen;
+
+        if (type == DNS_TYPE_OPT) continue; // Its TTL holds the EDNS flags
+
+        rr_ttl = (READ_U16(p + 4) << 16 | READ_U16(p + 6)) & 0x7FFFFFFF;
+        if (age > 0) {
+            int aged = rr_ttl > age ? rr_ttl - age : 0;
+            WRITE_U16(p + 4, aged >> 16);
+            WRITE_U16(p + 6, aged & 0xFFFF);
+        }
+
+        if (type == DNS_TYPE_SOA && i >= ancount && i < ancount + nscount && rdlen >= 20) {
+            char *p_min = p + 10 + rdlen - 4;
+            int minimum = (READ_U16(p_min) << 16 | READ_U16(p_min + 2)) & 0x7FFFFFFF;
+            if (minimum < rr_ttl) rr_ttl = minimum;
+        }
+        if (ttl == -1 || rr_ttl < ttl) ttl = rr_ttl;
+    }
+
+    return ttl == -1 ? DNS_ERR : ttl;
+}
+
+/*
+ Returns the offset after the name at off, a compression pointer ends it
+ */
+static int dnsSkipName(char *buf, int buf_len, int off) {
+    while (off < buf_len) {
+        int label_len = (uint8_t)buf[off];
+
+        if (label_len == 0) return off + 1;
+        if ((label_len & 0xC0) == 0xC0) return off + 2 <= buf_len ? off + 2 : DNS_ERR;
+        if (label_len > 63) return DNS_ERR;
+        off += 1 + label_len;
+    }
+
+    return DNS_ERR;
+}
+
+/*
+ Match the uncompressed question name at off against the dotted name, ignoring the case
+ */
+static int dnsMatchName(char *buf, int buf_len, int off, char *name) {
+    int name_len = strlen(name);
+    int n = 0;
+
+    if (name_len > 0 && name[name_len - 1] == '.') name_len--;
+
+    while (off < buf_len && buf[off] != 0) {
+        int label_len = (uint8_t)buf[off];
+
+        if (label_len > 63 || buf_len - off - 1 < label_len) return DNS_ERR;
+        if (n > 0 && (n >= name_len || name[n++] != '.')) return DNS_ERR;
+        if (name_len - n < label_len || strncasecmp(buf + off + 1, name + n, label_len) != 0)
+            return DNS_ERR;
+
+        n += label_len;
+        off += 1 + label_len;
+    }
+    if (off >= buf_len || n != name_len) return DNS_ERR;
+
+    return off + 1;
+}
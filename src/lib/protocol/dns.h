@@ -0,0 +1,69 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROTOCOL_DNS_H
+#define __PROTOCOL_DNS_H
+
+#include "../core/net.h"
+
+enum {
+    DNS_OK = 0,
+    DNS_ERR = -1,
+    DNS_ERR_TRUNCATED = -2, // Retry over TCP
+    DNS_ERR_SERVER = -3, // SERVFAIL or REFUSED, retry another server
+};
+
+enum {
+    DNS_TYPE_A = 1,
+    DNS_TYPE_SOA = 6,
+    DNS_TYPE_AAAA = 28,
+    DNS_TYPE_OPT = 41,
+    DNS_CLASS_IN = 1,
+};
+
+#define DNS_HEADER_LEN 12
+#define DNS_UDP_MAX_LEN 512 /* No EDNS is sent, a longer answer comes truncated */
+
+/**
+ *
+ * DNS message
+ *
+ *    +----+-------+---------+---------+---------+---------+----------+
+ *    | ID | FLAGS | QDCOUNT | ANCOUNT | NSCOUNT | ARCOUNT | Sections |
+ *    +----+-------+---------+---------+---------+---------+----------+
+ *    | 2  |   2   |    2    |    2    |    2    |    2    | Variable |
+ *    +----+-------+---------+---------+---------+---------+----------+
+ *
+ * Question, the name is a list of length prefixed labels ending with 0
+ *
+ *    +----------+-------+--------+
+ *    |  QNAME   | QTYPE | QCLASS |
+ *    +----------+-------+--------+
+ *    | Variable |   2   |   2    |
+ *    +----------+-------+--------+
+ */
+int dnsParseQuery(char *buf, int buf_len, char *name, int name_len, int *qtype);
+int dnsBuildAnswer(char *buf, int qlen, int buf_cap, int qtype, void *addr, int ttl);
+int dnsBuildQuery(char *buf, int buf_cap, int id, char *name, int qtype);
+int dnsParseAnswer(char *buf, int buf_len, int id, char *name, int qtype, int port,
+                   sockAddrEx *addrs, int size, int *ttl);
+int dnsQueryKey(char *buf, int buf_len, char *key, int key_cap);
+int dnsAnswerTtl(char *buf, int buf_len, int age);
+
+#endif /* __PROTOCOL_DNS_H */
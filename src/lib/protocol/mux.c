@@ -0,0 +1,62 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../core/common.h"
+
+#include "mux.h"
+
+#include <arpa/inet.h>
+
+sds muxFrameAppend(sds buf, int type, uint32_t id, char *data, int len) {
+    muxHeader header = {
+        .type = type,
+        .rsv = 0,
+        .len = htons(len),
+        .id = htonl(id),
+    };
+
+    buf = sdscatlen(buf, &header, sizeof(header));
+    if (len > 0) buf = sdscatlen(buf, data, len);
+
+    return buf;
+}
+
+/*
+ Return the frame length, 0 if the frame is not complete yet
+ */
+int muxFrameParse(char *buf, int buf_len, muxFrame *frame) {
+    muxHeader header;
+    int len;
+
+    if (buf_len < MUX_HEADER_LEN) return 0;
+
+    memcpy(&header, buf, sizeof(header));
+    len = ntohs(header.len);
+    if (buf_len < MUX_HEADER_LEN + len) return 0;
+
+    if (header.type < MUX_FRAME_SYN || header.type > MUX_FRAME_WND) return MUX_ERR;
+    if (header.type == MUX_FRAME_WND && len != sizeof(uint32_t)) return MUX_ERR;
+
+    frame->type = header.type;
+    frame->id = ntohl(header.id);
+    frame->data = buf + MUX_HEADER_LEN;
+    frame->len = len;
+
+    return MUX_HEADER_LEN + len;
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROTOCOL_MUX_H
+#define __PROTOCOL_MUX_H
+
+#include "redis/sds.h"
+
+#include <stdint.h>
+
+/* Shadowsocks dest addr of a connection carrying mux frames instead of one stream */
+#define MUX_HOST "mux.xsocks.invalid"
+
+enum {
+    MUX_OK = 0,
+    MUX_ERR = -1,
+
+    MUX_FRAME_SYN = 1,
+    MUX_FRAME_DATA,
+    MUX_FRAME_FIN,
+    MUX_FRAME_RST,
+    MUX_FRAME_WND,
+
+    MUX_HEADER_LEN = 8,
+    MUX_WINDOW = 256*1024, // Initial send window of a stream
+};
+
+typedef struct muxHeader {
+    uint8_t type;
+    uint8_t rsv;
+    uint16_t len;
+    uint32_t id;
+} muxHeader;
+
+typedef struct muxFrame {
+    int type;
+    uint32_t id;
+    char *data;
+    int len;
+} muxFrame;
+
+sds muxFrameAppend(sds buf, int type, uint32_t id, char *data, int len);
+int muxFrameParse(char *buf, int buf_len, muxFrame *frame);
+
+/**
+ *
+ * Mux frame
+ *
+ *    +------+---------+-----+----+----------+
+ *    | TYPE |   RSV   | LEN | ID |   DATA   |
+ *    +------+---------+-----+----+----------+
+ *    |  1   | 1(0x00) |  2  | 4  | Variable |
+ *    +------+---------+-----+----+----------+
+ *
+ * SYN  DATA is the socks5 addr buffer of the stream dest
+ * DATA DATA is the stream payload, at most the window the peer granted
+ * FIN  Stream is closed after the data received is flushed
+ * RST  Stream is closed at once
+ * WND  DATA is a 4 bytes window increment, sent as the data is consumed
+ *
+ * All the integers are in network byte order.
+ */
+
+#endif /* __PROTOCOL_MUX_H */
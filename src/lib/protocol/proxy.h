@@ -21,7 +21,9 @@
 #define __PROTOCOL_PROXY_H
 
 #include "../core/common.h"
+#include "../core/dlist.h"
 
+#include "../core/iobuf.h"
 #include "../core/net.h"
 #include "../core/time.h"
 #include "../core/utils.h"
@@ -37,8 +39,9 @@ enum {
 };
 
 #define ADD_EVENT(c, e) do { assert(c->el); assert(e); eventAdd(c->el, e); } while (0)
-#define ADD_EVENT_READ(c) ADD_EVENT(c, c->re)
-#define ADD_EVENT_WRITE(c) ADD_EVENT(c, c->we)
+// A conn still resolving its host has no fd events yet
+#define ADD_EVENT_READ(c) do { if (c->re) ADD_EVENT(c, c->re); } while (0)
+#define ADD_EVENT_WRITE(c) do { if (c->we) ADD_EVENT(c, c->we); } while (0)
 #define ADD_EVENT_TIME(c) do { if (c->timeout > 0) ADD_EVENT(c, c->te); } while (0)
 #define DEL_EVENT_READ(c) DEL_EVENT(c->re)
 #define DEL_EVENT_WRITE(c) DEL_EVENT(c->we)
@@ -59,8 +62,8 @@ enum {
 #define TCP_READ(c, buf, len) (c)->read(c, buf, len)
 #define TCP_WRITE(c, buf, len) (c)->write(c, buf, len)
 
-#define UDP_READ(c, buf, len, sa) (c)->read(c, buf, len, sa)
-#define UDP_WRITE(c, buf, len, sa) (c)->write(c, buf, len, sa)
+#define UDP_READ(c, b, sa) (c)->read(c, b, sa)
+#define UDP_WRITE(c, b, sa) (c)->write(c, b, sa)
 
 #define CONN_CLOSE(c) do { if (c) (c)->close(c); } while (0)
 #define CONN_GET_ADDRINFO(c) (c)->getAddrinfo(c)
@@ -20,12 +20,9 @@
 #include "raw.h"
 
 tcpRawConn *tcpRawConnNew(tcpConn *conn) {
-    tcpRawConn *c;
+    tcpRawConn *c = (tcpRawConn *)conn;
 
-    c = xs_realloc(conn, sizeof(*c));
-    if (!c) return c;
-
-    conn = &c->conn;
+    assert(sizeof(*c) <= TCP_CONN_SIZE);
 
     tcpInit(conn);
 
@@ -33,12 +30,9 @@ tcpRawConn *tcpRawConnNew(tcpConn *conn) {
 }
 
 udpRawConn *udpRawConnNew(udpConn *conn) {
-    udpRawConn *c;
-
-    c = xs_realloc(conn, sizeof(*c));
-    if (!c) return c;
+    udpRawConn *c = (udpRawConn *)conn;
 
-    conn = &c->conn;
+    assert(sizeof(*c) <= UDP_CONN_SIZE);
 
     udpInit(conn);
 
@@ -0,0 +1,763 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "resolver.h"
+#include "dns.h"
+
+#include <ctype.h>
+#include <stdio.h>
+
+enum {
+    RESOLVER_PENDING_A = 1<<0,
+    RESOLVER_PENDING_AAAA = 1<<1,
+};
+
+#define RESOLVER_FAMILY_INDEX(af) ((af) == AF_INET6 ? 1 : 0)
+#define RESOLVER_QTYPE_INDEX(qtype) ((qtype) == DNS_TYPE_AAAA ? 1 : 0)
+#define RESOLVER_QTYPE_PENDING(qtype) \
+    ((qtype) == DNS_TYPE_AAAA ? RESOLVER_PENDING_AAAA : RESOLVER_PENDING_A)
+#define RESOLVER_READ_LEN 4096
+
+typedef struct resolver {
+    eventLoop *el;
+    int nservers;
+    sockAddrEx servers[RESOLVER_MAX_SERVERS];
+    int timeout;
+    int attempts;
+    uint32_t seed;
+    resolverLookup *lookups; // By id
+    resolverLookup *lookups_by_host;
+    resolverHost *hosts; // By name
+    int cache_size; // Max entries, 0 disables the cache
+    int cache_count;
+    resolverEntry *cache; // By name
+    dlist lru; // Most recently used first
+} resolver;
+
+static resolver *res = NULL;
+
+static int resolverAddServer(char *ip);
+static void resolverLoadConf(char *path);
+static void resolverLoadHosts(char *path);
+static int resolverLookupHosts(char *host, int port, sockAddrEx *addrs, int size);
+static int resolverNewId();
+static int resolverIsServer(sockAddrEx *sa);
+static sockAddrEx *resolverServer(resolverLookup *lookup);
+static void resolverSetPort(sockAddrEx *sa, int port);
+static int resolverOrder(char *host, int af, sockAddrEx *addrs4, int naddrs4, sockAddrEx *addrs6,
+                         int naddrs6, sockAddrEx *addrs, int size);
+
+static resolverEntry *resolverCacheGet(char *name, uint64_t now);
+static resolverEntry *resolverCacheSet(resolverLookup *lookup, uint64_t now);
+static void resolverCacheRemove(resolverEntry *entry);
+static int resolverCacheAddrs(resolverEntry *entry, char *name, sockAddrEx *addrs, int size);
+
+static resolverLookup *resolverLookupNew(char *name);
+static void resolverLookupFinish(resolverLookup *lookup, char *err);
+static void resolverLookupDetach(resolverLookup *lookup);
+static int resolverSocket(resolverLookup *lookup, int af);
+static void resolverSend(resolverLookup *lookup, int qtype);
+static void resolverOnAnswer(resolverLookup *lookup, char *buf, int len, int stream);
+static void resolverReadHandler(event *e);
+static void resolverTimeHandler(event *e);
+
+static void resolverStreamNew(resolverLookup *lookup, int qtype);
+static void resolverStreamFree(resolverStream *stream);
+static void resolverStreamWriteHandler(event *e);
+static void resolverStreamReadHandler(event *e);
+
+/*
+ The servers are the comma separated nameservers, or the ones of /etc/resolv.conf.
+ Fails when there is none, the callers then resolve with the blocking libc resolver.
+ */
+int resolverInit(char *err, eventLoop *el, char *nameservers, int cache_size) {
+    if (CALLOC_P(res) == NULL) {
+        xs_error(err, "Resolver is NULL, please check the memory");
+        return NET_ERR;
+    }
+    res->el = el;
+    res->timeout = RESOLVER_TIMEOUT;
+    res->attempts = RESOLVER_ATTEMPTS;
+    res->seed = (uint32_t)(timerStart() ^ getpid());
+    res->cache_size = cache_size > 0 ? cache_size : 0;
+
+    if (nameservers) {
+        char ip[NET_IP_MAX_STR_LEN];
+        char *p = nameservers, *end;
+        int len;
+
+        while (p && *p) {
+            end = strchr(p, ',');
+            len = end ? end - p : (int)strlen(p);
+            if (len >= (int)sizeof(ip)) len = sizeof(ip) - 1;
+
+            memcpy(ip, p, len);
+            ip[len] = '\0';
+            p = end ? end + 1 : NULL;
+            if (len > 0 && resolverAddServer(ip) == NET_ERR) {
+                xs_error(err, "Invalid nameserver: %s", ip);
+                resolverFree();
+                return NET_ERR;
+            }
+        }
+    } else {
+        resolverLoadConf(RESOLVER_CONF);
+    }
+
+    if (res->nservers == 0) {
+        xs_error(err, "No nameserver found");
+        resolverFree();
+        return NET_ERR;
+    }
+
+    resolverLoadHosts(RESOLVER_HOSTS);
+
+    return NET_OK;
+}
+
+void resolverFree() {
+    resolverLookup *lookup, *lookup_tmp;
+    resolverHost *host, *host_tmp;
+
+    if (!res) return;
+
+    HASH_ITER(hh, res->lookups, lookup, lookup_tmp) {
+        resolverLookupDetach(lookup);
+        while (lookup->waiters) resolverCancel(lookup->waiters);
+        xs_free(lookup);
+    }
+    HASH_ITER(hh, res->hosts, host, host_tmp) {
+        HASH_DEL(res->hosts, host);
+        xs_free(host);
+    }
+    while (res->lru.head) resolverCacheRemove(DLIST_ENTRY(res->lru.head, resolverEntry, lru));
+
+    xs_free(res);
+    res = NULL;
+}
+
+/*
+ IP literals, /etc/hosts names, cached answers and, without a resolver, the libc answers
+ are returned at once. An answer served stale is refreshed in the background. Else 0 is
+ returned with the caller waiting for the lookup of the host, and the handler gets the
+ addresses later from the loop, never from within this call.
+ */
+int resolverResolve(char *err, char *host, int port, sockAddrEx *addrs, int size,
+                    resolverHandler handler, void *data, resolverQuery **query) {
+    char name[HOSTNAME_MAX_LEN];
+    size_t len = strlen(host);
+    resolverLookup *lookup;
+    resolverEntry *entry;
+    resolverQuery *q;
+    uint64_t now;
+    int n;
+
+    if (query) *query = NULL;
+    if (size > 0 && netSockAddrExFromIp(host, port, &addrs[0]) == NET_OK) return 1;
+    if (!res) return netTcpResolve(err, host, port, addrs, size);
+    if ((n = resolverLookupHosts(host, port, addrs, size)) > 0) return n;
+
+    if (len >= sizeof(name)) {
+        xs_error(err, "Host name is too long");
+        return NET_ERR;
+    }
+    for (size_t i = 0; i <= len; i++) name[i] = tolower((unsigned char)host[i]);
+
+    now = timerStart();
+    if ((entry = resolverCacheGet(name, now)) != NULL) {
+        if (entry->naddrs == 0) {
+            xs_error(err, "Failed to resolve addr");
+            return NET_ERR;
+        }
+        n = resolverCacheAddrs(entry, name, addrs, size);
+        for (int i = 0; i < n; i++) resolverSetPort(&addrs[i], port);
+
+        HASH_FIND(hn, res->lookups_by_host, name, len, lookup);
+        if (now >= entry->expire && !lookup) resolverLookupNew(name);
+
+        return n;
+    }
+
+    HASH_FIND(hn, res->lookups_by_host, name, len, lookup);
+    if (!lookup && (lookup = resolverLookupNew(name)) == NULL) {
+        xs_error(err, "Resolver lookup is NULL, please check the memory");
+        return NET_ERR;
+    }
+    if (CALLOC_P(q) == NULL) {
+        xs_error(err, "Resolver query is NULL, please check the memory");
+        return NET_ERR;
+    }
+    q->lookup = lookup;
+    q->port = port;
+    q->handler = handler;
+    q->data = data;
+    q->next = lookup->waiters;
+    if (q->next) q->next->prev = q;
+    lookup->waiters = q;
+
+    if (query) *query = q;
+    return 0;
+}
+
+/*
+ Stop waiting, the handler is not called. The lookup goes on for the cache.
+ */
+void resolverCancel(resolverQuery *query) {
+    if (!query || !res) return;
+
+    if (query->prev)
+        query->prev->next = query->next;
+    else
+        query->lookup->waiters = query->next;
+    if (query->next) query->next->prev = query->prev;
+
+    xs_free(query);
+}
+
+static int resolverAddServer(char *ip) {
+    if (res->nservers == RESOLVER_MAX_SERVERS) return NET_OK;
+    if (netSockAddrExFromIp(ip, 53, &res->servers[res->nservers]) == NET_ERR) return NET_ERR;
+
+    res->nservers++;
+    return NET_OK;
+}
+
+static void resolverLoadConf(char *path) {
+    char line[512];
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *key = strtok(line, " \t\r\n");
+        char *value;
+
+        if (!key || *key == '#' || *key == ';') continue;
+
+        if (strcmp(key, "nameserver") == 0) {
+            // Scoped IPv6 servers are skipped, e.g. fe80::1%eth0
+            if ((value = strtok(NULL, " \t\r\n")) != NULL) resolverAddServer(value);
+        } else if (strcmp(key, "options") == 0) {
+            while ((value = strtok(NULL, " \t\r\n")) != NULL) {
+                if (strncmp(value, "timeout:", 8) == 0 && atoi(value + 8) > 0)
+                    res->timeout = atoi(value + 8) * MILLISECOND_UNIT;
+                else if (strncmp(value, "attempts:", 9) == 0 && atoi(value + 9) > 0)
+                    res->attempts = atoi(value + 9);
+            }
+        }
+    }
+
+    fclose(fp);
+}
+
+static void resolverLoadHosts(char *path) {
+    char line[1024];
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) return;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        char *ip, *name;
+        sockAddrEx sa;
+
+        if (comment) *comment = '\0';
+        if ((ip = strtok(line, " \t\r\n")) == NULL || netSockAddrExFromIp(ip, 0, &sa) == NET_ERR)
+            continue;
+
+        while ((name = strtok(NULL, " \t\r\n")) != NULL) {
+            size_t len = strlen(name);
+            resolverHost *entry;
+
+            for (size_t i = 0; i < len; i++) name[i] = tolower((unsigned char)name[i]);
+
+            HASH_FIND(hh, res->hosts, name, len, entry);
+            if (!entry) {
+                if ((entry = xs_calloc(sizeof(*entry) + len + 1)) == NULL) break;
+                memcpy(entry->name, name, len + 1);
+                HASH_ADD_KEYPTR(hh, res->hosts, entry->name, len, entry);
+            }
+            if (entry->naddrs < RESOLVER_HOST_ADDRS) entry->addrs[entry->naddrs++] = sa;
+        }
+    }
+
+    fclose(fp);
+}
+
+static int resolverLookupHosts(char *host, int port, sockAddrEx *addrs, int size) {
+    char name[HOSTNAME_MAX_LEN];
+    size_t len = strlen(host);
+    resolverHost *entry;
+    int n;
+
+    if (!res->hosts || len >= sizeof(name)) return 0;
+
+    for (size_t i = 0; i <= len; i++) name[i] = tolower((unsigned char)host[i]);
+    HASH_FIND(hh, res->hosts, name, len, entry);
+    if (!entry) return 0;
+
+    for (n = 0; n < entry->naddrs && n < size; n++) {
+        addrs[n] = entry->addrs[n];
+        resolverSetPort(&addrs[n], port);
+    }
+
+    return n;
+}
+
+/*
+ Random ids, so an off-path answer has to guess it besides the random port of the socket
+ of the lookup
+ */
+static int resolverNewId() {
+    resolverLookup *lookup;
+    int id;
+
+    do {
+        res->seed ^= res->seed << 13;
+        res->seed ^= res->seed >> 17;
+        res->seed ^= res->seed << 5;
+        id = res->seed & 0xFFFF;
+        HASH_FIND_INT(res->lookups, &id, lookup);
+    } while (lookup);
+
+    return id;
+}
+
+static int resolverIsServer(sockAddrEx *sa) {
+    for (int i = 0; i < res->nservers; i++) {
+        sockAddrEx *s = &res->servers[i];
+
+        if (s->sa.ss_family != sa->sa.ss_family) continue;
+        if (sa->sa.ss_family == AF_INET) {
+            sockAddrIpV4 *a = (sockAddrIpV4 *)&sa->sa, *b = (sockAddrIpV4 *)&s->sa;
+            if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr) return 1;
+        } else {
+            sockAddrIpV6 *a = (sockAddrIpV6 *)&sa->sa, *b = (sockAddrIpV6 *)&s->sa;
+            if (a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, 16) == 0)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static sockAddrEx *resolverServer(resolverLookup *lookup) {
+    return &res->servers[lookup->attempt % res->nservers];
+}
+
+static void resolverSetPort(sockAddrEx *sa, int port) {
+    if (sa->sa.ss_family == AF_INET)
+        ((sockAddrIpV4 *)&sa->sa)->sin_port = htons(port);
+    else
+        ((sockAddrIpV6 *)&sa->sa)->sin6_port = htons(port);
+}
+
+/*
+ Order the addresses as netTcpResolve does, the family that won the last race to the
+ host first, else af, then the families interleaved.
+ */
+static int resolverOrder(char *host, int af, sockAddrEx *addrs4, int naddrs4, sockAddrEx *addrs6,
+                         int naddrs6, sockAddrEx *addrs, int size) {
+    sockAddrEx *pref = addrs4, *other = addrs6;
+    int n_pref = naddrs4, n_other = naddrs6;
+    int n = 0;
+
+    if (netAfCacheGet(host) != AF_UNSPEC) af = netAfCacheGet(host);
+    if (af == AF_INET6) {
+        pref = addrs6;
+        n_pref = naddrs6;
+        other = addrs4;
+        n_other = naddrs4;
+    }
+    for (int i = 0; n < size && (i < n_pref || i < n_other); i++) {
+        if (i < n_pref) addrs[n++] = pref[i];
+        if (i < n_other && n < size) addrs[n++] = other[i];
+    }
+
+    return n;
+}
+
+/*
+ The entry of name, unless it is gone past its stale time
+ */
+static resolverEntry *resolverCacheGet(char *name, uint64_t now) {
+    resolverEntry *entry;
+
+    HASH_FIND(hh, res->cache, name, strlen(name), entry);
+    if (!entry) return NULL;
+    if (now >= entry->stale) {
+        resolverCacheRemove(entry);
+        return NULL;
+    }
+
+    dlistUnlink(&res->lru, &entry->lru);
+    dlistPushHead(&res->lru, &entry->lru);
+
+    return entry;
+}
+
+/*
+ Cache the answer of a lookup, the TTL clamped. Without addresses it is a negative
+ entry, which is never served stale.
+ */
+static resolverEntry *resolverCacheSet(resolverLookup *lookup, uint64_t now) {
+    size_t len = strlen(lookup->host);
+    resolverEntry *entry;
+    int ttl, n = 0;
+
+    if (res->cache_size == 0) return NULL;
+
+    HASH_FIND(hh, res->cache, lookup->host, len, entry);
+    if (entry) {
+        dlistUnlink(&res->lru, &entry->lru);
+    } else {
+        if (res->cache_count >= res->cache_size)
+            resolverCacheRemove(DLIST_ENTRY(res->lru.tail, resolverEntry, lru));
+        if ((entry = xs_calloc(sizeof(*entry) + len + 1)) == NULL) return NULL;
+        memcpy(entry->name, lookup->host, len + 1);
+        HASH_ADD_KEYPTR(hh, res->cache, entry->name, len, entry);
+        res->cache_count++;
+    }
+    dlistPushHead(&res->lru, &entry->lru);
+
+    for (int i = 0; i < lookup->naddrs4 && n < NET_CONNECT_MAX_ADDRS; i++, n++) {
+        entry->addrs[n].af = AF_INET;
+        memcpy(entry->addrs[n].ip, &((sockAddrIpV4 *)&lookup->addrs4[i].sa)->sin_addr, 4);
+    }
+    for (int i = 0; i < lookup->naddrs6 && n < NET_CONNECT_MAX_ADDRS; i++, n++) {
+        entry->addrs[n].af = AF_INET6;
+        memcpy(entry->addrs[n].ip, &((sockAddrIpV6 *)&lookup->addrs6[i].sa)->sin6_addr, 16);
+    }
+    entry->naddrs = n;
+    entry->first_af = lookup->first_af;
+
+    ttl = n > 0 ? MAX(RESOLVER_TTL_MIN, MIN(lookup->ttl, RESOLVER_TTL_MAX)) : RESOLVER_TTL_NEGATIVE;
+    entry->expire = now + (uint64_t)ttl * MICROSECOND_UNIT;
+    entry->stale = entry->expire + (n > 0 ? (uint64_t)RESOLVER_TTL_STALE * MICROSECOND_UNIT : 0);
+
+    return entry;
+}
+
+static void resolverCacheRemove(resolverEntry *entry) {
+    if (!entry) return;
+
+    HASH_DEL(res->cache, entry);
+    dlistUnlink(&res->lru, &entry->lru);
+    res->cache_count--;
+    xs_free(entry);
+}
+
+static int resolverCacheAddrs(resolverEntry *entry, char *name, sockAddrEx *addrs, int size) {
+    sockAddrEx addrs4[NET_CONNECT_MAX_ADDRS], addrs6[NET_CONNECT_MAX_ADDRS];
+    int n4 = 0, n6 = 0;
+
+    for (int i = 0; i < entry->naddrs; i++) {
+        resolverAddr *a = &entry->addrs[i];
+
+        if (a->af == AF_INET) {
+            sockAddrIpV4 *sa = (sockAddrIpV4 *)&addrs4[n4].sa;
+            bzero(&addrs4[n4], sizeof(addrs4[n4]));
+            sa->sin_family = AF_INET;
+            memcpy(&sa->sin_addr, a->ip, 4);
+            addrs4[n4++].sa_len = sizeof(*sa);
+        } else {
+            sockAddrIpV6 *sa = (sockAddrIpV6 *)&addrs6[n6].sa;
+            bzero(&addrs6[n6], sizeof(addrs6[n6]));
+            sa->sin6_family = AF_INET6;
+            memcpy(&sa->sin6_addr, a->ip, 16);
+            addrs6[n6++].sa_len = sizeof(*sa);
+        }
+    }
+
+    return resolverOrder(name, entry->first_af, addrs4, n4, addrs6, n6, addrs, size);
+}
+
+static resolverLookup *resolverLookupNew(char *name) {
+    resolverLookup *lookup;
+
+    if (CALLOC_P(lookup) == NULL) return NULL;
+
+    lookup->id = resolverNewId();
+    lookup->pending = RESOLVER_PENDING_A | RESOLVER_PENDING_AAAA;
+    lookup->first_af = AF_UNSPEC;
+    lookup->ttl = -1;
+    lookup->fds[0] = lookup->fds[1] = -1;
+    strcpy(lookup->host, name);
+
+    lookup->te = NEW_EVENT_REPEAT(res->timeout, resolverTimeHandler, lookup);
+    eventAdd(res->el, lookup->te);
+    HASH_ADD_INT(res->lookups, id, lookup);
+    HASH_ADD(hn, res->lookups_by_host, host, strlen(lookup->host), lookup);
+
+    resolverSend(lookup, DNS_TYPE_A);
+    resolverSend(lookup, DNS_TYPE_AAAA);
+
+    return lookup;
+}
+
+/*
+ Cache the answer and hand it to the waiters. When the lookup failed, a stale entry
+ still answers them.
+ */
+static void resolverLookupFinish(resolverLookup *lookup, char *err) {
+    sockAddrEx addrs[NET_CONNECT_MAX_ADDRS];
+    uint64_t now = timerStart();
+    resolverEntry *entry;
+    int naddrs, n;
+
+    resolverLookupDetach(lookup);
+
+    // Both families answered, or one with addresses, else the servers failed
+    if (lookup->naddrs4 + lookup->naddrs6 > 0 || lookup->pending == 0)
+        entry = resolverCacheSet(lookup, now);
+    else
+        entry = resolverCacheGet(lookup->host, now);
+
+    if (entry)
+        naddrs = resolverCacheAddrs(entry, lookup->host, addrs, NET_CONNECT_MAX_ADDRS);
+    else
+        naddrs = resolverOrder(lookup->host, lookup->first_af, lookup->addrs4, lookup->naddrs4,
+                               lookup->addrs6, lookup->naddrs6, addrs, NET_CONNECT_MAX_ADDRS);
+
+    // The addresses are taken first, a handler may resolve again and touch the cache
+    while (lookup->waiters) {
+        resolverQuery *q = lookup->waiters;
+        resolverHandler handler = q->handler;
+        void *data = q->data;
+        sockAddrEx dup[NET_CONNECT_MAX_ADDRS];
+
+        for (n = 0; n < naddrs; n++) {
+            dup[n] = addrs[n];
+            resolverSetPort(&dup[n], q->port);
+        }
+        resolverCancel(q);
+
+        handler(data, lookup->host, dup, naddrs > 0 ? naddrs : NET_ERR, naddrs > 0 ? NULL : err);
+    }
+
+    xs_free(lookup);
+}
+
+/*
+ Out of the tables, so a new resolve of the host starts a lookup of its own
+ */
+static void resolverLookupDetach(resolverLookup *lookup) {
+    HASH_DEL(res->lookups, lookup);
+    HASH_DELETE(hn, res->lookups_by_host, lookup);
+    CLR_EVENT(lookup->te);
+    for (int i = 0; i < 2; i++) {
+        CLR_EVENT(lookup->res[i]);
+        if (lookup->fds[i] != -1) close(lookup->fds[i]);
+        lookup->fds[i] = -1;
+    }
+    resolverStreamFree(lookup->streams[0]);
+    resolverStreamFree(lookup->streams[1]);
+}
+
+/*
+ A socket of the lookup's own per family, which the kernel binds to a random ephemeral
+ port on the first send. Nothing but the servers asked by this lookup ever learns it.
+ */
+static int resolverSocket(resolverLookup *lookup, int af) {
+    int idx = RESOLVER_FAMILY_INDEX(af);
+    int fd;
+
+    if (lookup->fds[idx] != -1) return lookup->fds[idx];
+    if ((fd = socket(af, SOCK_DGRAM, 0)) == -1) return -1;
+    anetNonBlock(NULL, fd);
+
+    lookup->fds[idx] = fd;
+    lookup->res[idx] = NEW_EVENT_READ(fd, resolverReadHandler, lookup);
+    eventAdd(res->el, lookup->res[idx]);
+
+    return fd;
+}
+
+static void resolverSend(resolverLookup *lookup, int qtype) {
+    sockAddrEx *server = resolverServer(lookup);
+    char buf[DNS_UDP_MAX_LEN];
+    int len, fd;
+
+    if (lookup->streams[RESOLVER_QTYPE_INDEX(qtype)]) return;
+    if ((len = dnsBuildQuery(buf, sizeof(buf), lookup->id, lookup->host, qtype)) == DNS_ERR) return;
+
+    // A failed send is retried on the timeout like a lost one
+    if ((fd = resolverSocket(lookup, server->sa.ss_family)) == -1) {
+        LOGD("Resolver socket of %s error: %s", lookup->host, STRERR);
+        return;
+    }
+    if (netUdpWrite(NULL, fd, buf, len, server) == NET_ERR)
+        LOGD("Resolver send %s to %s error: %s", lookup->host, netFormatSockAddr(server), STRERR);
+}
+
+/*
+ The answer carries its question, which tells the family it answers
+ */
+static void resolverOnAnswer(resolverLookup *lookup, char *buf, int len, int stream) {
+    static const int qtypes[] = {DNS_TYPE_A, DNS_TYPE_AAAA};
+
+    for (int i = 0; i < 2; i++) {
+        int qtype = qtypes[i];
+        int pending = RESOLVER_QTYPE_PENDING(qtype);
+        sockAddrEx *addrs = qtype == DNS_TYPE_A ? lookup->addrs4 : lookup->addrs6;
+        int n, ttl;
+
+        if (!(lookup->pending & pending)) continue;
+
+        n = dnsParseAnswer(buf, len, lookup->id, lookup->host, qtype, 0, addrs,
+                           NET_CONNECT_MAX_ADDRS, &ttl);
+        if (n == DNS_ERR) continue;
+        if (n == DNS_ERR_TRUNCATED && !stream) {
+            resolverStreamNew(lookup, qtype);
+            return;
+        }
+        // Another server is tried on the timeout
+        if (n == DNS_ERR_SERVER) return;
+        if (n < 0) n = 0;
+
+        lookup->pending &= ~pending;
+        if (qtype == DNS_TYPE_A)
+            lookup->naddrs4 = n;
+        else
+            lookup->naddrs6 = n;
+        if (n > 0 && ttl != -1 && (lookup->ttl == -1 || ttl < lookup->ttl)) lookup->ttl = ttl;
+        if (n > 0 && lookup->first_af == AF_UNSPEC)
+            lookup->first_af = qtype == DNS_TYPE_A ? AF_INET : AF_INET6;
+
+        if (lookup->pending == 0) resolverLookupFinish(lookup, "Failed to resolve addr");
+        return;
+    }
+}
+
+/*
+ One datagram per event, an answer may finish the lookup and close the socket. The rest
+ fire the event again.
+ */
+static void resolverReadHandler(event *e) {
+    resolverLookup *lookup = e->data;
+    char buf[RESOLVER_READ_LEN];
+    sockAddrEx sa;
+    int len;
+
+    sa.sa_len = sizeof(sa.sa);
+    if ((len = netUdpRead(NULL, e->id, buf, sizeof(buf), &sa)) == NET_ERR) return;
+    if (len < DNS_HEADER_LEN || !resolverIsServer(&sa)) return;
+
+    resolverOnAnswer(lookup, buf, len, 0);
+}
+
+/*
+ Deliver what one family gave rather than wait out the other, else try the next server
+ */
+static void resolverTimeHandler(event *e) {
+    resolverLookup *lookup = e->data;
+
+    if (lookup->naddrs4 + lookup->naddrs6 > 0) {
+        resolverLookupFinish(lookup, NULL);
+        return;
+    }
+    if (++lookup->attempt >= res->attempts * res->nservers) {
+        resolverLookupFinish(lookup, "Resolve timeout");
+        return;
+    }
+
+    if (lookup->pending & RESOLVER_PENDING_A) resolverSend(lookup, DNS_TYPE_A);
+    if (lookup->pending & RESOLVER_PENDING_AAAA) resolverSend(lookup, DNS_TYPE_AAAA);
+}
+
+static void resolverStreamNew(resolverLookup *lookup, int qtype) {
+    int idx = RESOLVER_QTYPE_INDEX(qtype);
+    resolverStream *stream;
+    int len;
+
+    if (lookup->streams[idx] || CALLOC_P(stream) == NULL) return;
+
+    stream->lookup = lookup;
+    stream->qtype = qtype;
+    len = dnsBuildQuery(stream->buf + 2, sizeof(stream->buf) - 2, lookup->id, lookup->host, qtype);
+    if (len == DNS_ERR) {
+        xs_free(stream);
+        resolverLookupFinish(lookup, "Failed to build the DNS query");
+        return;
+    }
+    stream->buf[0] = (char)(len >> 8);
+    stream->buf[1] = (char)len;
+    stream->len = len + 2;
+
+    if ((stream->fd = netTcpNonBlockConnectAddr(NULL, resolverServer(lookup))) == NET_ERR) {
+        xs_free(stream);
+        return;
+    }
+    stream->re = NEW_EVENT_READ(stream->fd, resolverStreamReadHandler, stream);
+    stream->we = NEW_EVENT_WRITE(stream->fd, resolverStreamWriteHandler, stream);
+    eventAdd(res->el, stream->we);
+
+    lookup->streams[idx] = stream;
+}
+
+static void resolverStreamFree(resolverStream *stream) {
+    if (!stream) return;
+
+    if (stream->lookup) stream->lookup->streams[RESOLVER_QTYPE_INDEX(stream->qtype)] = NULL;
+    CLR_EVENT(stream->re);
+    CLR_EVENT(stream->we);
+    close(stream->fd);
+    xs_free(stream);
+}
+
+/*
+ The query is small enough to go out in one write once connected
+ */
+static void resolverStreamWriteHandler(event *e) {
+    resolverStream *stream = e->data;
+
+    if (netTcpWrite(NULL, stream->fd, stream->buf, stream->len) != stream->len) {
+        resolverStreamFree(stream);
+        return;
+    }
+
+    stream->len = 0;
+    DEL_EVENT(stream->we);
+    eventAdd(res->el, stream->re);
+}
+
+static void resolverStreamReadHandler(event *e) {
+    resolverStream *stream = e->data;
+    resolverLookup *lookup = stream->lookup;
+    int closed, nread, msg_len;
+
+    nread = netTcpRead(NULL, stream->fd, stream->buf + stream->len,
+                       sizeof(stream->buf) - stream->len, &closed);
+    if (nread == NET_ERR || closed) {
+        resolverStreamFree(stream);
+        return;
+    }
+    stream->len += nread;
+
+    if (stream->len < 2) return;
+    msg_len = ((uint8_t)stream->buf[0] << 8) | (uint8_t)stream->buf[1];
+    if (stream->len < 2 + msg_len) return;
+
+    // Detached first, the answer may finish and free the lookup
+    lookup->streams[RESOLVER_QTYPE_INDEX(stream->qtype)] = NULL;
+    stream->lookup = NULL;
+    resolverOnAnswer(lookup, stream->buf + 2, msg_len, 1);
+
+    resolverStreamFree(stream);
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROTOCOL_RESOLVER_H
+#define __PROTOCOL_RESOLVER_H
+
+#include "proxy.h"
+
+#include "shadowsocks-libev/uthash.h"
+
+#define RESOLVER_CONF "/etc/resolv.conf"
+#define RESOLVER_HOSTS "/etc/hosts"
+#define RESOLVER_MAX_SERVERS 3 /* As many as the libc resolver uses */
+#define RESOLVER_TIMEOUT 2000 /* ms per attempt, resolv.conf "options timeout:n" overrides */
+#define RESOLVER_ATTEMPTS 2 /* Rounds over the servers, resolv.conf "options attempts:n" overrides */
+#define RESOLVER_HOST_ADDRS 4 /* Addresses kept per /etc/hosts name */
+#define RESOLVER_TTL_MIN 30 /* s, answer TTLs are clamped into [min, max] */
+#define RESOLVER_TTL_MAX 3600
+#define RESOLVER_TTL_NEGATIVE 30 /* s, names without addresses */
+#define RESOLVER_TTL_STALE 86400 /* s, an expired answer is still served while refreshed */
+
+/* naddrs is NET_ERR on failure, err tells why */
+typedef void (*resolverHandler)(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err);
+
+/* Answer refetched over TCP after a truncated one over UDP */
+typedef struct resolverStream {
+    int fd;
+    event *re;
+    event *we;
+    struct resolverLookup *lookup;
+    int qtype;
+    int len; // Bytes in buf, the 2 bytes length prefix included
+    char buf[2 + 65535];
+} resolverStream;
+
+/* A caller waiting for a lookup, the handle it may cancel */
+typedef struct resolverQuery {
+    struct resolverLookup *lookup;
+    int port;
+    resolverHandler handler;
+    void *data;
+    struct resolverQuery *prev;
+    struct resolverQuery *next;
+} resolverQuery;
+
+/*
+ An A and an AAAA question for one host, both under the same id. The attempts go round
+ the servers on every timeout, and the answer is delivered once both are done or one
+ timeout after the first one with addresses. All the callers asking for the host in
+ the meantime wait for the same lookup, which goes on without them to fill the cache.
+ */
+typedef struct resolverLookup {
+    int id; // Key of hh
+    int pending; // Families still unanswered, RESOLVER_PENDING_*
+    int attempt;
+    int first_af; // Family answered first with addresses
+    int ttl; // Min TTL of the answers, -1 if none
+    int naddrs4;
+    int naddrs6;
+    sockAddrEx addrs4[NET_CONNECT_MAX_ADDRS]; // Port 0
+    sockAddrEx addrs6[NET_CONNECT_MAX_ADDRS];
+    event *te;
+    int fds[2]; // Sockets to the IPv4 and the IPv6 servers, -1 if none yet
+    event *res[2];
+    resolverStream *streams[2]; // A, AAAA
+    resolverQuery *waiters;
+    UT_hash_handle hh;
+    UT_hash_handle hn; // By host
+    char host[HOSTNAME_MAX_LEN]; // Key of hn, lowercased
+} resolverLookup;
+
+typedef struct resolverAddr {
+    uint8_t af;
+    uint8_t ip[16]; // IPv4 in the first 4 bytes
+} resolverAddr;
+
+/*
+ Cached answer, negative when naddrs is 0. Fresh until expire, then served stale until
+ stale while a lookup refreshes it. The entries are on a LRU list, the least recently
+ used one gives way once the cache is full.
+ */
+typedef struct resolverEntry {
+    uint64_t expire; // us
+    uint64_t stale;
+    int first_af;
+    int naddrs;
+    resolverAddr addrs[NET_CONNECT_MAX_ADDRS];
+    dlistNode lru;
+    UT_hash_handle hh;
+    char name[]; // Key, lowercased
+} resolverEntry;
+
+typedef struct resolverHost {
+    int naddrs;
+    sockAddrEx addrs[RESOLVER_HOST_ADDRS]; // Port 0
+    UT_hash_handle hh;
+    char name[]; // Key, lowercased
+} resolverHost;
+
+int resolverInit(char *err, eventLoop *el, char *nameservers, int cache_size);
+void resolverFree();
+
+int resolverResolve(char *err, char *host, int port, sockAddrEx *addrs, int size,
+                    resolverHandler handler, void *data, resolverQuery **query);
+void resolverCancel(resolverQuery *query);
+
+#endif /* __PROTOCOL_RESOLVER_H */
@@ -22,10 +22,15 @@
 
 #include "shadowsocks-libev/crypto.h"
 
+#define SHADOWSOCKS_TAILROOM (MAX_KEY_LENGTH + 2 * 16 + 2) /* Salt, tags and length of a chunk */
+#define SHADOWSOCKS_CHUNK_MAX 0x3FFF /* Max payload of an AEAD chunk */
+#define SHADOWSOCKS_DRAIN_MAX 0x4000 /* Bytes read from a rejected peer before it is closed */
+
 enum {
     ERROR_SHADOWSOCKS_ENCRYPT = 10000,
     ERROR_SHADOWSOCKS_DECRYPT,
     ERROR_SHADOWSOCKS_SOCKS5,
+    ERROR_SHADOWSOCKS_AUTH,
 };
 
 #endif /* __PROTOCOL_SHADOWSOCKS_H */
@@ -0,0 +1,178 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "../core/common.h"
+
+#include "sniff.h"
+
+#include <ctype.h>
+
+#define TLS_RECORD_HANDSHAKE 0x16
+#define TLS_HANDSHAKE_CLIENT_HELLO 0x01
+#define TLS_EXT_SERVER_NAME 0x0000
+#define TLS_SERVER_NAME_HOST 0x00
+
+#define READ_U16(p) (((uint8_t)(p)[0] << 8) | (uint8_t)(p)[1])
+#define READ_U24(p) (((uint8_t)(p)[0] << 16) | ((uint8_t)(p)[1] << 8) | (uint8_t)(p)[2])
+
+static int sniffTls(char *buf, int buf_len, char *host, int host_len);
+static int sniffHttp(char *buf, int buf_len, char *host, int host_len);
+static int sniffSetHost(char *name, int name_len, char *host, int host_len);
+
+/*
+ Find the dest domain in the first bytes of a conn, the SNI of a TLS ClientHello
+ or the Host header of an HTTP request
+ */
+int sniffHost(char *buf, int buf_len, char *host, int host_len) {
+    if (buf_len <= 0) return SNIFF_AGAIN;
+
+    if ((uint8_t)buf[0] == TLS_RECORD_HANDSHAKE) return sniffTls(buf, buf_len, host, host_len);
+    if (isupper((uint8_t)buf[0])) return sniffHttp(buf, buf_len, host, host_len);
+
+    return SNIFF_ERR;
+}
+
+/*
+ * TLS record
+ *
+ *    +------+---------+--------+----------------------------+
+ *    | TYPE | VERSION | LENGTH | Handshake                  |
+ *    +------+---------+--------+----------------------------+
+ *    |  1   |    2    |   2    | Variable                   |
+ *    +------+---------+--------+----------------------------+
+ *
+ * ClientHello, after the handshake type(1) and length(3)
+ *
+ *    +---------+--------+------------+---------------+-------------+------------+
+ *    | VERSION | RANDOM | SESSION ID | CIPHER SUITES | COMPRESSION | EXTENSIONS |
+ *    +---------+--------+------------+---------------+-------------+------------+
+ *    |    2    |   32   |  1 + Var   |    2 + Var    |   1 + Var   |  2 + Var   |
+ *    +---------+--------+------------+---------------+-------------+------------+
+ */
+static int sniffTls(char *buf, int buf_len, char *host, int host_len) {
+    char *p, *end;
+    int len;
+
+    if (buf_len < 5) return SNIFF_AGAIN;
+    if (buf[1] != 0x03) return SNIFF_ERR;
+
+    len = READ_U16(buf + 3);
+    if (5 + len > SNIFF_BUF_LEN) return SNIFF_ERR;
+    if (buf_len < 5 + len) return SNIFF_AGAIN;
+
+    p = buf + 5;
+    end = p + len;
+
+    if (end - p < 4 || (uint8_t)p[0] != TLS_HANDSHAKE_CLIENT_HELLO) return SNIFF_ERR;
+    if (READ_U24(p + 1) > end - p - 4) return SNIFF_ERR; // Split over records, not seen in practice
+    end = p + 4 + READ_U24(p + 1);
+    p += 4 + 2 + 32;
+
+    if (end - p < 1 || end - p < 1 + (uint8_t)p[0]) return SNIFF_ERR;
+    p += 1 + (uint8_t)p[0];
+    if (end - p < 2 || end - p < 2 + READ_U16(p)) return SNIFF_ERR;
+    p += 2 + READ_U16(p);
+    if (end - p < 1 || end - p < 1 + (uint8_t)p[0]) return SNIFF_ERR;
+    p += 1 + (uint8_t)p[0];
+    if (end - p < 2) return SNIFF_ERR; // No extensions
+    if (end - p < 2 + READ_U16(p)) return SNIFF_ERR;
+    end = p + 2 + READ_U16(p);
+    p += 2;
+
+    while (end - p >= 4) {
+        int type = READ_U16(p);
+        int ext_len = READ_U16(p + 2);
+
+        p += 4;
+        if (end - p < ext_len) return SNIFF_ERR;
+
+        if (type == TLS_EXT_SERVER_NAME) {
+            char *q = p, *q_end = p + ext_len;
+
+            if (q_end - q < 2) return SNIFF_ERR;
+            q += 2;
+            while (q_end - q >= 3) {
+                int name_len = READ_U16(q + 1);
+
+                if (q_end - q - 3 < name_len) return SNIFF_ERR;
+                if (q[0] == TLS_SERVER_NAME_HOST) return sniffSetHost(q + 3, name_len, host, host_len);
+                q += 3 + name_len;
+            }
+            return SNIFF_ERR;
+        }
+        p += ext_len;
+    }
+
+    return SNIFF_ERR;
+}
+
+static int sniffHttp(char *buf, int buf_len, char *host, int host_len) {
+    char *p = buf, *end = buf + buf_len;
+    int i;
+
+    // Request line starts with the method token and a space
+    for (i = 0; i < buf_len && i < 8 && isupper((uint8_t)buf[i]); i++) continue;
+    if (i == buf_len) return SNIFF_AGAIN;
+    if (i < 3 || buf[i] != ' ') return SNIFF_ERR;
+
+    while (p < end) {
+        char *eol = memchr(p, '\n', end - p);
+        if (!eol) break;
+
+        char *line = p;
+        int line_len = eol - p;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        p = eol + 1;
+
+        if (line == buf) continue;
+        if (line_len == 0) return SNIFF_ERR; // End of the headers
+
+        if (line_len > 5 && strncasecmp(line, "host:", 5) == 0) {
+            char *v = line + 5, *v_end = line + line_len;
+
+            while (v < v_end && (*v == ' ' || *v == '\t')) v++;
+            while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+
+            if (v < v_end && *v == '[') {
+                // IPv6 literal, the dest IP is as good as it
+                return SNIFF_ERR;
+            }
+            char *colon = memchr(v, ':', v_end - v);
+            if (colon) v_end = colon;
+
+            return sniffSetHost(v, v_end - v, host, host_len);
+        }
+    }
+
+    return buf_len < SNIFF_BUF_LEN ? SNIFF_AGAIN : SNIFF_ERR;
+}
+
+static int sniffSetHost(char *name, int name_len, char *host, int host_len) {
+    if (name_len <= 0 || name_len >= host_len) return SNIFF_ERR;
+
+    for (int i = 0; i < name_len; i++) {
+        char c = name[i];
+
+        if (!isalnum((uint8_t)c) && c != '-' && c != '.' && c != '_') return SNIFF_ERR;
+        host[i] = tolower((uint8_t)c);
+    }
+    host[name_len] = '\0';
+
+    return SNIFF_OK;
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of xsocks, a lightweight proxy tool for science online.
+ *
+ * Copyright (C) 2019 XJP09_HK <jianping_xie@aliyun.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROTOCOL_SNIFF_H
+#define __PROTOCOL_SNIFF_H
+
+enum {
+    SNIFF_OK = 0,
+    SNIFF_ERR = -1,   // Neither a TLS ClientHello nor an HTTP request, or no host in it
+    SNIFF_AGAIN = -2, // The head is not all there yet
+};
+
+#define SNIFF_BUF_LEN (16384 + 5) /* A full TLS record */
+
+int sniffHost(char *buf, int buf_len, char *host, int host_len);
+
+#endif /* __PROTOCOL_SNIFF_H */
@@ -18,26 +18,70 @@
  */
 
 #include "tcp.h"
+#include "resolver.h"
 #include "../core/utils.h"
 
+#define TCP_CONNECT_ATTEMPT_DELAY 250 /* ms, Connection Attempt Delay of RFC 8305 */
+
+typedef struct tcpRaceAttempt {
+    int fd;
+    event *we;
+    sockAddrEx sa;
+    struct tcpRace *race;
+} tcpRaceAttempt;
+
+/*
+ Happy Eyeballs state of a connecting conn. The first attempt is the conn itself,
+ the other addresses are tried one by one every attempt delay, or at once when
+ an attempt fails. The first attempt that completes wins and the rest are closed.
+ */
+typedef struct tcpRace {
+    tcpConn *conn;
+    char *host;
+    event *te;
+    int primary; /* The attempt on conn->fd is still pending */
+    int next;
+    int naddrs;
+    sockAddrEx addrs[NET_CONNECT_MAX_ADDRS];
+    tcpRaceAttempt attempts[NET_CONNECT_MAX_ADDRS];
+} tcpRace;
+
 static tcpListener *tcpListenNew(int fd, eventLoop *el, void *data);
 static void tcpListenFree(tcpListener *ln);
 static void tcpListenReadHandler(event *e);
 
 static tcpConn *tcpConnNew(int fd, int timeout, eventLoop *el, void *data);
 static void tcpConnInit(tcpConn *c);
+static int tcpConnStart(char *err, tcpConn *c, char *host, sockAddrEx *addrs, int naddrs);
+static void tcpConnResolved(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err);
 static int tcpCheckConnectDone(tcpConn *c, int *done);
 
+static tcpRace *tcpRaceNew(tcpConn *c, char *host, sockAddrEx *addrs, int naddrs);
+static void tcpRaceFree(tcpConn *c);
+static int tcpRaceNext(tcpRace *race);
+static int tcpRaceIsPending(tcpRace *race);
+static int tcpRaceFailover(tcpConn *c);
+static void tcpRaceWin(tcpRace *race, tcpRaceAttempt *attempt);
+static void tcpRaceWriteHandler(event *e);
+static void tcpRaceTimeHandler(event *e);
+
 static int tcpPipeWrite(tcpConn *c);
 
+static void tcpIdleLink(tcpConn *c);
+static void tcpIdleUnlink(tcpConn *c);
+static void tcpIdleTouch(tcpConn *c);
+
 static int handleTcpConnection(tcpConn *c);
 static void tcpConnReadHandler(event *e);
 static void tcpConnWriteHandler(event *e);
 static void tcpConnTimeoutHandler(event *e);
 
-tcpListener *tcpListen(char *err, eventLoop *el, char *host, int port, void *data,
+static int conn_count;
+static tcpAddrFilter addr_filter;
+static dlist idle_list; // Least recently active first
+
+tcpListener *tcpListen(char *err, eventLoop *el, char *host, int port, int backlog, void *data,
                        tcpEventHandler onAccept) {
-    int backlog = 256;
     int fd;
 
     if ((host && isIPv6Addr(host)))
@@ -97,10 +141,11 @@ static void tcpListenReadHandler(event *e) {
 }
 
 tcpConn *tcpAccept(char *err, eventLoop *el, int fd, int timeout, void *data) {
+    sockAddrEx sa;
     int cfd;
 
-    cfd = anetTcpAccept(err, fd, NULL, 0, NULL);
-    if (cfd == ANET_ERR) return NULL;
+    cfd = netTcpAccept(err, fd, &sa);
+    if (cfd == NET_ERR) return NULL;
 
     tcpConn *c = tcpConnNew(cfd, timeout, el, data);
     if (!c) {
@@ -108,50 +153,175 @@ tcpConn *tcpAccept(char *err, eventLoop *el, int fd, int timeout, void *data) {
         xs_error(err, "TCP conn is NULL, please check the memory");
         return NULL;
     }
+    memcpy(&c->rsa, &sa, sizeof(sa));
 
     tcpConnInit(c);
 
     return c;
 }
 
+/*
+ The host is resolved on the loop unless it is an IP literal or a hosts entry, the conn
+ is returned at once and the connect starts, or fails through onConnect, once resolved.
+ */
 tcpConn *tcpConnect(char *err, eventLoop *el, char *host, int port, int timeout, void *data) {
-    int fd;
+    sockAddrEx addrs[NET_CONNECT_MAX_ADDRS];
+    int naddrs;
     tcpConn *c;
-    sockAddrEx sa;
 
-    fd = netTcpNonBlockConnect(err, host, port, &sa);
-    if (fd == ANET_ERR) return NULL;
-
-    c = tcpConnNew(fd, timeout, el, data);
+    c = tcpConnNew(-1, timeout, el, data);
     if (!c) {
-        close(fd);
         xs_error(err, "TCP conn is NULL, please check the memory");
         return NULL;
     }
+    c->flags |= TCP_FLAG_CONNECTING;
+
+    naddrs = resolverResolve(err, host, port, addrs, NET_CONNECT_MAX_ADDRS, tcpConnResolved, c,
+                             &c->query);
+    if (naddrs == NET_ERR || (naddrs > 0 && tcpConnStart(err, c, host, addrs, naddrs) == TCP_ERR)) {
+        tcpClose(c);
+        return NULL;
+    }
+
+    return c;
+}
 
+/*
+ Connect to addresses resolved already, they are raced in order. The host is optional,
+ it only keys the address family cache of the race.
+ */
+tcpConn *tcpConnectAddr(char *err, eventLoop *el, char *host, sockAddrEx *addrs, int naddrs,
+                        int timeout, void *data) {
+    tcpConn *c;
+
+    c = tcpConnNew(-1, timeout, el, data);
+    if (!c) {
+        xs_error(err, "TCP conn is NULL, please check the memory");
+        return NULL;
+    }
     c->flags |= TCP_FLAG_CONNECTING;
-    memcpy(&c->rsa, &sa, sizeof(sa));
+
+    if (tcpConnStart(err, c, host, addrs, naddrs) == TCP_ERR) {
+        tcpClose(c);
+        return NULL;
+    }
 
     return c;
 }
 
+/*
+ The filter drops the resolved addresses the conns must not reach, e.g. by the ACL
+ */
+void tcpSetAddrFilter(tcpAddrFilter filter) {
+    addr_filter = filter;
+}
+
 int tcpInit(tcpConn *c) {
+    // The connect timeout covers the lookup, the fd events come once it is done
+    tcpSetTimeout(c, c->timeout);
+    if (c->fd == -1) return TCP_OK;
+
     c->re = NEW_EVENT_READ(c->fd, tcpConnReadHandler, c);
     c->we = NEW_EVENT_WRITE(c->fd, tcpConnWriteHandler, c);
-    tcpSetTimeout(c, c->timeout);
 
     if (c->flags & TCP_FLAG_CONNECTING) ADD_EVENT_WRITE(c);
+    if (c->race) ADD_EVENT(c, c->race->te);
 
     return TCP_OK;
 }
 
 int tcpSetTimeout(tcpConn *c, int timeout) {
-    if (timeout <= 0 || timeout != c->timeout) CLR_EVENT_TIME(c);
+    CLR_EVENT_TIME(c);
+    c->timeout = timeout;
     if (timeout > 0) {
-        c->te = NEW_EVENT_ONCE(c->timeout * MILLISECOND_UNIT, tcpConnTimeoutHandler, c);
+        c->te = NEW_EVENT_ONCE(timeout * MILLISECOND_UNIT, tcpConnTimeoutHandler, c);
         ADD_EVENT_TIME(c);
     }
+
+    return TCP_OK;
+}
+
+int tcpSetIdleTimeout(tcpConn *c, int timeout) {
+    c->idle_timeout = timeout;
+    if (c->flags & TCP_FLAG_STREAM) {
+        tcpSetTimeout(c, timeout);
+        if (timeout > 0)
+            tcpIdleLink(c);
+        else
+            tcpIdleUnlink(c);
+    }
+
+    return TCP_OK;
+}
+
+/*
+ Handshake is done, the conn carries user data from now on and falls back to the idle timeout
+ */
+void tcpSetStream(tcpConn *c) {
+    if (c->flags & TCP_FLAG_STREAM) return;
+
+    c->flags |= TCP_FLAG_STREAM;
+    tcpSetTimeout(c, c->idle_timeout);
+    if (c->idle_timeout > 0) tcpIdleLink(c);
+}
+
+/*
+ The read and the write events of a conn share the priority, EVENT_PRIORITY_*
+ */
+void tcpSetPriority(tcpConn *c, int priority) {
+    eventSetPriority(c->re, priority);
+    eventSetPriority(c->we, priority);
+}
+
+/*
+ Stop reading until tcpResume, a pending pipe write still goes on
+ */
+void tcpPause(tcpConn *c) {
+    c->flags |= TCP_FLAG_PAUSED;
+    DEL_EVENT_READ(c);
+}
+
+void tcpResume(tcpConn *c) {
+    if (!(c->flags & TCP_FLAG_PAUSED)) return;
+
+    c->flags &= ~TCP_FLAG_PAUSED;
+    // Else the pipe adds the read back once its write is done
+    if (c->rbuf_off == 0) ADD_EVENT_READ(c);
+}
+
+/*
+ The options are applied again once connected, as the connect race may replace the fd
+ */
+int tcpSetSockOpts(char *err, tcpConn *c, netSockOpts *opts) {
+    c->sockopts = opts;
+    if (c->fd != -1 && netSetSockOpts(err, c->fd, opts) == NET_ERR) return TCP_ERR;
+
+    return TCP_OK;
+}
+
+/*
+ Hand an established conn over to a new owner. All the events are dropped here,
+ the next tcpInit rebuilds them and the owner gets onConnect from the write event.
+ */
+int tcpDetach(tcpConn *c, int timeout, void *data) {
+    tcpIdleUnlink(c);
+    CLR_EVENT_READ(c);
+    CLR_EVENT_WRITE(c);
+    CLR_EVENT_TIME(c);
+
+    c->onRead = NULL;
+    c->onWrite = NULL;
+    c->onTimeout = NULL;
+    c->onClose = NULL;
+    c->onError = NULL;
+    c->onConnect = NULL;
+
+    c->data = data;
     c->timeout = timeout;
+    c->idle_timeout = timeout;
+    c->flags = TCP_FLAG_INIT | TCP_FLAG_CONNECTING;
+    c->rbuf_off = 0;
+    c->err = 0;
 
     return TCP_OK;
 }
@@ -159,11 +329,15 @@ int tcpSetTimeout(tcpConn *c, int timeout) {
 void tcpClose(tcpConn *c) {
     if (!c) return;
 
+    tcpIdleUnlink(c);
+    conn_count--;
     c->flags |= TCP_FLAG_CLOSED;
     CLR_EVENT_READ(c);
     CLR_EVENT_WRITE(c);
     CLR_EVENT_TIME(c);
-    close(c->fd);
+    tcpRaceFree(c);
+    resolverCancel(c->query);
+    if (c->fd != -1) close(c->fd);
 
     xs_free(c->rbuf);
 
@@ -171,12 +345,13 @@ void tcpClose(tcpConn *c) {
 }
 
 static tcpConn *tcpConnNew(int fd, int timeout, eventLoop *el, void *data) {
-    tcpConn *c = xs_calloc(sizeof(*c));
+    tcpConn *c = xs_calloc(TCP_CONN_SIZE);
     if (!c) return NULL;
 
     c->fd = fd;
     c->flags = TCP_FLAG_INIT;
     c->timeout = timeout;
+    c->idle_timeout = timeout;
 
     c->el = el;
     c->data = data;
@@ -185,6 +360,7 @@ static tcpConn *tcpConnNew(int fd, int timeout, eventLoop *el, void *data) {
     c->write = tcpWrite;
     c->close = tcpClose;
     c->getAddrinfo = tcpGetAddrinfo;
+    c->errstr = errorBuffer();
 
     c->rbuf = xs_calloc(NET_IOBUF_LEN);
     c->rbuf_len = NET_IOBUF_LEN;
@@ -192,8 +368,8 @@ static tcpConn *tcpConnNew(int fd, int timeout, eventLoop *el, void *data) {
     c->wbuf = NULL;
     c->wbuf_len = 0;
 
-    anetNonBlock(NULL, fd);
-    anetFormatSock(fd, c->addrinfo, sizeof(c->addrinfo));
+    if (fd != -1) anetNonBlock(NULL, fd);
+    conn_count++;
 
     return c;
 }
@@ -204,14 +380,71 @@ static tcpConn *tcpConnNew(int fd, int timeout, eventLoop *el, void *data) {
 static void tcpConnInit(tcpConn *c) {
     int fd = c->fd;
 
-    anetFormatPeer(fd, c->addrinfo_peer, sizeof(c->addrinfo_peer));
-
-    anetDisableTcpNoDelay(NULL, fd);
+    if (c->sockopts)
+        netSetSockOpts(NULL, fd, c->sockopts);
+    else
+        anetDisableTcpNoDelay(NULL, fd);
     netNoSigPipe(NULL, fd);
 
+    // Connect timeout is over
+    if (c->flags & TCP_FLAG_CONNECTING) tcpSetTimeout(c, c->idle_timeout);
+
     c->flags |= TCP_FLAG_CONNECTED;
 }
 
+/*
+ Open the first address that does not fail right away, the rest go to the race
+ */
+static int tcpConnStart(char *err, tcpConn *c, char *host, sockAddrEx *addrs, int naddrs) {
+    int fd = NET_ERR;
+    int i, n;
+
+    if (addr_filter) {
+        for (i = 0, n = 0; i < naddrs; i++) {
+            if (addr_filter(&addrs[i])) continue;
+            if (n != i) addrs[n] = addrs[i];
+            n++;
+        }
+        if ((naddrs = n) == 0) {
+            xs_error(err, "All the addrs of %s are blocked", host ? host : "?");
+            return TCP_ERR;
+        }
+    }
+
+    for (i = 0; i < naddrs; i++)
+        if ((fd = netTcpNonBlockConnectAddr(err, &addrs[i])) != NET_ERR) break;
+    if (fd == NET_ERR) return TCP_ERR;
+
+    c->fd = fd;
+    memcpy(&c->rsa, &addrs[i], sizeof(addrs[i]));
+
+    if (i + 1 < naddrs) c->race = tcpRaceNew(c, host, addrs + i + 1, naddrs - i - 1);
+
+    return TCP_OK;
+}
+
+/*
+ The owner has set up the conn by now, so the events tcpInit skipped are made here
+ */
+static void tcpConnResolved(void *data, char *host, sockAddrEx *addrs, int naddrs, char *err) {
+    tcpConn *c = data;
+
+    c->query = NULL;
+    if (naddrs == NET_ERR) xs_error(c->errstr, "%s", err);
+    if (naddrs == NET_ERR || tcpConnStart(c->errstr, c, host, addrs, naddrs) == TCP_ERR) {
+        c->err = TCP_ERROR_CONNECT;
+        FIRE_CONNECT(c, TCP_ERR);
+        FIRE_CLOSE(c);
+        return;
+    }
+
+    if (c->sockopts) netSetSockOpts(NULL, c->fd, c->sockopts);
+    c->re = NEW_EVENT_READ(c->fd, tcpConnReadHandler, c);
+    c->we = NEW_EVENT_WRITE(c->fd, tcpConnWriteHandler, c);
+    ADD_EVENT_WRITE(c);
+    if (c->race) ADD_EVENT(c, c->race->te);
+}
+
 static int tcpCheckConnectDone(tcpConn *c, int *done) {
     int rc = connect(c->fd, (sockAddr *)&c->rsa.sa, c->rsa.sa_len);
     if (rc == 0) {
@@ -257,6 +490,7 @@ int tcpRead(tcpConn *c, char *buf, int buf_len) {
     }
 
     ADD_EVENT_TIME(c);
+    if (nread > 0) tcpIdleTouch(c);
 
     return nread;
 }
@@ -271,6 +505,7 @@ int tcpWrite(tcpConn *c, char *buf, int buf_len) {
         FIRE_CLOSE(c);
         return TCP_ERR;
     }
+    if (nwrite > 0) tcpIdleTouch(c);
 
     return nwrite;
 }
@@ -284,6 +519,9 @@ int tcpPipe(tcpConn *src, tcpConn *dst) {
     dst->pipe = src;
     dst->flags |= TCP_FLAG_PIPE;
 
+    tcpSetStream(src);
+    tcpSetStream(dst);
+
     nread = TCP_READ(src, rbuf, rbuf_len);
     if (nread <= 0) return nread;
 
@@ -308,7 +546,7 @@ int tcpPipe(tcpConn *src, tcpConn *dst) {
         dst->wbuf_len = 0;
 
         DEL_EVENT_WRITE(dst);
-        ADD_EVENT_READ(src);
+        if (!(src->flags & TCP_FLAG_PAUSED)) ADD_EVENT_READ(src);
     }
 
     return nread;
@@ -324,7 +562,7 @@ static int tcpPipeWrite(tcpConn *c) {
         c->pipe->rbuf_off = 0;
         c->wbuf = NULL;
         c->wbuf_len = 0;
-        ADD_EVENT_READ(c->pipe);
+        if (!(c->pipe->flags & TCP_FLAG_PAUSED)) ADD_EVENT_READ(c->pipe);
         DEL_EVENT_WRITE(c);
         return TCP_OK;
     }
@@ -342,7 +580,60 @@ static int tcpPipeWrite(tcpConn *c) {
 }
 
 char *tcpGetAddrinfo(tcpConn *c) {
-    return tcpIsConnected(c) ? c->addrinfo_peer : c->addrinfo;
+    return tcpIsConnected(c) ? netFormatSockAddr(&c->rsa) : netFormatSock(c->fd);
+}
+
+int tcpConnCount() {
+    return conn_count;
+}
+
+/*
+ Close the streams not active for timeout seconds, the least recently active first.
+ They go through the timeout path of their owners, so a pair is closed as one.
+ */
+int tcpReapIdle(int timeout) {
+    uint64_t now = timerStart();
+    int reaped = 0;
+    tcpConn *c;
+
+    while ((c = DLIST_ENTRY(idle_list.head, tcpConn, idle)) != NULL &&
+           now - c->active_time >= (uint64_t)timeout * MICROSECOND_UNIT) {
+
+        tcpIdleUnlink(c);
+        if (!c->onClose) continue;
+
+        LOGI("TCP conn %s idle for %ds is reclaimed", CONN_GET_ADDRINFO(c),
+             (int)((now - c->active_time) / MICROSECOND_UNIT));
+        c->err = TCP_ERROR_TIMEOUT;
+        xs_error(c->errstr, "TCP conn idle reclaimed");
+        reaped++;
+
+        FIRE_TIMEOUT(c);
+        FIRE_CLOSE(c);
+    }
+
+    return reaped;
+}
+
+static void tcpIdleLink(tcpConn *c) {
+    if (dlistIsLinked(&idle_list, &c->idle)) return;
+
+    c->active_time = timerStart();
+    dlistPushTail(&idle_list, &c->idle);
+}
+
+static void tcpIdleUnlink(tcpConn *c) {
+    dlistUnlink(&idle_list, &c->idle);
+}
+
+/*
+ Move an active stream to the tail, so the list stays sorted by the last activity
+ */
+static void tcpIdleTouch(tcpConn *c) {
+    if (!dlistIsLinked(&idle_list, &c->idle)) return;
+
+    tcpIdleUnlink(c);
+    tcpIdleLink(c);
 }
 
 static int handleTcpConnection(tcpConn *c) {
@@ -354,8 +645,14 @@ static int handleTcpConnection(tcpConn *c) {
         if (status == TCP_OK) {
             if (done == 0) return TCP_ERR;
 
+            if (c->race) {
+                netAfCacheSet(c->race->host, c->rsa.sa.ss_family);
+                tcpRaceFree(c);
+            }
             tcpConnInit(c);
             DEL_EVENT_WRITE(c);
+        } else if (c->race && tcpRaceFailover(c) == TCP_OK) {
+            return TCP_ERR;
         }
 
         FIRE_CONNECT(c, status);
@@ -401,3 +698,145 @@ static void tcpConnTimeoutHandler(event *e) {
     FIRE_TIMEOUT(c);
     FIRE_CLOSE(c);
 }
+
+static tcpRace *tcpRaceNew(tcpConn *c, char *host, sockAddrEx *addrs, int naddrs) {
+    tcpRace *race = xs_calloc(sizeof(*race));
+    if (!race) return NULL;
+
+    race->conn = c;
+    race->host = host ? xs_strdup(host) : NULL;
+    race->primary = 1;
+    race->naddrs = naddrs;
+    memcpy(race->addrs, addrs, naddrs * sizeof(*addrs));
+    for (int i = 0; i < naddrs; i++) race->attempts[i].fd = -1;
+
+    race->te = NEW_EVENT_REPEAT(TCP_CONNECT_ATTEMPT_DELAY, tcpRaceTimeHandler, race);
+
+    return race;
+}
+
+static void tcpRaceFree(tcpConn *c) {
+    tcpRace *race = c->race;
+    if (!race) return;
+
+    for (int i = 0; i < race->next; i++) {
+        tcpRaceAttempt *attempt = &race->attempts[i];
+
+        CLR_EVENT(attempt->we);
+        if (attempt->fd != -1) close(attempt->fd);
+    }
+    CLR_EVENT(race->te);
+    xs_free(race->host);
+    xs_free(race);
+
+    c->race = NULL;
+}
+
+/*
+ Start the attempt of the next address, skipping the ones failing right away
+ */
+static int tcpRaceNext(tcpRace *race) {
+    tcpConn *c = race->conn;
+
+    while (race->next < race->naddrs) {
+        tcpRaceAttempt *attempt = &race->attempts[race->next];
+        sockAddrEx *sa = &race->addrs[race->next++];
+
+        attempt->fd = netTcpNonBlockConnectAddr(c->errstr, sa);
+        if (attempt->fd == NET_ERR) {
+            attempt->fd = -1;
+            continue;
+        }
+
+        memcpy(&attempt->sa, sa, sizeof(*sa));
+        attempt->race = race;
+        attempt->we = NEW_EVENT_WRITE(attempt->fd, tcpRaceWriteHandler, attempt);
+        ADD_EVENT(c, attempt->we);
+
+        break;
+    }
+
+    if (race->next == race->naddrs) DEL_EVENT(race->te);
+
+    return tcpRaceIsPending(race) ? TCP_OK : TCP_ERR;
+}
+
+static int tcpRaceIsPending(tcpRace *race) {
+    if (race->primary) return 1;
+
+    for (int i = 0; i < race->next; i++)
+        if (race->attempts[i].fd != -1) return 1;
+
+    return 0;
+}
+
+/*
+ The attempt on conn->fd failed, go on with the other addresses. Return TCP_ERR
+ when there is nothing left to wait for.
+ */
+static int tcpRaceFailover(tcpConn *c) {
+    tcpRace *race = c->race;
+
+    DEL_EVENT_READ(c);
+    DEL_EVENT_WRITE(c);
+    close(c->fd);
+    c->fd = -1;
+    race->primary = 0;
+
+    return tcpRaceNext(race);
+}
+
+/*
+ Move the winner onto the conn, the owner sees it as a plain connect done
+ */
+static void tcpRaceWin(tcpRace *race, tcpRaceAttempt *attempt) {
+    tcpConn *c = race->conn;
+
+    CLR_EVENT_READ(c);
+    CLR_EVENT_WRITE(c);
+    if (c->fd != -1) close(c->fd);
+
+    c->fd = attempt->fd;
+    attempt->fd = -1;
+    memcpy(&c->rsa, &attempt->sa, sizeof(attempt->sa));
+
+    netAfCacheSet(race->host, c->rsa.sa.ss_family);
+    tcpRaceFree(c);
+
+    c->re = NEW_EVENT_READ(c->fd, tcpConnReadHandler, c);
+    c->we = NEW_EVENT_WRITE(c->fd, tcpConnWriteHandler, c);
+    tcpConnInit(c);
+
+    FIRE_CONNECT(c, TCP_OK);
+}
+
+static void tcpRaceWriteHandler(event *e) {
+    tcpRaceAttempt *attempt = e->data;
+    tcpRace *race = attempt->race;
+    tcpConn *c = race->conn;
+    int rc;
+
+    rc = connect(attempt->fd, (sockAddr *)&attempt->sa.sa, attempt->sa.sa_len);
+    if (rc == 0 || errno == EISCONN) {
+        tcpRaceWin(race, attempt);
+        return;
+    }
+    if (errno == EALREADY || errno == EINPROGRESS || errno == EWOULDBLOCK) return;
+
+    xs_error(c->errstr, STRERR);
+    DEL_EVENT(attempt->we);
+    close(attempt->fd);
+    attempt->fd = -1;
+
+    if (tcpRaceNext(race) == TCP_OK) return;
+
+    c->err = TCP_ERROR_CONNECT;
+    FIRE_CONNECT(c, TCP_ERR);
+    FIRE_CLOSE(c);
+}
+
+static void tcpRaceTimeHandler(event *e) {
+    tcpRace *race = e->data;
+
+    tcpRaceNext(race);
+}
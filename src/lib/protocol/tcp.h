@@ -32,6 +32,8 @@ enum {
     TCP_FLAG_LISTEN = 1<<3,
     TCP_FLAG_PIPE = 1<<4,
     TCP_FLAG_CLOSED = 1<<5,
+    TCP_FLAG_STREAM = 1<<6,
+    TCP_FLAG_PAUSED = 1<<7, // Reads held back by tcpPause
 
     TCP_ERROR_READ = 10000,
     TCP_ERROR_WRITE = 10001,
@@ -40,11 +42,16 @@ enum {
     TCP_ERROR_CONNECT = 10004,
 };
 
+#define TCP_CONN_SIZE 768 /* Bytes of every conn, the protocol conns extend tcpConn in place */
+
 struct tcpConn;
+struct tcpRace;
+struct resolverQuery;
 
 typedef void (*tcpEventHandler)(void *data);
 typedef int (*tcpIoHandler)(struct tcpConn *conn, char *buf, int buf_len);
 typedef void (*tcpConnectHandler)(void *data, int status);
+typedef int (*tcpAddrFilter)(sockAddrEx *sa);
 
 typedef struct tcpListener {
     int fd;
@@ -61,6 +68,7 @@ typedef struct tcpConn {
     int fd;
     int flags;
     int timeout;
+    int idle_timeout; // Used once connected or streaming
     eventLoop *el;
     event *re;
     event *we;
@@ -76,25 +84,38 @@ typedef struct tcpConn {
     void (*close)(struct tcpConn *c);
     char *(*getAddrinfo)(struct tcpConn *c);
     void *data;
-    char addrinfo[ADDR_INFO_STR_LEN];
-    char addrinfo_peer[ADDR_INFO_STR_LEN];
-    sockAddrEx rsa; // For connect check
+    sockAddrEx rsa; // Peer address, formatted only on demand
     char *rbuf;
     int rbuf_len;
     int rbuf_off;
     char *wbuf;
     int wbuf_len;
     int err;
-    char errstr[XS_ERR_LEN];
+    char *errstr; // Shared by the conns, valid right after the error
     struct tcpConn *pipe;
+    struct tcpRace *race; // Happy Eyeballs attempts while connecting
+    struct resolverQuery *query; // Host lookup in flight, fd is -1 until it is done
+    netSockOpts *sockopts;
+    uint64_t active_time; // Last read or write in microseconds
+    dlistNode idle; // On the idle list while a stream has an idle timeout
 } tcpConn;
 
-tcpListener *tcpListen(char *err, eventLoop *el, char *host, int port, void *data,
+tcpListener *tcpListen(char *err, eventLoop *el, char *host, int port, int backlog, void *data,
                        tcpEventHandler onAccept);
 
 tcpConn *tcpAccept(char *err, eventLoop *el, int fd, int timeout, void *data);
 tcpConn *tcpConnect(char *err, eventLoop *el, char *host, int port, int timeout, void *data);
+tcpConn *tcpConnectAddr(char *err, eventLoop *el, char *host, sockAddrEx *addrs, int naddrs,
+                        int timeout, void *data);
+void tcpSetAddrFilter(tcpAddrFilter filter);
 int tcpSetTimeout(tcpConn *c, int timeout);
+int tcpSetIdleTimeout(tcpConn *c, int timeout);
+void tcpSetStream(tcpConn *c);
+void tcpSetPriority(tcpConn *c, int priority);
+void tcpPause(tcpConn *c);
+void tcpResume(tcpConn *c);
+int tcpSetSockOpts(char *err, tcpConn *c, netSockOpts *opts);
+int tcpDetach(tcpConn *c, int timeout, void *data);
 int tcpIsConnected(tcpConn *c);
 int tcpPipe(tcpConn *src, tcpConn *dst);
 
@@ -104,4 +125,7 @@ int tcpRead(tcpConn *c, char *buf, int buf_len);
 int tcpWrite(tcpConn *c, char *buf, int buf_len);
 char *tcpGetAddrinfo(tcpConn *c);
 
+int tcpConnCount();
+int tcpReapIdle(int timeout);
+
 #endif /* __PROTOCOL_TCP_H */
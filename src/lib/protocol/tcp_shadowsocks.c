@@ -21,18 +21,27 @@
 
 #include "socks5.h"
 
+#include "shadowsocks-libev/aead.h"
+
 static void tcpShadowsocksConnFree(tcpConn *conn);
 static int tcpShadowsocksConnRead(tcpConn *conn, char *buf, int buf_len);
 static int tcpShadowsocksConnWrite(tcpConn *conn, char *buf, int buf_len);
+static int tcpShadowsocksStreamRead(tcpConn *conn, char *buf, int buf_len);
+static int tcpShadowsocksStreamWrite(tcpConn *conn, char *buf, int buf_len);
+static void tcpShadowsocksSetStream(tcpShadowsocksConn *c);
 static char *tcpShadowsocksGetAddrinfo(tcpConn *conn);
+static cipher_ctx_t *tcpShadowsocksCtxNew(tcpShadowsocksConn *c, int enc);
+static void tcpShadowsocksCtxFree(tcpShadowsocksConn *c, cipher_ctx_t **ctx);
+static int tcpShadowsocksReject(tcpShadowsocksConn *c, int err, char *errstr);
 
+/*
+ Nothing but the conn itself is allocated here. The cipher ctxs and wbuf come with
+ the first read or write, so a peer without the key never gets them on the server.
+ */
 tcpShadowsocksConn *tcpShadowsocksConnNew(tcpConn *conn, crypto_t *crypto) {
-    tcpShadowsocksConn *c;
-
-    c = xs_realloc(conn, sizeof(*c));
-    if (!c) return c;
+    tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
 
-    conn = &c->conn;
+    assert(sizeof(*c) <= TCP_CONN_SIZE);
 
     conn->read = tcpShadowsocksConnRead;
     conn->write = tcpShadowsocksConnWrite;
@@ -42,20 +51,6 @@ tcpShadowsocksConn *tcpShadowsocksConnNew(tcpConn *conn, crypto_t *crypto) {
     c->crypto = crypto;
     c->state = SHADOWSOCKS_STATE_INIT;
 
-    c->e_ctx = xs_calloc(sizeof(*c->e_ctx));
-    c->d_ctx = xs_calloc(sizeof(*c->d_ctx));
-
-    c->crypto->ctx_init(c->crypto->cipher, c->e_ctx, 1);
-    c->crypto->ctx_init(c->crypto->cipher, c->d_ctx, 0);
-
-    c->addrbuf_dest = xs_calloc(sizeof(*c->addrbuf_dest));
-    balloc(c->addrbuf_dest, IOBUF_MIN_LEN);
-
-    c->tmp_buf = xs_calloc(sizeof(*c->tmp_buf));
-    balloc(c->tmp_buf, NET_IOBUF_LEN);
-    c->tmp_buf->len = 0;
-    c->tmp_buf_off = 0;
-
     tcpInit(conn);
 
     return c;
@@ -67,52 +62,115 @@ int tcpShadowsocksConnInit(tcpShadowsocksConn *conn, char *host, int port) {
 
     socks5AddrCreate(NULL, host, port, addr, &addr_len);
 
-    memcpy(conn->addrbuf_dest->data, addr, addr_len);
-    conn->addrbuf_dest->len = addr_len;
+    memcpy(conn->addrbuf_dest, addr, addr_len);
+    conn->addrbuf_dest_len = addr_len;
 
-    anetFormatAddr(conn->addrinfo_dest, ADDR_INFO_STR_LEN, host, port);
 
     return TCP_OK;
 }
 
 static char *tcpShadowsocksGetAddrinfo(tcpConn *conn) {
     tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
-    return c->state == SHADOWSOCKS_STATE_STREAM ? c->addrinfo_dest : tcpGetAddrinfo(conn);
+    char host[HOSTNAME_MAX_LEN];
+    int host_len = sizeof(host);
+    int port;
+
+    if (c->state != SHADOWSOCKS_STATE_STREAM ||
+        socks5AddrParse(c->addrbuf_dest, c->addrbuf_dest_len, NULL, host, &host_len, &port) ==
+            SOCKS5_ERR)
+        return tcpGetAddrinfo(conn);
+
+    return netFormatAddr(host, port);
 }
 
 static void tcpShadowsocksConnFree(tcpConn *conn) {
     tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
     if (!c) return;
 
-    c->crypto->ctx_release(c->e_ctx);
-    c->crypto->ctx_release(c->d_ctx);
-    xs_free(c->e_ctx);
-    xs_free(c->d_ctx);
-
-    bfree(c->tmp_buf);
-    bfree(c->addrbuf_dest);
-    xs_free(c->tmp_buf);
-    xs_free(c->addrbuf_dest);
+    tcpShadowsocksCtxFree(c, &c->e_ctx);
+    tcpShadowsocksCtxFree(c, &c->d_ctx);
+    ioBufRelease(c->wbuf);
 
     tcpClose(conn);
 }
 
+static cipher_ctx_t *tcpShadowsocksCtxNew(tcpShadowsocksConn *c, int enc) {
+    cipher_ctx_t *ctx = xs_calloc(sizeof(*ctx));
+    if (!ctx) return NULL;
+
+    c->crypto->ctx_init(c->crypto->cipher, ctx, enc);
+
+    return ctx;
+}
+
+static void tcpShadowsocksCtxFree(tcpShadowsocksConn *c, cipher_ctx_t **ctx) {
+    if (!*ctx) return;
+
+    c->crypto->ctx_release(*ctx);
+    xs_free(*ctx);
+    *ctx = NULL;
+}
+
+/*
+ The first chunk failed the tag, the replay filter or the addr parse. The cipher state
+ is dropped and the peer is drained until SHADOWSOCKS_DRAIN_MAX or the handshake
+ timeout, an instant close would tell a prober where the check is.
+ */
+static int tcpShadowsocksReject(tcpShadowsocksConn *c, int err, char *errstr) {
+    tcpConn *conn = &c->conn;
+
+    tcpShadowsocksCtxFree(c, &c->d_ctx);
+    c->state = SHADOWSOCKS_STATE_REJECT;
+    c->drained = 0;
+
+    conn->err = err;
+    xs_error(conn->errstr, "%s", errstr);
+    FIRE_ERROR(conn);
+
+    return 0;
+}
+
 static int tcpShadowsocksConnRead(tcpConn *conn, char *buf, int buf_len) {
     tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
+    int len = buf_len;
     int nread;
+    int rc;
 
-    if (c->state == SHADOWSOCKS_STATE_HANDSHAKE) c->state = SHADOWSOCKS_STATE_STREAM;
+    if (c->state == SHADOWSOCKS_STATE_HANDSHAKE) tcpShadowsocksSetStream(c);
 
-    nread = tcpRead(conn, buf, buf_len);
+    // As in tcpShadowsocksStreamRead, what is left over plus the read decrypts into buf
+    if (c->d_ctx && aead_is_crypto(c->crypto) && buf_len >= SHADOWSOCKS_CHUNK_MAX)
+        len = aead_decrypt_room(c->d_ctx, buf_len);
+
+    nread = tcpRead(conn, buf, len);
     if (nread <= 0) return nread;
 
+    if (c->state == SHADOWSOCKS_STATE_REJECT) {
+        c->drained += nread;
+        if (c->drained < SHADOWSOCKS_DRAIN_MAX) return 0;
+
+        conn->err = ERROR_SHADOWSOCKS_AUTH;
+        FIRE_CLOSE(conn);
+        return TCP_ERR;
+    }
+
+    if (!c->d_ctx && (c->d_ctx = tcpShadowsocksCtxNew(c, 0)) == NULL) {
+        conn->err = ERROR_SHADOWSOCKS_DECRYPT;
+        xs_error(conn->errstr, "Shadowsocks cipher ctx is NULL, please check the memory");
+        goto error;
+    }
+
     buffer_t tmp_buf = {.idx = 0, .len = nread, .capacity = buf_len, .data = buf};
-    if (c->crypto->decrypt(&tmp_buf, c->d_ctx, tmp_buf.capacity)) {
+    rc = c->crypto->decrypt(&tmp_buf, c->d_ctx, tmp_buf.capacity);
+    if (rc == CRYPTO_ERROR) {
+        if (c->state == SHADOWSOCKS_STATE_INIT)
+            return tcpShadowsocksReject(c, ERROR_SHADOWSOCKS_AUTH,
+                                        "Authenticate shadowsocks first chunk error");
         conn->err = ERROR_SHADOWSOCKS_DECRYPT;
         xs_error(conn->errstr, "Decrypt shadowsocks stream buffer error");
         goto error;
     }
-    nread = tmp_buf.len;
+    nread = rc == CRYPTO_NEED_MORE ? 0 : (int)tmp_buf.len;
 
     if (c->state == SHADOWSOCKS_STATE_INIT) {
         char host[HOSTNAME_MAX_LEN];
@@ -120,11 +178,10 @@ static int tcpShadowsocksConnRead(tcpConn *conn, char *buf, int buf_len) {
         int port;
         int addr_len;
 
-        if ((addr_len = socks5AddrParse(buf, nread, NULL, host, &host_len, &port)) == SOCKS5_ERR) {
-            conn->err = ERROR_SHADOWSOCKS_SOCKS5;
-            xs_error(conn->errstr, "Parse shadowsocks socks5 addr error");
-            goto error;
-        }
+        if (nread == 0) return 0;
+        if ((addr_len = socks5AddrParse(buf, nread, NULL, host, &host_len, &port)) == SOCKS5_ERR)
+            return tcpShadowsocksReject(c, ERROR_SHADOWSOCKS_SOCKS5,
+                                        "Parse shadowsocks socks5 addr error");
 
         tcpShadowsocksConnInit(c, host, port);
         c->state = SHADOWSOCKS_STATE_HANDSHAKE;
@@ -138,53 +195,140 @@ error:
     return TCP_ERR;
 }
 
+/*
+ A chunk is encrypted in place in wbuf, with the dest addr of the handshake prepended
+ to the first one. Returns the plaintext bytes taken from buf once their chunk is all
+ on the wire, or 0 while it is still pending and buf has to be passed again.
+ */
 static int tcpShadowsocksConnWrite(tcpConn *conn, char *buf, int buf_len) {
     tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
+    ioBuf *wbuf = c->wbuf;
     int nwrite;
 
-    if (c->state == SHADOWSOCKS_STATE_INIT) {
-        if (c->crypto->encrypt(c->addrbuf_dest, c->e_ctx, c->addrbuf_dest->capacity)) {
+    if (c->state == SHADOWSOCKS_STATE_HANDSHAKE) tcpShadowsocksSetStream(c);
+
+    if (!wbuf) {
+        c->wbuf = wbuf = ioBufNew(SOCKS5_ADDR_MAX_LEN + SHADOWSOCKS_CHUNK_MAX + SHADOWSOCKS_TAILROOM,
+                                  SOCKS5_ADDR_MAX_LEN);
+        c->e_ctx = tcpShadowsocksCtxNew(c, 1);
+        if (!wbuf || !c->e_ctx) {
             conn->err = ERROR_SHADOWSOCKS_ENCRYPT;
-            xs_error(conn->errstr, "Encrypt shadowsocks handshake buffer error");
-            goto error;
-        }
-        nwrite = tcpWrite(conn, c->addrbuf_dest->data, c->addrbuf_dest->len);
-        if (nwrite < 0)
-            return nwrite;
-        else if (nwrite != (int)c->addrbuf_dest->len) {
-            xs_error(conn->errstr, "Write shadowsocks handshake buffer error");
+            xs_error(conn->errstr, "Shadowsocks wbuf is NULL, please check the memory");
             goto error;
         }
+    }
 
-        c->state = SHADOWSOCKS_STATE_HANDSHAKE;
-    } else if (c->state == SHADOWSOCKS_STATE_HANDSHAKE)
-        c->state = SHADOWSOCKS_STATE_STREAM;
+    if (wbuf->len == 0) {
+        // The dest addr shares the first chunk with the payload
+        int max = SHADOWSOCKS_CHUNK_MAX;
+        if (c->state == SHADOWSOCKS_STATE_INIT) max -= c->addrbuf_dest_len;
 
-    if (c->tmp_buf->len == 0) {
-        memcpy(c->tmp_buf->data, buf, buf_len);
-        c->tmp_buf->len = buf_len;
+        ioBufReset(wbuf, SOCKS5_ADDR_MAX_LEN);
+        c->wbuf_consumed = ioBufAppend(wbuf, buf, MIN(buf_len, max));
 
-        if (c->crypto->encrypt(c->tmp_buf, c->e_ctx, c->tmp_buf->capacity)) {
+        if (c->state == SHADOWSOCKS_STATE_INIT) {
+            ioBufPrepend(wbuf, c->addrbuf_dest, c->addrbuf_dest_len);
+            c->state = SHADOWSOCKS_STATE_HANDSHAKE;
+        }
+
+        buffer_t tmp_buf = {.idx = 0,
+                            .len = wbuf->len,
+                            .capacity = wbuf->len + IOBUF_TAILROOM(wbuf),
+                            .data = IOBUF_DATA(wbuf)};
+        if (c->crypto->encrypt(&tmp_buf, c->e_ctx, tmp_buf.capacity)) {
             conn->err = ERROR_SHADOWSOCKS_ENCRYPT;
             xs_error(conn->errstr, "Encrypt shadowsocks stream buffer error");
             goto error;
         }
+        wbuf->len = tmp_buf.len;
     }
 
-    char *wbuf = c->tmp_buf->data + c->tmp_buf_off;
-    int wbuf_len = c->tmp_buf->len - c->tmp_buf_off;
+    nwrite = tcpWrite(conn, IOBUF_DATA(wbuf), wbuf->len);
+    if (nwrite == TCP_ERR) return nwrite;
 
-    nwrite = tcpWrite(conn, wbuf, wbuf_len);
-    if (nwrite == wbuf_len) {
-        c->tmp_buf->len = 0;
-        c->tmp_buf_off = 0;
-    } else if (nwrite > 0 && nwrite < wbuf_len) {
-        c->tmp_buf_off += nwrite;
-    }
-    return nwrite;
+    ioBufConsume(wbuf, nwrite);
+    return wbuf->len == 0 ? c->wbuf_consumed : 0;
 
 error:
     FIRE_ERROR(conn);
     FIRE_CLOSE(conn);
     return TCP_ERR;
 }
+
+/*
+ The relay handlers are picked once here. Those of an AEAD stream decrypt the chunks
+ from the cipher ctx straight into buf and encrypt buf straight into wbuf, without the
+ buffer_t copies of the generic crypto calls.
+ */
+static void tcpShadowsocksSetStream(tcpShadowsocksConn *c) {
+    tcpConn *conn = &c->conn;
+
+    c->state = SHADOWSOCKS_STATE_STREAM;
+    tcpSetStream(conn);
+
+    if (aead_is_crypto(c->crypto)) {
+        conn->read = tcpShadowsocksStreamRead;
+        conn->write = tcpShadowsocksStreamWrite;
+    }
+}
+
+/*
+ Until the first chunk has passed the salt check, the generic read does it. No more is
+ read than all the chunks buffered can be decrypted into buf, the rest waits in the
+ socket, so none is left buffered for a read event that may never come.
+ */
+static int tcpShadowsocksStreamRead(tcpConn *conn, char *buf, int buf_len) {
+    tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
+    size_t plen;
+    int nread;
+    int rc;
+
+    if (!aead_ctx_ready(c->d_ctx) || buf_len < SHADOWSOCKS_CHUNK_MAX)
+        return tcpShadowsocksConnRead(conn, buf, buf_len);
+
+    nread = tcpRead(conn, buf, aead_decrypt_room(c->d_ctx, buf_len));
+    if (nread <= 0) return nread;
+
+    rc = aead_decrypt_chunks(c->d_ctx, buf, nread, buf, &plen, buf_len);
+    if (rc == CRYPTO_ERROR) {
+        conn->err = ERROR_SHADOWSOCKS_DECRYPT;
+        xs_error(conn->errstr, "Decrypt shadowsocks stream buffer error");
+        FIRE_ERROR(conn);
+        FIRE_CLOSE(conn);
+        return TCP_ERR;
+    }
+
+    return rc == CRYPTO_NEED_MORE ? 0 : (int)plen;
+}
+
+/*
+ Same contract as tcpShadowsocksConnWrite, the salt comes with the first chunk
+ */
+static int tcpShadowsocksStreamWrite(tcpConn *conn, char *buf, int buf_len) {
+    tcpShadowsocksConn *c = (tcpShadowsocksConn *)conn;
+    ioBuf *wbuf = c->wbuf;
+    size_t clen;
+    int nwrite;
+
+    if (!wbuf) return tcpShadowsocksConnWrite(conn, buf, buf_len);
+
+    if (wbuf->len == 0) {
+        ioBufReset(wbuf, 0);
+        c->wbuf_consumed = MIN(buf_len, SHADOWSOCKS_CHUNK_MAX);
+
+        if (aead_encrypt_chunk(c->e_ctx, buf, c->wbuf_consumed, IOBUF_DATA(wbuf), &clen)) {
+            conn->err = ERROR_SHADOWSOCKS_ENCRYPT;
+            xs_error(conn->errstr, "Encrypt shadowsocks stream buffer error");
+            FIRE_ERROR(conn);
+            FIRE_CLOSE(conn);
+            return TCP_ERR;
+        }
+        wbuf->len = clen;
+    }
+
+    nwrite = tcpWrite(conn, IOBUF_DATA(wbuf), wbuf->len);
+    if (nwrite == TCP_ERR) return nwrite;
+
+    ioBufConsume(wbuf, nwrite);
+    return wbuf->len == 0 ? c->wbuf_consumed : 0;
+}
@@ -21,24 +21,27 @@
 #define __PROTOCOL_TCP_SHADOWSOCKS_H
 
 #include "shadowsocks.h"
+#include "socks5.h"
 #include "tcp.h"
 
 enum {
     SHADOWSOCKS_STATE_INIT = 0,
     SHADOWSOCKS_STATE_HANDSHAKE,
     SHADOWSOCKS_STATE_STREAM,
+    SHADOWSOCKS_STATE_REJECT, // The first chunk failed, drained until closed
 };
 
 typedef struct tcpShadowsocksConn {
     tcpConn conn;
     int state;
-    buffer_t *tmp_buf;
-    int tmp_buf_off;
-    buffer_t *addrbuf_dest;
-    char addrinfo_dest[ADDR_INFO_STR_LEN];
+    ioBuf *wbuf;       // Ciphertext of the chunk being written, allocated on the first write
+    int wbuf_consumed; // Plaintext bytes carried by that chunk
+    int drained;       // Bytes read since rejected
+    char addrbuf_dest[SOCKS5_ADDR_MAX_LEN];
+    int addrbuf_dest_len;
     crypto_t *crypto;
-    cipher_ctx_t *e_ctx;
-    cipher_ctx_t *d_ctx;
+    cipher_ctx_t *e_ctx; // Allocated on the first write
+    cipher_ctx_t *d_ctx; // Allocated on the first read
 } tcpShadowsocksConn;
 
 tcpShadowsocksConn *tcpShadowsocksConnNew(tcpConn *conn, crypto_t *crypto);
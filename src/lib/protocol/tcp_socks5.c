@@ -25,12 +25,9 @@ static int tcpSocks5ConnWrite(tcpConn *conn, char *buf, int buf_len);
 static char *tcpSocks5GetAddrinfo(tcpConn *conn);
 
 tcpSocks5Conn *tcpSocks5ConnNew(tcpConn *conn) {
-    tcpSocks5Conn *c;
-
-    c = xs_realloc(conn, sizeof(*c));
-    if (!c) return c;
+    tcpSocks5Conn *c = (tcpSocks5Conn *)conn;
 
-    conn = &c->conn;
+    assert(sizeof(*c) <= TCP_CONN_SIZE);
 
     c->state = SOCKS5_STATE_INIT;
     c->flags = SOCKS5_FLAG_SERVER;
@@ -47,14 +44,22 @@ tcpSocks5Conn *tcpSocks5ConnNew(tcpConn *conn) {
 
 int tcpSocks5ConnInit(tcpSocks5Conn *conn, char *host, int port) {
     conn->addrbuf_dest = socks5AddrInit(NULL, host, port);
-    anetFormatAddr(conn->addrinfo_dest, ADDR_INFO_STR_LEN, host, port);
 
     return TCP_OK;
 }
 
 static char *tcpSocks5GetAddrinfo(tcpConn *conn) {
     tcpSocks5Conn *c = (tcpSocks5Conn *)conn;
-    return c->state == SOCKS5_STATE_STREAM ? c->addrinfo_dest : tcpGetAddrinfo(conn);
+    char host[HOSTNAME_MAX_LEN];
+    int host_len = sizeof(host);
+    int port;
+
+    if (c->state != SOCKS5_STATE_STREAM ||
+        socks5AddrParse(c->addrbuf_dest, sdslen(c->addrbuf_dest), NULL, host, &host_len, &port) ==
+            SOCKS5_ERR)
+        return tcpGetAddrinfo(conn);
+
+    return netFormatAddr(host, port);
 }
 
 static void tcpSocks5ConnFree(tcpConn *conn) {
@@ -192,8 +197,17 @@ static int tcpSocks5ConnWrite(tcpConn *conn, char *buf, int buf_len) {
         }
 
         c->state = SOCKS5_STATE_STREAM;
+        tcpSetStream(conn);
+
+        // Nothing is left to parse, the relay goes to the socket directly
+        conn->read = tcpRead;
+        conn->write = tcpWrite;
 
-        anetDisableTcpNoDelay(NULL, conn->fd);
+        // The relay gets the no_delay of the conn profile, as tcpConnInit applies it
+        if (conn->sockopts)
+            netSetSockOpts(NULL, conn->fd, conn->sockopts);
+        else
+            anetDisableTcpNoDelay(NULL, conn->fd);
 
         return nwrite;
     }
@@ -45,7 +45,6 @@ typedef struct tcpSocks5Conn {
     int flags;
     int state;
     sds addrbuf_dest;
-    char addrinfo_dest[ADDR_INFO_STR_LEN];
 } tcpSocks5Conn;
 
 tcpSocks5Conn *tcpSocks5ConnNew(tcpConn *conn);
@@ -24,6 +24,13 @@ static udpConn *udpConnNew(int fd, int timeout, eventLoop *el, void *data);
 static void udpConnReadHandler(event *e);
 static void udpConnTimeoutHandler(event *e);
 
+static void udpIdleLink(udpConn *c);
+static void udpIdleUnlink(udpConn *c);
+static void udpIdleTouch(udpConn *c);
+
+static int conn_count;
+static dlist idle_list; // Least recently active first
+
 udpConn *udpCreate(char *err, eventLoop *el, char *host, int port, int ipv6_first, int timeout,
                    void *data) {
     int fd = ANET_ERR;
@@ -55,6 +62,7 @@ udpConn *udpCreate(char *err, eventLoop *el, char *host, int port, int ipv6_firs
 int udpInit(udpConn *c) {
     c->re = NEW_EVENT_READ(c->fd, udpConnReadHandler, c);
     udpSetTimeout(c, c->timeout);
+    if (c->timeout > 0) udpIdleLink(c);
 
     ADD_EVENT_READ(c);
 
@@ -64,9 +72,15 @@ int udpInit(udpConn *c) {
 static udpConn *udpConnNew(int fd, int timeout, eventLoop *el, void *data) {
     udpConn *c;
 
-    c = xs_calloc(sizeof(*c));
+    c = xs_calloc(UDP_CONN_SIZE);
     if (!c) return NULL;
 
+    c->rbuf = ioBufNew(UDP_BUF_HEADROOM + NET_IOBUF_LEN + UDP_BUF_TAILROOM, UDP_BUF_HEADROOM);
+    if (!c->rbuf) {
+        xs_free(c);
+        return NULL;
+    }
+
     c->fd = fd;
     c->timeout = timeout;
     c->el = el;
@@ -76,20 +90,21 @@ static udpConn *udpConnNew(int fd, int timeout, eventLoop *el, void *data) {
     c->write = udpWrite;
     c->close = udpClose;
     c->getAddrinfo = udpGetAddrinfo;
+    c->errstr = errorBuffer();
 
     anetNonBlock(NULL, c->fd);
-    anetFormatSock(fd, c->addrinfo, sizeof(c->addrinfo));
+    conn_count++;
 
     return c;
 }
 
 int udpSetTimeout(udpConn *c, int timeout) {
-    if (timeout <= 0 || timeout != c->timeout) CLR_EVENT_TIME(c);
+    CLR_EVENT_TIME(c);
+    c->timeout = timeout;
     if (timeout > 0) {
-        c->te = NEW_EVENT_ONCE(c->timeout * MILLISECOND_UNIT, udpConnTimeoutHandler, c);
+        c->te = NEW_EVENT_ONCE(timeout * MILLISECOND_UNIT, udpConnTimeoutHandler, c);
         ADD_EVENT_TIME(c);
     }
-    c->timeout = timeout;
 
     return UDP_OK;
 }
@@ -97,19 +112,28 @@ int udpSetTimeout(udpConn *c, int timeout) {
 void udpClose(udpConn *c) {
     if (!c) return;
 
+    udpIdleUnlink(c);
+    conn_count--;
     CLR_EVENT_READ(c);
     CLR_EVENT_TIME(c);
     close(c->fd);
 
+    ioBufRelease(c->rbuf);
     xs_free(c);
 }
 
-int udpRead(udpConn *c, char *buf, int buf_len, sockAddrEx *sa) {
+/*
+ Read a datagram as the payload of b, the headroom and tailroom are left for the
+ protocol layers to work in place
+ */
+int udpRead(udpConn *c, ioBuf *b, sockAddrEx *sa) {
     int nread;
 
     DEL_EVENT_TIME(c);
 
-    nread = netUdpRead(c->errstr, c->fd, buf, buf_len, sa);
+    ioBufReset(b, UDP_BUF_HEADROOM);
+    nread =
+        netUdpRead(c->errstr, c->fd, IOBUF_DATA(b), IOBUF_TAILROOM(b) - UDP_BUF_TAILROOM, sa);
     if (nread == NET_ERR) {
         c->err = UDP_ERROR_READ;
         FIRE_ERROR(c);
@@ -121,16 +145,18 @@ int udpRead(udpConn *c, char *buf, int buf_len, sockAddrEx *sa) {
         return UDP_ERR;
     }
 
+    b->len = nread;
     ADD_EVENT_TIME(c);
+    udpIdleTouch(c);
 
     return nread;
 }
 
-int udpWrite(udpConn *c, char *buf, int buf_len, sockAddrEx *sa) {
+int udpWrite(udpConn *c, ioBuf *b, sockAddrEx *sa) {
     int nwrite;
 
-    nwrite = netUdpWrite(c->errstr, c->fd, buf, buf_len, sa);
-    if (nwrite != buf_len) {
+    nwrite = netUdpWrite(c->errstr, c->fd, IOBUF_DATA(b), b->len, sa);
+    if (nwrite != b->len) {
         c->err = UDP_ERROR_WRITE;
         FIRE_ERROR(c);
         FIRE_CLOSE(c);
@@ -141,7 +167,54 @@ int udpWrite(udpConn *c, char *buf, int buf_len, sockAddrEx *sa) {
 }
 
 char *udpGetAddrinfo(udpConn *c) {
-    return c->addrinfo;
+    return netFormatSock(c->fd);
+}
+
+int udpConnCount() {
+    return conn_count;
+}
+
+/*
+ Close the conns without a datagram for timeout seconds, the least recently active first
+ */
+int udpReapIdle(int timeout) {
+    uint64_t now = timerStart();
+    int reaped = 0;
+    udpConn *c;
+
+    while ((c = DLIST_ENTRY(idle_list.head, udpConn, idle)) != NULL &&
+           now - c->active_time >= (uint64_t)timeout * MICROSECOND_UNIT) {
+
+        udpIdleUnlink(c);
+        if (!c->onClose) continue;
+
+        LOGI("UDP conn %s idle for %ds is reclaimed", CONN_GET_ADDRINFO(c),
+             (int)((now - c->active_time) / MICROSECOND_UNIT));
+        c->err = UDP_ERROR_TIMEOUT;
+        xs_error(c->errstr, "UDP conn idle reclaimed");
+        reaped++;
+
+        FIRE_TIMEOUT(c);
+        FIRE_CLOSE(c);
+    }
+
+    return reaped;
+}
+
+static void udpIdleLink(udpConn *c) {
+    c->active_time = timerStart();
+    dlistPushTail(&idle_list, &c->idle);
+}
+
+static void udpIdleUnlink(udpConn *c) {
+    dlistUnlink(&idle_list, &c->idle);
+}
+
+static void udpIdleTouch(udpConn *c) {
+    if (!dlistIsLinked(&idle_list, &c->idle)) return;
+
+    udpIdleUnlink(c);
+    udpIdleLink(c);
 }
 
 static void udpConnReadHandler(event *e) {
@@ -32,10 +32,14 @@ enum {
     UDP_ERROR_CLOSED = 10003,
 };
 
+#define UDP_BUF_HEADROOM 320  /* Room for the headers prepended in place, e.g. socks5 addr */
+#define UDP_BUF_TAILROOM 128  /* Room for the cipher to grow the payload in place */
+#define UDP_CONN_SIZE 512     /* Bytes of every conn, the protocol conns extend udpConn in place */
+
 struct udpConn;
 
 typedef void (*udpEventHandler)(void *data);
-typedef int (*udpIoHandler)(struct udpConn *conn, char *buf, int buf_len, sockAddrEx *sa);
+typedef int (*udpIoHandler)(struct udpConn *conn, ioBuf *b, sockAddrEx *sa);
 
 typedef struct udpConn {
     int fd;
@@ -53,9 +57,11 @@ typedef struct udpConn {
     void (*close)(struct udpConn *c);
     char *(*getAddrinfo)(struct udpConn *c);
     void *data;
-    char addrinfo[ADDR_INFO_STR_LEN];
+    ioBuf *rbuf; // Datagrams are read into and relayed from here
     int err;
-    char errstr[XS_ERR_LEN];
+    char *errstr; // Shared by the conns, valid right after the error
+    uint64_t active_time; // Last datagram in microseconds
+    dlistNode idle; // On the idle list while the conn has a timeout
 } udpConn;
 
 udpConn *udpCreate(char *err, eventLoop *el, char *host, int port, int ipv6_first, int timeout,
@@ -64,8 +70,11 @@ int udpSetTimeout(udpConn *c, int timeout);
 
 int udpInit(udpConn *c);
 void udpClose(udpConn *c);
-int udpRead(udpConn *c, char *buf, int buf_len, sockAddrEx *sa);
-int udpWrite(udpConn *c, char *buf, int buf_len, sockAddrEx *sa);
+int udpRead(udpConn *c, ioBuf *b, sockAddrEx *sa);
+int udpWrite(udpConn *c, ioBuf *b, sockAddrEx *sa);
 char *udpGetAddrinfo(udpConn *c);
 
+int udpConnCount();
+int udpReapIdle(int timeout);
+
 #endif /* __PROTOCOL_UDP_H */
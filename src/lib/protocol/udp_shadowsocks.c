@@ -22,16 +22,13 @@
 #include "socks5.h"
 
 static void udpShadowsocksConnFree(udpConn *conn);
-static int udpShadowsocksConnRead(udpConn *conn, char *buf, int buf_len, sockAddrEx *sa);
-static int udpShadowsocksConnWrite(udpConn *conn, char *buf, int buf_len, sockAddrEx *sa);
+static int udpShadowsocksConnRead(udpConn *conn, ioBuf *b, sockAddrEx *sa);
+static int udpShadowsocksConnWrite(udpConn *conn, ioBuf *b, sockAddrEx *sa);
 
 udpShadowsocksConn *udpShadowsocksConnNew(udpConn *conn, crypto_t *crypto) {
-    udpShadowsocksConn *c;
-
-    c = xs_realloc(conn, sizeof(*c));
-    if (!c) return c;
+    udpShadowsocksConn *c = (udpShadowsocksConn *)conn;
 
-    conn = &c->conn;
+    assert(sizeof(*c) <= UDP_CONN_SIZE);
 
     conn->read = udpShadowsocksConnRead;
     conn->write = udpShadowsocksConnWrite;
@@ -39,9 +36,6 @@ udpShadowsocksConn *udpShadowsocksConnNew(udpConn *conn, crypto_t *crypto) {
 
     c->crypto = crypto;
 
-    c->addrbuf_dest = xs_calloc(sizeof(*c->addrbuf_dest));
-    balloc(c->addrbuf_dest, IOBUF_MIN_LEN);
-
     udpInit(conn);
 
     return c;
@@ -53,8 +47,8 @@ int udpShadowsocksConnInit(udpShadowsocksConn *conn, char *host, int port) {
 
     socks5AddrCreate(NULL, host, port, addr, &addr_len);
 
-    memcpy(conn->addrbuf_dest->data, addr, addr_len);
-    conn->addrbuf_dest->len = addr_len;
+    memcpy(conn->addrbuf_dest, addr, addr_len);
+    conn->addrbuf_dest_len = addr_len;
 
     return UDP_OK;
 }
@@ -63,42 +57,42 @@ static void udpShadowsocksConnFree(udpConn *conn) {
     udpShadowsocksConn *c = (udpShadowsocksConn *)conn;
     if (!c) return;
 
-    bfree(c->addrbuf_dest);
-    xs_free(c->addrbuf_dest);
-
     udpClose(&c->conn);
 }
 
-static int udpShadowsocksConnRead(udpConn *conn, char *buf, int buf_len, sockAddrEx *sa) {
+static int udpShadowsocksConnRead(udpConn *conn, ioBuf *b, sockAddrEx *sa) {
     udpShadowsocksConn *c = (udpShadowsocksConn *)conn;
     int nread;
 
-    nread = udpRead(conn, buf, buf_len, sa);
+    nread = udpRead(conn, b, sa);
     if (nread == UDP_ERR) return UDP_ERR;
 
-    buffer_t tmp_buf = {.idx = 0, .len = nread, .capacity = buf_len, .data = buf};
+    buffer_t tmp_buf = {
+        .idx = 0, .len = b->len, .capacity = b->len + IOBUF_TAILROOM(b), .data = IOBUF_DATA(b)};
     if (c->crypto->decrypt_all(&tmp_buf, c->crypto->cipher, tmp_buf.capacity) != CRYPTO_OK) {
         conn->err = ERROR_SHADOWSOCKS_DECRYPT;
         xs_error(conn->errstr, "Decrypt UDP shadowsocks buffer error");
         goto error;
     }
-    nread = tmp_buf.len;
+    b->len = tmp_buf.len;
 
     char host[HOSTNAME_MAX_LEN];
     int host_len = sizeof(host);
     int port;
     int addr_len;
 
-    if ((addr_len = socks5AddrParse(buf, nread, NULL, host, &host_len, &port)) == SOCKS5_ERR) {
+    if ((addr_len = socks5AddrParse(IOBUF_DATA(b), b->len, NULL, host, &host_len, &port)) ==
+        SOCKS5_ERR) {
         conn->err = ERROR_SHADOWSOCKS_SOCKS5;
         xs_error(conn->errstr, "Parse shadowsocks socks5 addr error");
         goto error;
     }
 
-    memmove(buf, buf + addr_len, nread - addr_len);
+    // The addr header goes back to the headroom, no need to move the payload
+    ioBufConsume(b, addr_len);
     udpShadowsocksConnInit(c, host, port);
 
-    return nread - addr_len;
+    return b->len;
 
 error:
     FIRE_ERROR(conn);
@@ -106,33 +100,36 @@ error:
     return UDP_ERR;
 }
 
-static int udpShadowsocksConnWrite(udpConn *conn, char *buf, int buf_len, sockAddrEx *sa) {
+/*
+ The dest addr is prepended and the datagram encrypted in place, b holds the
+ ciphertext afterwards
+ */
+static int udpShadowsocksConnWrite(udpConn *conn, ioBuf *b, sockAddrEx *sa) {
     udpShadowsocksConn *c = (udpShadowsocksConn *)conn;
-    buffer_t tmp_buf;
     int nwrite;
 
-    bzero(&tmp_buf, sizeof(tmp_buf));
-    balloc(&tmp_buf, NET_IOBUF_LEN);
-    memcpy(tmp_buf.data, buf, buf_len);
-    tmp_buf.len = buf_len;
-
-    bprepend(&tmp_buf, c->addrbuf_dest, tmp_buf.capacity);
+    if (IOBUF_TAILROOM(b) < SHADOWSOCKS_TAILROOM ||
+        ioBufPrepend(b, c->addrbuf_dest, c->addrbuf_dest_len) == NULL) {
+        conn->err = ERROR_SHADOWSOCKS_ENCRYPT;
+        xs_error(conn->errstr, "No room to encrypt UDP shadowsocks buffer in place");
+        goto error;
+    }
 
+    buffer_t tmp_buf = {
+        .idx = 0, .len = b->len, .capacity = b->len + IOBUF_TAILROOM(b), .data = IOBUF_DATA(b)};
     if (c->crypto->encrypt_all(&tmp_buf, c->crypto->cipher, tmp_buf.capacity)) {
         conn->err = ERROR_SHADOWSOCKS_ENCRYPT;
         xs_error(conn->errstr, "Encrypt UDP shadowsocks buffer error");
         goto error;
     }
+    b->len = tmp_buf.len;
 
-    nwrite = udpWrite(conn, tmp_buf.data, tmp_buf.len, sa);
+    nwrite = udpWrite(conn, b, sa);
     if (nwrite == UDP_ERR) return UDP_ERR;
 
-    bfree(&tmp_buf);
-
-    return nwrite - c->addrbuf_dest->len;
+    return nwrite - c->addrbuf_dest_len;
 
 error:
-    bfree(&tmp_buf);
     FIRE_ERROR(conn);
     FIRE_CLOSE(conn);
     return UDP_ERR;
@@ -21,11 +21,13 @@
 #define __PROTOCOL_UDP_SHADOWSOCKS_H
 
 #include "shadowsocks.h"
+#include "socks5.h"
 #include "udp.h"
 
 typedef struct udpShadowsocksConn {
     udpConn conn;
-    buffer_t *addrbuf_dest;
+    char addrbuf_dest[SOCKS5_ADDR_MAX_LEN];
+    int addrbuf_dest_len;
     crypto_t *crypto;
 } udpShadowsocksConn;
 